@@ -13,10 +13,26 @@ enum ConfigError parse_app_config(const char *path) {
     app_config.sensor_config[0] = 0;
     app_config.jpeg_enable = false;
     app_config.mp4_enable = false;
+    app_config.mp4_codec_h265 = false;
+    app_config.mp4_low_latency = true;
+    app_config.mp4_fragment_duration = 500;
+    app_config.mp4_preroll = 0;
     app_config.rtsp_enable = false;
+    app_config.rtsp_multicast_group[0] = 0;
+    app_config.rtsp_multicast_port = 5000;
+    app_config.rtsp_multicast_ttl = 16;
+    app_config.rtsp_adaptive_bitrate = false;
+    app_config.rtsp_min_bitrate = 256;
     app_config.osd_enable = false;
     app_config.motion_detect_enable = false;
 
+    app_config.record_enable = false;
+    app_config.record_path[0] = 0;
+    app_config.record_file_duration = 10;
+    app_config.record_buffer_size = 0;
+    app_config.record_quota = 90;
+    app_config.record_quota_percent = true;
+
     app_config.mjpeg_enable = false;
     app_config.mjpeg_fps = 15;
     app_config.mjpeg_width = 640;
@@ -114,6 +130,8 @@ enum ConfigError parse_app_config(const char *path) {
         &app_config.web_server_thread_stack_size);
     if (err != CONFIG_OK)
         goto RET_ERR;
+    parse_int(&ini, "system", "frame_buffer_size", 0, INT_MAX / 1024,
+        &app_config.frame_buffer_size);
 
     err =
         parse_bool(&ini, "night_mode", "enable", &app_config.night_mode_enable);
@@ -189,11 +207,34 @@ enum ConfigError parse_app_config(const char *path) {
     err = parse_bool(&ini, "rtsp", "enable", &app_config.rtsp_enable);
     if (err != CONFIG_OK)
         goto RET_ERR;
+    if (app_config.rtsp_enable) {
+        // Multicast stays off unless a group is given
+        parse_param_value(
+            &ini, "rtsp", "multicast_group", app_config.rtsp_multicast_group);
+        parse_int(&ini, "rtsp", "multicast_port", 1024, 65534,
+            &app_config.rtsp_multicast_port);
+        parse_int(&ini, "rtsp", "multicast_ttl", 1, 255,
+            &app_config.rtsp_multicast_ttl);
+        parse_bool(&ini, "rtsp", "adaptive_bitrate",
+            &app_config.rtsp_adaptive_bitrate);
+        parse_int(&ini, "rtsp", "min_bitrate", 32, INT_MAX,
+            &app_config.rtsp_min_bitrate);
+    }
 
     err = parse_bool(&ini, "mp4", "enable", &app_config.mp4_enable);
     if (err != CONFIG_OK)
         goto RET_ERR;
     if (app_config.mp4_enable) {
+        {
+            // Even entries and 264 are H.264, odd ones and 265 are H.265
+            const char *possible_values[] = {
+                "H.264", "H.265", "H264", "H265", "AVC", "HEVC"};
+            const int count = sizeof(possible_values) / sizeof(const char *);
+            int codec = 0;
+            parse_enum(
+                &ini, "mp4", "codec", &codec, possible_values, count, 0);
+            app_config.mp4_codec_h265 = codec % 2;
+        }
         err = parse_int(
             &ini, "mp4", "width", 160, INT_MAX, &app_config.mp4_width);
         if (err != CONFIG_OK)
@@ -212,6 +253,34 @@ enum ConfigError parse_app_config(const char *path) {
             &ini, "mp4", "bitrate", 32, INT_MAX, &app_config.mp4_bitrate);
         if (err != CONFIG_OK)
             goto RET_ERR;
+        parse_bool(&ini, "mp4", "low_latency", &app_config.mp4_low_latency);
+        parse_int(&ini, "mp4", "fragment_duration", 1, 10000,
+            &app_config.mp4_fragment_duration);
+        parse_int(&ini, "mp4", "preroll", 0, 600, &app_config.mp4_preroll);
+    }
+
+    parse_bool(&ini, "record", "enable", &app_config.record_enable);
+    if (app_config.record_enable) {
+        err = parse_param_value(
+            &ini, "record", "path", app_config.record_path);
+        if (err != CONFIG_OK)
+            goto RET_ERR;
+        parse_int(&ini, "record", "file_duration", 1, 24 * 60,
+            &app_config.record_file_duration);
+        parse_int(&ini, "record", "buffer_size", 0, INT_MAX / 1024,
+            &app_config.record_buffer_size);
+        // Either a share of the card or a size in MB, 0 to only keep room
+        // for the next file
+        char quota[64];
+        if (parse_param_value(&ini, "record", "quota", quota) == CONFIG_OK) {
+            char *end;
+            long value = strtol(quota, &end, 10);
+            bool percent = *end == '%';
+            if (value >= 0 && (!percent || value <= 100)) {
+                app_config.record_quota = value;
+                app_config.record_quota_percent = percent;
+            }
+        }
     }
 
     parse_bool(&ini, "osd", "enable", &app_config.osd_enable);
@@ -7,14 +7,23 @@ struct AppConfig {
     char sensor_config[128];
 
     bool rtsp_enable;
+    char rtsp_multicast_group[128];
+    unsigned int rtsp_multicast_port;
+    unsigned int rtsp_multicast_ttl;
+    bool rtsp_adaptive_bitrate;
+    unsigned int rtsp_min_bitrate;
 
     // [video_0]
     bool mp4_enable;
+    bool mp4_codec_h265;
     unsigned int mp4_fps;
     unsigned int mp4_width;
     unsigned int mp4_height;
     unsigned int mp4_profile;
     unsigned int mp4_bitrate;
+    bool mp4_low_latency;
+    unsigned int mp4_fragment_duration;
+    unsigned int mp4_preroll;
 
     // [jpeg]
     bool jpeg_enable;
@@ -22,6 +31,14 @@ struct AppConfig {
     unsigned int jpeg_height;
     unsigned int jpeg_qfactor;
 
+    // [record]
+    bool record_enable;
+    char record_path[128];
+    unsigned int record_file_duration;
+    unsigned int record_buffer_size;
+    unsigned int record_quota;
+    bool record_quota_percent;
+
     // [mjpeg]
     bool mjpeg_enable;
     unsigned int mjpeg_fps;
@@ -49,6 +66,7 @@ struct AppConfig {
     unsigned int isp_thread_stack_size;
     unsigned int venc_stream_thread_stack_size;
     unsigned int web_server_thread_stack_size;
+    unsigned int frame_buffer_size;
 
     unsigned int align_width;
     unsigned int max_pool_cnt;
@@ -0,0 +1,594 @@
+#include "frame.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// Frames are carved in order out of one buffer and mostly released in the
+// same order, so the pool behaves as a ring: its tail moves up as soon as
+// the oldest frames are let go. Only the encoder thread allocates, the
+// other threads merely drop their references.
+unsigned char *poolBuf = NULL;
+unsigned int poolSize = 0, poolHead = 0, poolTail = 0, poolEnd = 0;
+unsigned int poolUsed = 0;
+bool poolWrapped = false;
+
+int frame_pool_init(unsigned int size) {
+    poolSize = size & ~7;
+    poolBuf = malloc(poolSize);
+    if (!poolBuf) {
+        fprintf(stderr, "Can't allocate a %u bytes frame pool\n", poolSize);
+        poolSize = 0;
+        return EXIT_FAILURE;
+    }
+    poolHead = poolTail = poolUsed = 0;
+    poolEnd = poolSize;
+    poolWrapped = false;
+    return EXIT_SUCCESS;
+}
+
+void frame_pool_free() {
+    free(poolBuf);
+    poolBuf = NULL;
+    poolSize = 0;
+}
+
+static void frame_pool_reclaim() {
+    while (poolUsed) {
+        if (poolWrapped && poolTail == poolEnd) {
+            poolTail = 0;
+            poolEnd = poolSize;
+            poolWrapped = false;
+            continue;
+        }
+        struct Frame *frame = (struct Frame *)(poolBuf + poolTail);
+        if (__atomic_load_n(&frame->refs, __ATOMIC_ACQUIRE))
+            break;
+        poolTail += frame->pool_size;
+        poolUsed -= frame->pool_size;
+    }
+    if (!poolUsed) {
+        poolHead = poolTail = 0;
+        poolEnd = poolSize;
+        poolWrapped = false;
+    }
+}
+
+// Gives NULL when the frames held by slow consumers leave no room, the
+// caller then falls back to the heap
+static struct Frame *frame_pool_alloc(unsigned int size) {
+    if (!poolBuf)
+        return NULL;
+    size = (size + 7) & ~7;
+    frame_pool_reclaim();
+
+    unsigned int pos;
+    if (!poolWrapped && poolSize - poolHead >= size)
+        pos = poolHead;
+    else if (!poolWrapped && poolTail >= size) {
+        poolEnd = poolHead;
+        poolWrapped = true;
+        pos = 0;
+    } else if (poolWrapped && poolTail - poolHead >= size)
+        pos = poolHead;
+    else
+        return NULL;
+
+    poolHead = pos + size;
+    poolUsed += size;
+    struct Frame *frame = (struct Frame *)(poolBuf + pos);
+    frame->pool_size = size;
+    return frame;
+}
+
+static bool frame_is_key_nal(hal_vidcodec codec, unsigned char type) {
+    if (codec == HAL_VIDCODEC_H264)
+        return type == 5 || type == 7;
+    if (codec == HAL_VIDCODEC_H265)
+        return (type >= 19 && type <= 21) || type == 32;
+    return false;
+}
+
+bool frame_nal_is_param(hal_vidcodec codec, unsigned char type) {
+    if (codec == HAL_VIDCODEC_H264)
+        return type == 7 || type == 8;
+    if (codec == HAL_VIDCODEC_H265)
+        return type >= 32 && type <= 34;
+    return false;
+}
+
+bool frame_nal_is_ref(const struct Frame *frame, const struct FrameNal *nal) {
+    if (frame->codec == HAL_VIDCODEC_H264)
+        return frame->data[nal->offset] & 0x60;
+    // Even slice types up to 14 are the sub-layer non-reference ones
+    if (frame->codec == HAL_VIDCODEC_H265)
+        return nal->type < 32 ? nal->type > 14 || nal->type & 1 :
+            frame_nal_is_param(frame->codec, nal->type);
+    return false;
+}
+
+// Units of the frame being built, as many as the encoder puts out. Only
+// the encoder thread creates frames.
+struct FrameNal *nalBuf = NULL;
+unsigned int nalCap = 0, nalCount = 0;
+
+static void frame_add_nal(hal_vidcodec codec, const unsigned char *data,
+    unsigned int base, unsigned int start, unsigned int end) {
+    // A four-byte start code leaves its leading zero behind
+    while (end > start && !data[end - 1])
+        end--;
+    if (end <= start)
+        return;
+
+    if (nalCount == nalCap) {
+        unsigned int cap = nalCap ? nalCap * 2 : 64;
+        struct FrameNal *nals = realloc(nalBuf, cap * sizeof(struct FrameNal));
+        // Out of memory the rest of the pack goes along with the last unit
+        if (!nals) {
+            fprintf(stderr, "Can't index more than %u NAL units of a frame\n",
+                nalCap);
+            if (nalCount)
+                nalBuf[nalCount - 1].size =
+                    base + end - nalBuf[nalCount - 1].offset;
+            return;
+        }
+        nalBuf = nals;
+        nalCap = cap;
+    }
+
+    struct FrameNal *nal = &nalBuf[nalCount++];
+    nal->offset = base + start;
+    nal->size = end - start;
+    nal->type = codec == HAL_VIDCODEC_H265 ?
+        (data[start] >> 1) & 0x3F : data[start] & 0x1F;
+}
+
+// Indexes the Annex-B units found in a pack, they never cross its bounds and
+// get their offsets in the frame from base
+static void frame_index(hal_vidcodec codec, const unsigned char *data,
+    unsigned int end, unsigned int base) {
+    unsigned int pos = 0, nal = 0;
+    bool found = false;
+
+    while (pos + 2 < end) {
+        if (data[pos + 2] > 1) {
+            pos += 3;
+            continue;
+        }
+        if (data[pos + 2] == 1 && !data[pos + 1] && !data[pos]) {
+            if (found)
+                frame_add_nal(codec, data, base, nal, pos);
+            nal = pos += 3;
+            found = true;
+            continue;
+        }
+        pos++;
+    }
+    if (found)
+        frame_add_nal(codec, data, base, nal, end);
+}
+
+struct Frame *frame_create(hal_vidcodec codec, hal_vidstream *stream) {
+    bool annexb = codec == HAL_VIDCODEC_H264 || codec == HAL_VIDCODEC_H265;
+    unsigned int size = 0;
+    nalCount = 0;
+    for (unsigned int i = 0; i < stream->count; i++) {
+        hal_vidpack *pack = &stream->pack[i];
+        unsigned int length = pack->length - pack->offset;
+        if (annexb)
+            frame_index(codec, pack->data + pack->offset, length, size);
+        size += length;
+    }
+
+    // The index of the units follows the data in the same allocation
+    unsigned int nals_at = (size + 7) & ~7;
+    unsigned int alloc = sizeof(struct Frame) + nals_at +
+        nalCount * sizeof(struct FrameNal);
+    struct Frame *frame = frame_pool_alloc(alloc);
+    if (!frame) {
+        frame = malloc(alloc);
+        if (!frame) {
+            fprintf(stderr, "Can't allocate a %u bytes frame\n", size);
+            return NULL;
+        }
+        frame->pool_size = 0;
+    }
+    frame->refs = 1;
+    frame->codec = codec;
+    frame->keyframe = codec == HAL_VIDCODEC_MJPG || codec == HAL_VIDCODEC_JPG;
+    frame->size = 0;
+    frame->nals = (struct FrameNal *)(frame->data + nals_at);
+    frame->nal_count = nalCount;
+    memcpy(frame->nals, nalBuf, nalCount * sizeof(struct FrameNal));
+    for (unsigned int i = 0; i < nalCount; i++)
+        if (frame_is_key_nal(codec, frame->nals[i].type))
+            frame->keyframe = true;
+
+    // Fall back to the arrival time when the encoder left the stamp out
+    frame->timestamp = stream->count ? stream->pack[0].timestamp : 0;
+    if (!frame->timestamp) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        frame->timestamp = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    }
+
+    for (unsigned int i = 0; i < stream->count; i++) {
+        hal_vidpack *pack = &stream->pack[i];
+        unsigned int length = pack->length - pack->offset;
+        if (frame_is_key_nal(codec, pack->naluType))
+            frame->keyframe = true;
+        memcpy(frame->data + frame->size, pack->data + pack->offset, length);
+        frame->size += length;
+    }
+
+    return frame;
+}
+
+struct Frame *frame_ref(struct Frame *frame) {
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    return frame;
+}
+
+void frame_unref(struct Frame *frame) {
+    if (!frame)
+        return;
+    // Pooled frames are reclaimed by the encoder thread once released
+    bool pooled = frame->pool_size;
+    if (!__atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) && !pooled)
+        free(frame);
+}
+
+// Access units since the last keyframe, a new consumer starts from them
+// instead of waiting for the next one. Only the encoder thread uses it.
+struct Frame *gopFrames[GOP_CACHE_LEN];
+unsigned int gopCount = 0, gopBytes = 0;
+
+void gop_cache_put(struct Frame *frame) {
+    if (frame->keyframe)
+        gop_cache_clear();
+    // Without its keyframe the rest is of no use, the next one starts over
+    else if (!gopCount || gopCount == GOP_CACHE_LEN ||
+        gopBytes + frame->size > GOP_CACHE_SIZE) {
+        gop_cache_clear();
+        return;
+    }
+
+    gopFrames[gopCount++] = frame_ref(frame);
+    gopBytes += frame->size;
+}
+
+unsigned int gop_cache_get(struct Frame *const **frames) {
+    *frames = gopFrames;
+    return gopCount;
+}
+
+void gop_cache_clear() {
+    for (unsigned int i = 0; i < gopCount; i++)
+        frame_unref(gopFrames[i]);
+    gopCount = gopBytes = 0;
+}
+
+// Ring of references to the frames of the pre-event buffer, along with the
+// positions of its keyframes so a clip can be found by time without going
+// through every frame. Positions only ever grow, slots are taken modulo
+// the capacity of each ring.
+pthread_mutex_t prerollLock = PTHREAD_MUTEX_INITIALIZER;
+struct Frame **prerollFrames = NULL;
+uint64_t *prerollKeys = NULL;
+unsigned int prerollCap = 0, prerollSize = 0, prerollBytes = 0;
+uint64_t prerollSpan = 0;
+uint64_t prerollHead = 0, prerollTail = 0, keyHead = 0, keyTail = 0;
+
+#define preroll_at(pos) prerollFrames[(pos) % prerollCap]
+#define preroll_key(i) prerollKeys[(i) % prerollCap]
+
+int preroll_init(unsigned int seconds, unsigned int size) {
+    // Enough slots for the span and a GOP beyond it at up to 120 fps
+    prerollCap = (seconds + 4) * 120;
+    prerollFrames = calloc(prerollCap, sizeof(struct Frame *));
+    prerollKeys = calloc(prerollCap, sizeof(uint64_t));
+    if (!prerollFrames || !prerollKeys) {
+        fprintf(stderr, "Can't allocate the pre-event buffer\n");
+        free(prerollFrames);
+        free(prerollKeys);
+        prerollFrames = NULL;
+        prerollKeys = NULL;
+        return EXIT_FAILURE;
+    }
+    prerollSpan = seconds * 1000000ULL;
+    prerollSize = size;
+    prerollHead = prerollTail = keyHead = keyTail = 0;
+    prerollBytes = 0;
+    return EXIT_SUCCESS;
+}
+
+// Drops the frames up to the next keyframe, or all of them without one
+static void preroll_drop_gop() {
+    uint64_t end = keyHead - keyTail > 1 ?
+        preroll_key(keyTail + 1) : prerollHead;
+    while (prerollTail < end) {
+        struct Frame *frame = preroll_at(prerollTail++);
+        prerollBytes -= frame->size;
+        frame_unref(frame);
+    }
+    keyTail = keyHead - keyTail > 1 ? keyTail + 1 : keyHead;
+}
+
+void preroll_free() {
+    pthread_mutex_lock(&prerollLock);
+    while (prerollTail < prerollHead)
+        preroll_drop_gop();
+    free(prerollFrames);
+    free(prerollKeys);
+    prerollFrames = NULL;
+    prerollKeys = NULL;
+    pthread_mutex_unlock(&prerollLock);
+}
+
+void preroll_put(struct Frame *frame) {
+    if (!prerollFrames)
+        return;
+    pthread_mutex_lock(&prerollLock);
+    if (prerollHead - prerollTail == prerollCap)
+        preroll_drop_gop();
+    // A buffer not starting on a keyframe is of no use
+    if (!frame->keyframe && keyHead == keyTail) {
+        pthread_mutex_unlock(&prerollLock);
+        return;
+    }
+    if (frame->keyframe)
+        preroll_key(keyHead++) = prerollHead;
+    preroll_at(prerollHead++) = frame_ref(frame);
+    prerollBytes += frame->size;
+
+    // The oldest GOP goes once the following ones cover the span on their
+    // own, or right away when the buffer gets too big
+    while (keyHead - keyTail > 1 && (prerollBytes > prerollSize ||
+        frame->timestamp - preroll_at(preroll_key(keyTail + 1))->timestamp >=
+        prerollSpan))
+        preroll_drop_gop();
+    if (prerollBytes > prerollSize)
+        preroll_drop_gop();
+    pthread_mutex_unlock(&prerollLock);
+}
+
+bool preroll_range(uint64_t *first, uint64_t *last) {
+    bool found = false;
+    pthread_mutex_lock(&prerollLock);
+    if (prerollFrames && prerollHead != prerollTail) {
+        *first = preroll_at(prerollTail)->timestamp;
+        *last = preroll_at(prerollHead - 1)->timestamp;
+        found = true;
+    }
+    pthread_mutex_unlock(&prerollLock);
+    return found;
+}
+
+unsigned int preroll_cut(uint64_t from, uint64_t to, struct Frame **frames,
+    unsigned int max) {
+    unsigned int count = 0;
+    pthread_mutex_lock(&prerollLock);
+    if (!prerollFrames || keyHead == keyTail) {
+        pthread_mutex_unlock(&prerollLock);
+        return 0;
+    }
+
+    // Last keyframe at or before the start, or the first one held
+    uint64_t lo = keyTail, hi = keyHead;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (preroll_at(preroll_key(mid))->timestamp <= from)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    for (uint64_t pos = preroll_key(lo); pos < prerollHead && count < max;
+        pos++) {
+        struct Frame *frame = preroll_at(pos);
+        if (frame->timestamp > to)
+            break;
+        frames[count++] = frame_ref(frame);
+    }
+    pthread_mutex_unlock(&prerollLock);
+    return count;
+}
+
+void packet_queue_init(struct PacketQueue *queue) {
+    queue->head = queue->count = queue->queued = queue->sent = 0;
+    queue->resync = false;
+}
+
+static void packet_queue_drop(struct PacketQueue *queue, unsigned int pos) {
+    struct Packet *packet =
+        &queue->packets[(queue->head + pos) % PACKET_QUEUE_LEN];
+    queue->queued -= packet->size;
+    packet_free(packet);
+    queue->count--;
+
+    if (!pos) {
+        queue->head = (queue->head + 1) % PACKET_QUEUE_LEN;
+        return;
+    }
+    for (; pos < queue->count; pos++)
+        queue->packets[(queue->head + pos) % PACKET_QUEUE_LEN] =
+            queue->packets[(queue->head + pos + 1) % PACKET_QUEUE_LEN];
+}
+
+// Drops the media packets from the given position on, replies stay
+static void packet_queue_clear(struct PacketQueue *queue, unsigned int from) {
+    for (unsigned int pos = queue->count; pos-- > from;)
+        if (queue->packets[(queue->head + pos) % PACKET_QUEUE_LEN].kind !=
+            PACKET_CTRL)
+            packet_queue_drop(queue, pos);
+}
+
+void packet_queue_reset(struct PacketQueue *queue) {
+    while (queue->count)
+        packet_queue_drop(queue, queue->count - 1);
+    queue->sent = 0;
+    queue->resync = false;
+}
+
+struct Packet *packet_queue_reserve(struct PacketQueue *queue,
+    enum PacketKind kind, unsigned int size) {
+    if (queue->resync && kind != PACKET_CTRL) {
+        if (kind != PACKET_KEY)
+            return NULL;
+        queue->resync = false;
+    }
+
+    // A packet which has been partially written cannot be taken back
+    unsigned int first = queue->sent ? 1 : 0;
+    while (kind != PACKET_CTRL && (queue->count == PACKET_QUEUE_LEN ||
+        (queue->count > first && queue->queued + size > PACKET_QUEUE_SIZE))) {
+        unsigned int pos = first;
+        while (pos < queue->count &&
+            queue->packets[(queue->head + pos) % PACKET_QUEUE_LEN].kind !=
+                PACKET_NONREF)
+            pos++;
+        if (pos < queue->count) {
+            packet_queue_drop(queue, pos);
+            continue;
+        }
+        if (kind == PACKET_NONREF)
+            return NULL;
+
+        packet_queue_clear(queue, first);
+        if (kind != PACKET_KEY) {
+            queue->resync = true;
+            return NULL;
+        }
+        break;
+    }
+    if (queue->count == PACKET_QUEUE_LEN)
+        return NULL;
+
+    return &queue->packets[(queue->head + queue->count) % PACKET_QUEUE_LEN];
+}
+
+void packet_queue_commit(struct PacketQueue *queue, struct Packet *packet) {
+    queue->count++;
+    queue->queued += packet->size;
+}
+
+static bool in_frames(struct Frame *const *frames, int frame_count,
+    const struct iovec *iov) {
+    for (int i = 0; i < frame_count; i++)
+        if ((unsigned char *)iov->iov_base >= frames[i]->data &&
+            (unsigned char *)iov->iov_base + iov->iov_len <=
+                frames[i]->data + frames[i]->size)
+            return true;
+    return false;
+}
+
+bool packet_init(struct Packet *packet, const struct iovec *iov, int iovcnt,
+    struct Frame *const *frames, int frame_count) {
+    unsigned int size = 0, copied = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+        if (!in_frames(frames, frame_count, &iov[i]))
+            copied += iov[i].iov_len;
+    }
+
+    if (!(packet->iov = malloc(iovcnt * sizeof(struct iovec) +
+        frame_count * sizeof(struct Frame *) + copied)))
+        return false;
+    packet->frames = (struct Frame **)(packet->iov + iovcnt);
+    packet->frame_count = frame_count;
+    for (int i = 0; i < frame_count; i++)
+        packet->frames[i] = frame_ref(frames[i]);
+
+    // Consecutive copied pieces end up in a single vector
+    char *copy = (char *)(packet->frames + frame_count);
+    bool merge = false;
+    packet->iovcnt = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_len)
+            continue;
+        bool shared = in_frames(frames, frame_count, &iov[i]);
+        if (!shared && merge) {
+            memcpy(copy, iov[i].iov_base, iov[i].iov_len);
+            packet->iov[packet->iovcnt - 1].iov_len += iov[i].iov_len;
+            copy += iov[i].iov_len;
+            continue;
+        }
+        struct iovec *next = &packet->iov[packet->iovcnt++];
+        next->iov_len = iov[i].iov_len;
+        next->iov_base = iov[i].iov_base;
+        if (!shared) {
+            memcpy(copy, iov[i].iov_base, iov[i].iov_len);
+            next->iov_base = copy;
+            copy += iov[i].iov_len;
+        }
+        merge = !shared;
+    }
+    packet->size = size;
+    return true;
+}
+
+void packet_free(struct Packet *packet) {
+    for (int i = 0; i < packet->frame_count; i++)
+        frame_unref(packet->frames[i]);
+    free(packet->iov);
+    packet->iov = NULL;
+    packet->frame_count = 0;
+}
+
+bool packet_queue_push(struct PacketQueue *queue, const struct iovec *iov,
+    int iovcnt, struct Frame *const *frames, int frame_count,
+    enum PacketKind kind) {
+    unsigned int size = 0;
+    for (int i = 0; i < iovcnt; i++)
+        size += iov[i].iov_len;
+
+    struct Packet *packet = packet_queue_reserve(queue, kind, size);
+    if (!packet || !packet_init(packet, iov, iovcnt, frames, frame_count))
+        return false;
+    packet->kind = kind;
+    packet_queue_commit(queue, packet);
+    return true;
+}
+
+int packet_queue_send(struct PacketQueue *queue, int fd) {
+    while (queue->count) {
+        struct iovec iov[PACKET_QUEUE_IOV];
+        int iovcnt = 0;
+        unsigned int skip = queue->sent;
+        for (unsigned int p = 0; p < queue->count && iovcnt < PACKET_QUEUE_IOV;
+            p++) {
+            struct Packet *packet =
+                &queue->packets[(queue->head + p) % PACKET_QUEUE_LEN];
+            for (int j = 0; j < packet->iovcnt && iovcnt < PACKET_QUEUE_IOV;
+                j++) {
+                // Resume from where the previous partial write stopped
+                if (skip >= packet->iov[j].iov_len) {
+                    skip -= packet->iov[j].iov_len;
+                    continue;
+                }
+                iov[iovcnt].iov_base = (char *)packet->iov[j].iov_base + skip;
+                iov[iovcnt++].iov_len = packet->iov[j].iov_len - skip;
+                skip = 0;
+            }
+        }
+
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t len = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 1;
+        if (len < 0)
+            return -1;
+        queue->sent += len;
+        while (queue->count &&
+            queue->sent >= queue->packets[queue->head].size) {
+            queue->sent -= queue->packets[queue->head].size;
+            packet_queue_drop(queue, 0);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "hal/types.h"
+
+// Bounds of the GOP cache, longer GOPs are simply not cached
+#define GOP_CACHE_LEN 128
+#define GOP_CACHE_SIZE (4 * 1024 * 1024)
+// Bounds of the output queue of a viewer
+#define PACKET_QUEUE_LEN 64
+#define PACKET_QUEUE_SIZE (2 * 1024 * 1024)
+// Vectors written at once, an RTP keyframe is made of two per packet
+#define PACKET_QUEUE_IOV 256
+
+struct FrameNal {
+    unsigned int offset, size;
+    unsigned char type;
+};
+
+// An encoded frame shared by all the stream consumers, the encoder packs
+// are gathered into it once and every consumer then holds a reference and
+// sends straight from its data until the last one lets go
+struct Frame {
+    int refs;
+    // Bytes taken from the frame pool, zero when allocated on the heap
+    unsigned int pool_size;
+    hal_vidcodec codec;
+    bool keyframe;
+    // Presentation time in microseconds, from the encoder when it has one
+    uint64_t timestamp;
+    unsigned int size;
+    // Annex-B units found in data, as many as there are, the index is kept
+    // right after the data in the same allocation
+    unsigned int nal_count;
+    struct FrameNal *nals;
+    unsigned char data[];
+};
+
+int frame_pool_init(unsigned int size);
+void frame_pool_free();
+
+struct Frame *frame_create(hal_vidcodec codec, hal_vidstream *stream);
+struct Frame *frame_ref(struct Frame *frame);
+void frame_unref(struct Frame *frame);
+
+// Roles of a NAL whatever the codec numbering, parameter sets being the
+// VPS, SPS and PPS a decoder needs before any picture
+bool frame_nal_is_param(hal_vidcodec codec, unsigned char type);
+// Whether other pictures may depend on it, or for parameter sets
+bool frame_nal_is_ref(const struct Frame *frame, const struct FrameNal *nal);
+
+// The frames from the last keyframe on, oldest first, for the consumers of
+// the encoder thread to bring a new client up to date right away
+void gop_cache_put(struct Frame *frame);
+unsigned int gop_cache_get(struct Frame *const **frames);
+void gop_cache_clear();
+
+// The last seconds of the stream for clips of what led up to an event, the
+// encoder thread drops whole GOPs from its front as long as what is left
+// still spans them, up to size bytes. Readers from any thread get their
+// own references to the frames.
+int preroll_init(unsigned int seconds, unsigned int size);
+void preroll_free();
+void preroll_put(struct Frame *frame);
+// Encoder times of the first and last frames held, false while empty
+bool preroll_range(uint64_t *first, uint64_t *last);
+// Frames from the last keyframe at or before from up to to, both on the
+// encoder clock in microseconds, at most max of them
+unsigned int preroll_cut(uint64_t from, uint64_t to, struct Frame **frames,
+    unsigned int max);
+
+// Classes of queued packets, a congested viewer first sheds the
+// non-reference ones and only then gives up on everything up to the next
+// key packet. Control packets, the replies of a protocol, are never dropped.
+enum PacketKind { PACKET_KEY, PACKET_REF, PACKET_NONREF, PACKET_CTRL };
+
+// Payload is referenced from the frames it came from, only the small pieces
+// around it (chunk sizes, boundaries, boxes, headers...) are copied with
+// the packet, in the same allocation as its vectors and frame list
+struct Packet {
+    struct iovec *iov;
+    int iovcnt;
+    unsigned int size;
+    struct Frame **frames;
+    int frame_count;
+    enum PacketKind kind;
+};
+
+// Makes a packet out of the given pieces, those pointing into the frames
+// are only referenced while the rest is copied. Its kind is left to the
+// caller, false when out of memory.
+bool packet_init(struct Packet *packet, const struct iovec *iov, int iovcnt,
+    struct Frame *const *frames, int frame_count);
+void packet_free(struct Packet *packet);
+
+// Bounded output queue of a socket, filled by the stream producers and
+// drained whenever the socket accepts more data. It has no lock of its
+// own, its owner has to hold one around every call.
+struct PacketQueue {
+    struct Packet packets[PACKET_QUEUE_LEN];
+    unsigned int head, count, queued, sent;
+    // Media waits for the next key packet after some had to be dropped
+    bool resync;
+};
+
+void packet_queue_init(struct PacketQueue *queue);
+// Drops every packet, control ones included
+void packet_queue_reset(struct PacketQueue *queue);
+// Makes room for a packet of the given kind and size, gives the slot to
+// fill in and hand to packet_queue_commit, or NULL when the packet has to
+// be dropped instead
+struct Packet *packet_queue_reserve(struct PacketQueue *queue,
+    enum PacketKind kind, unsigned int size);
+void packet_queue_commit(struct PacketQueue *queue, struct Packet *packet);
+// Queues a packet made of the given pieces as packet_init does, false when
+// it was dropped
+bool packet_queue_push(struct PacketQueue *queue, const struct iovec *iov,
+    int iovcnt, struct Frame *const *frames, int frame_count,
+    enum PacketKind kind);
+// Writes out as much as the socket takes without blocking, gives 0 once
+// the queue is empty, 1 when the socket is full and -1 on errors
+int packet_queue_send(struct PacketQueue *queue, int fd);
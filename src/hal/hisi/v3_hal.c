@@ -292,6 +292,43 @@ int v3_encoder_destroy_all(void)
     return EXIT_SUCCESS;
 }
 
+int v3_encoder_set_bitrate(char index, unsigned int bitrate)
+{
+    int ret;
+    v3_venc_chn channel;
+
+    if (ret = v3_venc.fnGetChannelConfig(index, &channel))
+        return ret;
+
+    switch (channel.rate.mode) {
+        case V3_VENC_RATEMODE_MJPGCBR:
+            channel.rate.mjpgCbr.bitrate = bitrate; break;
+        case V3_VENC_RATEMODE_MJPGVBR:
+            channel.rate.mjpgVbr.maxBitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H264CBR:
+            channel.rate.h264Cbr.bitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H264VBR:
+            channel.rate.h264Vbr.maxBitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H264AVBR:
+            channel.rate.h264Avbr.bitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H265CBR:
+            channel.rate.h265Cbr.bitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H265VBR:
+            channel.rate.h265Vbr.maxBitrate = bitrate; break;
+        case V3_VENC_RATEMODE_H265AVBR:
+            channel.rate.h265Avbr.bitrate = bitrate; break;
+        default:
+            V3_ERROR("The rate control mode of this channel has no bitrate!");
+    }
+
+    return v3_venc.fnSetChannelConfig(index, &channel);
+}
+
+int v3_encoder_request_idr(char index)
+{
+    return v3_venc.fnRequestIdr(index, 1);
+}
+
 int v3_encoder_snapshot_grab(char index, short width, short height, 
     char quality, char grayscale, hal_jpegdata *jpeg)
 {
@@ -487,6 +524,11 @@ void *v3_encoder_thread(void)
                             outPack[j].data = stream.packet[j].data;
                             outPack[j].length = stream.packet[j].length;
                             outPack[j].offset = stream.packet[j].offset;
+                            outPack[j].timestamp = stream.packet[j].timestamp;
+                            outPack[j].naluType =
+                                v3_state[i].payload == HAL_VIDCODEC_H265 ?
+                                stream.packet[j].naluType.h265Nalu :
+                                stream.packet[j].naluType.h264Nalu;
                         }
                         outStrm.pack = outPack;
                         (*v3_venc_cb)(i, &outStrm);
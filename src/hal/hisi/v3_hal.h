@@ -41,6 +41,8 @@ int v3_channel_unbind(char index);
 int v3_encoder_create(char index, hal_vidconfig *config);
 int v3_encoder_destroy(char index);
 int v3_encoder_destroy_all(void);
+int v3_encoder_set_bitrate(char index, unsigned int bitrate);
+int v3_encoder_request_idr(char index);
 int v3_encoder_snapshot_grab(char index, short width, short height, 
     char quality, char grayscale, hal_jpegdata *jpeg);
 void *v3_encoder_thread(void);
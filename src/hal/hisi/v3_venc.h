@@ -379,6 +379,7 @@ typedef struct {
     int (*fnGetStream)(int channel, v3_venc_strm *stream, unsigned int timeout);
 
     int (*fnQuery)(int channel, v3_venc_stat* stats);
+    int (*fnRequestIdr)(int channel, int instant);
 
     int (*fnStartReceiving)(int channel);
     int (*fnStartReceivingEx)(int channel, int *count);
@@ -469,6 +470,12 @@ static int v3_venc_load(v3_venc_impl *venc_lib) {
         return EXIT_FAILURE;
     }
 
+    if (!(venc_lib->fnRequestIdr = (int(*)(int channel, int instant))
+        dlsym(venc_lib->handle, "HI_MPI_VENC_RequestIDR"))) {
+        fprintf(stderr, "[v3_venc] Failed to acquire symbol HI_MPI_VENC_RequestIDR!\n");
+        return EXIT_FAILURE;
+    }
+
     if (!(venc_lib->fnStartReceiving = (int(*)(int channel))
         dlsym(venc_lib->handle, "HI_MPI_VENC_StartRecvPic"))) {
         fprintf(stderr, "[v3_venc] Failed to acquire symbol HI_MPI_VENC_StartRecvPic!\n");
@@ -293,6 +293,45 @@ int i6_encoder_destroy_all(void)
     return EXIT_SUCCESS;
 }
 
+int i6_encoder_set_bitrate(char index, unsigned int bitrate)
+{
+    int ret;
+    i6_venc_chn channel;
+
+    if (ret = i6_venc.fnGetChannelConfig(index, &channel))
+        return ret;
+
+    switch (channel.rate.mode) {
+        case I6_VENC_RATEMODE_MJPGCBR:
+            channel.rate.mjpgCbr.bitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H264CBR:
+            channel.rate.h264Cbr.bitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H264VBR:
+            channel.rate.h264Vbr.maxBitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H264ABR:
+            channel.rate.h264Abr.avgBitrate = bitrate << 10;
+            channel.rate.h264Abr.maxBitrate =
+                MAX(channel.rate.h264Abr.maxBitrate, bitrate << 10); break;
+        case I6_VENC_RATEMODE_H264AVBR:
+            channel.rate.h264Avbr.maxBitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H265CBR:
+            channel.rate.h265Cbr.bitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H265VBR:
+            channel.rate.h265Vbr.maxBitrate = bitrate << 10; break;
+        case I6_VENC_RATEMODE_H265AVBR:
+            channel.rate.h265Avbr.maxBitrate = bitrate << 10; break;
+        default:
+            I6_ERROR("The rate control mode of this channel has no bitrate!");
+    }
+
+    return i6_venc.fnSetChannelConfig(index, &channel);
+}
+
+int i6_encoder_request_idr(char index)
+{
+    return i6_venc.fnRequestIdr(index, 1);
+}
+
 int i6_encoder_snapshot_grab(char index, short width, short height, 
     char quality, char grayscale, hal_jpegdata *jpeg)
 {
@@ -486,6 +525,11 @@ void *i6_encoder_thread(void)
                             outPack[j].data = stream.packet[j].data;
                             outPack[j].length = stream.packet[j].length;
                             outPack[j].offset = stream.packet[j].offset;
+                            outPack[j].timestamp = stream.packet[j].timestamp;
+                            outPack[j].naluType =
+                                i6_state[i].payload == HAL_VIDCODEC_H265 ?
+                                stream.packet[j].naluType.h265Nalu :
+                                stream.packet[j].naluType.h264Nalu;
                         }
                         outStrm.pack = outPack;
                         (*i6_venc_cb)(i, &outStrm);
@@ -280,6 +280,7 @@ typedef struct {
     int (*fnGetStream)(int channel, i6_venc_strm *stream, unsigned int timeout);
 
     int (*fnQuery)(int channel, i6_venc_stat* stats);
+    int (*fnRequestIdr)(int channel, char instant);
 
     int (*fnSetSourceConfig)(int channel, i6_venc_src_conf *config);
 
@@ -372,6 +373,12 @@ static int i6_venc_load(i6_venc_impl *venc_lib) {
         return EXIT_FAILURE;
     }
 
+    if (!(venc_lib->fnRequestIdr = (int(*)(int channel, char instant))
+        dlsym(venc_lib->handle, "MI_VENC_RequestIdr"))) {
+        fprintf(stderr, "[i6_venc] Failed to acquire symbol MI_VENC_RequestIdr!\n");
+        return EXIT_FAILURE;
+    }
+
     if (!(venc_lib->fnSetSourceConfig = (int(*)(int channel, i6_venc_src_conf *config))
         dlsym(venc_lib->handle, "MI_VENC_SetInputSourceConfig"))) {
         fprintf(stderr, "[i6_venc] Failed to acquire symbol MI_VENC_SetInputSourceConfig!\n");
@@ -314,6 +314,54 @@ int i6c_encoder_destroy_all(void)
     return EXIT_SUCCESS;
 }
 
+int i6c_encoder_set_bitrate(char index, unsigned int bitrate)
+{
+    int ret;
+    char device = 
+        (i6c_state[index].payload == HAL_VIDCODEC_JPG ||
+         i6c_state[index].payload == HAL_VIDCODEC_MJPG) ? 
+         I6C_VENC_DEV_MJPG_0 : I6C_VENC_DEV_H26X_0;
+    i6c_venc_chn channel;
+
+    if (ret = i6c_venc.fnGetChannelConfig(device, index, &channel))
+        return ret;
+
+    switch (channel.rate.mode) {
+        case I6C_VENC_RATEMODE_MJPGCBR:
+            channel.rate.mjpgCbr.bitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H264CBR:
+            channel.rate.h264Cbr.bitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H264VBR:
+            channel.rate.h264Vbr.maxBitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H264ABR:
+            channel.rate.h264Abr.avgBitrate = bitrate << 10;
+            channel.rate.h264Abr.maxBitrate =
+                MAX(channel.rate.h264Abr.maxBitrate, bitrate << 10); break;
+        case I6C_VENC_RATEMODE_H264AVBR:
+            channel.rate.h264Avbr.maxBitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H265CBR:
+            channel.rate.h265Cbr.bitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H265VBR:
+            channel.rate.h265Vbr.maxBitrate = bitrate << 10; break;
+        case I6C_VENC_RATEMODE_H265AVBR:
+            channel.rate.h265Avbr.maxBitrate = bitrate << 10; break;
+        default:
+            I6C_ERROR("The rate control mode of this channel has no bitrate!");
+    }
+
+    return i6c_venc.fnSetChannelConfig(device, index, &channel);
+}
+
+int i6c_encoder_request_idr(char index)
+{
+    char device = 
+        (i6c_state[index].payload == HAL_VIDCODEC_JPG ||
+         i6c_state[index].payload == HAL_VIDCODEC_MJPG) ? 
+         I6C_VENC_DEV_MJPG_0 : I6C_VENC_DEV_H26X_0;
+
+    return i6c_venc.fnRequestIdr(device, index, 1);
+}
+
 int i6c_encoder_snapshot_grab(char index, short width, short height,
     char quality, char grayscale, hal_jpegdata *jpeg)
 {
@@ -520,6 +568,11 @@ void *i6c_encoder_thread(void)
                             outPack[j].data = stream.packet[j].data;
                             outPack[j].length = stream.packet[j].length;
                             outPack[j].offset = stream.packet[j].offset;
+                            outPack[j].timestamp = stream.packet[j].timestamp;
+                            outPack[j].naluType =
+                                i6c_state[i].payload == HAL_VIDCODEC_H265 ?
+                                stream.packet[j].naluType.h265Nalu :
+                                stream.packet[j].naluType.h264Nalu;
                         }
                         outStrm.pack = outPack;
                         (*i6c_venc_cb)(i, &outStrm);
@@ -30,6 +30,8 @@ int i6c_config_load(char *path);
 int i6c_encoder_create(char index, hal_vidconfig *config);
 int i6c_encoder_destroy(char index, char jpeg);
 int i6c_encoder_destroy_all(void);
+int i6c_encoder_set_bitrate(char index, unsigned int bitrate);
+int i6c_encoder_request_idr(char index);
 int i6c_encoder_snapshot_grab(char index, short width, short height,
     char quality, char grayscale, hal_jpegdata *jpeg);
 void *i6c_encoder_thread(void);
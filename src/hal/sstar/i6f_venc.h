@@ -298,6 +298,7 @@ typedef struct {
     int (*fnGetStream)(unsigned int device, unsigned int channel, i6f_venc_strm *stream, unsigned int timeout);
 
     int (*fnQuery)(unsigned int device, unsigned int channel, i6f_venc_stat* stats);
+    int (*fnRequestIdr)(unsigned int device, unsigned int channel, char instant);
 
     int (*fnSetSourceConfig)(unsigned int device, unsigned int channel, i6f_venc_src_conf *config);
 
@@ -396,6 +397,12 @@ static int i6f_venc_load(i6f_venc_impl *venc_lib) {
         return EXIT_FAILURE;
     }
 
+    if (!(venc_lib->fnRequestIdr = (int(*)(unsigned int device, unsigned int channel, char instant))
+        dlsym(venc_lib->handle, "MI_VENC_RequestIdr"))) {
+        fprintf(stderr, "[i6f_venc] Failed to acquire symbol MI_VENC_RequestIdr!\n");
+        return EXIT_FAILURE;
+    }
+
     if (!(venc_lib->fnSetSourceConfig = (int(*)(unsigned int device, unsigned int channel, i6f_venc_src_conf *config))
         dlsym(venc_lib->handle, "MI_VENC_SetInputSourceConfig"))) {
         fprintf(stderr, "[i6f_venc] Failed to acquire symbol MI_VENC_SetInputSourceConfig!\n");
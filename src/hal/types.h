@@ -91,6 +91,10 @@ typedef struct {
     unsigned char *data;
     unsigned int length;
     unsigned int offset;
+    // Presentation time in microseconds as stamped by the encoder
+    unsigned long long timestamp;
+    // NAL unit type reported by the encoder for this pack
+    unsigned char naluType;
 } hal_vidpack;
 
 typedef struct {
@@ -7,8 +7,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "frame.h"
 #include "http_post.h"
 #include "night.h"
+#include "record.h"
+#include "storage.h"
 #include "server.h"
 #include "video.h"
 
@@ -37,11 +40,29 @@ int main(int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    // Frames are kept for a few seconds of the bitrate on top of the
+    // pre-event buffer and the recording queue, more go to the heap
+    unsigned int frameBuffer = app_config.frame_buffer_size * 1024;
+    if (!frameBuffer) {
+        frameBuffer = MAX(app_config.mp4_bitrate * 1024 / 8 *
+            (3 + app_config.mp4_preroll), 1024 * 1024);
+        if (app_config.record_enable)
+            frameBuffer += app_config.record_buffer_size ?
+                app_config.record_buffer_size * 1024 :
+                app_config.mp4_bitrate * 1024 / 8 * 10;
+    }
+    frame_pool_init(frameBuffer);
+
+    // Twice the nominal bitrate leaves room for busy scenes
+    if (app_config.mp4_enable && app_config.mp4_preroll)
+        preroll_init(app_config.mp4_preroll,
+            app_config.mp4_bitrate * 1024 / 8 * app_config.mp4_preroll * 2);
+
     start_server();
 
     int mainFd;
     if (app_config.rtsp_enable) {
-        ring_malloc(app_config.mp4_width * app_config.mp4_height);
+        ring_init(frameBuffer);
         signal(SIGINT, rtsp_interrupt);
         fprintf(stderr, "RTSP server started, listening for clients...\n");
         
@@ -55,6 +76,13 @@ int main(int argc, char *argv[]) {
         rtsp_portpool_init(RTP_DEFAULT_PORT);
     }
 
+    if (app_config.record_enable && start_storage())
+        app_config.record_enable = false;
+    if (app_config.record_enable && start_record()) {
+        stop_storage();
+        app_config.record_enable = false;
+    }
+
     if (start_sdk())
         return EXIT_FAILURE;
 
@@ -68,13 +96,9 @@ int main(int argc, char *argv[]) {
         start_region_handler();
         
     if (app_config.rtsp_enable) {
-        struct timespec ts = {2, 0};
-        while (keepRunning) {
-            nanosleep(&ts, NULL);
-            rtsp_eventloop(mainFd);
-        }
-        ring_free();
+        rtsp_eventloop(mainFd);
         rtsp_deinit_schedule();
+        ring_free();
         printf("RTSP server has closed!\n");
     } else 
         while (keepRunning) sleep(1);
@@ -87,8 +111,16 @@ int main(int argc, char *argv[]) {
 
     stop_sdk();
 
+    if (app_config.record_enable) {
+        stop_record();
+        stop_storage();
+    }
+
     stop_server();
 
+    preroll_free();
+    frame_pool_free();
+
     printf("Main thread is shutting down...\n");
     return EXIT_SUCCESS;
 }
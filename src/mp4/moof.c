@@ -2,48 +2,51 @@
 
 #include "moof.h"
 
-uint32_t pos_sequence_number = 0;
-uint32_t pos_base_data_offset = 0;
-uint32_t pos_base_media_decode_time = 0;
-
 struct DataOffsetPos {
     bool data_offset_present;
     uint32_t offset;
 };
 
-enum BufError write_mfhd(struct BitBuf *ptr, const uint32_t sequence_number);
+enum BufError write_mfhd(
+    struct BitBuf *ptr, const uint32_t sequence_number, struct MoofPos *pos);
 enum BufError write_traf(
     struct BitBuf *ptr, const uint32_t sequence_number,
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_duration,
     const struct SampleInfo *samples_info, const uint32_t samples_info_len,
-    struct DataOffsetPos *data_offset);
+    struct DataOffsetPos *data_offset, struct MoofPos *pos);
 enum BufError write_tfhd(
     struct BitBuf *ptr, const uint32_t sequence_number,
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_size, const uint32_t default_sample_duration,
     const struct SampleInfo *samples_info, const uint32_t samples_info_len,
-    struct DataOffsetPos *data_offset);
-enum BufError
-write_tfdt(struct BitBuf *ptr, const uint64_t base_media_decode_time);
+    struct DataOffsetPos *data_offset, struct MoofPos *pos);
+enum BufError write_tfdt(
+    struct BitBuf *ptr, const uint64_t base_media_decode_time,
+    struct MoofPos *pos);
 enum BufError write_trun(
     struct BitBuf *ptr, const struct SampleInfo *samples_info,
     const uint32_t samples_info_count, struct DataOffsetPos *data_offset);
 
 enum BufError
-write_mdat(struct BitBuf *ptr, const char *data, const uint32_t len) {
+write_mdat_header(struct BitBuf *ptr, const uint32_t len) {
     enum BufError err;
-    uint32_t start_atom = ptr->offset;
-    err = put_u32_be(ptr, 0);
+    err = put_u32_be(ptr, 8 + len);
     chk_err;
     err = put_str4(ptr, "mdat");
     chk_err;
+    return BUF_OK;
+}
+
+enum BufError
+write_mdat(struct BitBuf *ptr, const char *data, const uint32_t len) {
+    enum BufError err;
+    err = write_mdat_header(ptr, 4 + len);
+    chk_err;
     err = put_u32_be(ptr, len);
     chk_err;
     err = put(ptr, data, len);
     chk_err;
-    err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
-    chk_err;
     return BUF_OK;
 }
 
@@ -51,21 +54,24 @@ enum BufError write_moof(
     struct BitBuf *ptr, const uint32_t sequence_number,
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_duration,
-    const struct SampleInfo *samples_info, const uint32_t samples_info_len) {
+    const struct SampleInfo *samples_info, const uint32_t samples_info_len,
+    struct MoofPos *pos) {
     enum BufError err;
+    memset(pos, 0, sizeof(struct MoofPos));
     uint32_t start_atom = ptr->offset;
     err = put_u32_be(ptr, 0);
     chk_err;
     err = put_str4(ptr, "moof");
     chk_err;
-    err = write_mfhd(ptr, sequence_number);
+    err = write_mfhd(ptr, sequence_number, pos);
     chk_err;
 
     struct DataOffsetPos data_offset;
     data_offset.offset = 0;
     err = write_traf(
         ptr, sequence_number, base_data_offset, base_media_decode_time,
-        default_sample_duration, samples_info, samples_info_len, &data_offset);
+        default_sample_duration, samples_info, samples_info_len, &data_offset,
+        pos);
     chk_err;
     if (data_offset.data_offset_present)
         err = put_u32_be_to_offset(
@@ -78,7 +84,8 @@ enum BufError write_moof(
     return BUF_OK;
 }
 
-enum BufError write_mfhd(struct BitBuf *ptr, const uint32_t sequence_number) {
+enum BufError write_mfhd(
+    struct BitBuf *ptr, const uint32_t sequence_number, struct MoofPos *pos) {
     enum BufError err;
     uint32_t start_atom = ptr->offset;
     err = put_u32_be(ptr, 0);
@@ -92,7 +99,7 @@ enum BufError write_mfhd(struct BitBuf *ptr, const uint32_t sequence_number) {
     err = put_u8(ptr, 0);
     chk_err;
     // 3 flags
-    pos_sequence_number = ptr->offset;
+    pos->sequence_number = ptr->offset;
     err = put_u32_be(ptr, sequence_number);
     chk_err; // 4 sequence_number
     err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
@@ -105,7 +112,7 @@ enum BufError write_traf(
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_duration,
     const struct SampleInfo *samples_info, const uint32_t samples_info_len,
-    struct DataOffsetPos *data_offset) {
+    struct DataOffsetPos *data_offset, struct MoofPos *pos) {
     enum BufError err;
     uint32_t start_atom = ptr->offset;
     err = put_u32_be(ptr, 0);
@@ -115,9 +122,9 @@ enum BufError write_traf(
     err = write_tfhd(
         ptr, sequence_number, base_data_offset, base_media_decode_time,
         samples_info[0].size, default_sample_duration, samples_info,
-        samples_info_len, data_offset);
+        samples_info_len, data_offset, pos);
     chk_err;
-    err = write_tfdt(ptr, base_media_decode_time);
+    err = write_tfdt(ptr, base_media_decode_time, pos);
     chk_err;
     err = write_trun(ptr, samples_info, samples_info_len, data_offset);
     chk_err;
@@ -131,7 +138,7 @@ enum BufError write_tfhd(
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_size, const uint32_t default_sample_duration,
     const struct SampleInfo *samples_info, const uint32_t samples_info_len,
-    struct DataOffsetPos *data_offset) {
+    struct DataOffsetPos *data_offset, struct MoofPos *pos) {
     enum BufError err;
     uint32_t start_atom = ptr->offset;
     err = put_u32_be(ptr, 0);
@@ -181,7 +188,7 @@ enum BufError write_tfhd(
     err = put_u32_be(ptr, 1);
     chk_err; // 4 track_ID
     if (base_data_offset_present) {
-        pos_base_data_offset = ptr->offset;
+        pos->base_data_offset = ptr->offset;
         err = put_u64_be(ptr, base_data_offset);
         chk_err;
     }
@@ -205,8 +212,9 @@ enum BufError write_tfhd(
     return BUF_OK;
 }
 
-enum BufError
-write_tfdt(struct BitBuf *ptr, const uint64_t base_media_decode_time) {
+enum BufError write_tfdt(
+    struct BitBuf *ptr, const uint64_t base_media_decode_time,
+    struct MoofPos *pos) {
     enum BufError err;
     uint32_t start_atom = ptr->offset;
     err = put_u32_be(ptr, 0);
@@ -219,7 +227,7 @@ write_tfdt(struct BitBuf *ptr, const uint64_t base_media_decode_time) {
     chk_err;
     err = put_u8(ptr, 0);
     chk_err; // 3 flags
-    pos_base_media_decode_time = ptr->offset;
+    pos->base_media_decode_time = ptr->offset;
     err = put_u64_be(ptr, base_media_decode_time);
     chk_err; // 4 baseMediaDecodeTime
     err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
@@ -312,3 +320,55 @@ enum BufError write_trun(
     chk_err;
     return BUF_OK;
 }
+
+enum BufError write_mfra(
+    struct BitBuf *ptr, const struct RandomAccess *entries,
+    const uint32_t entries_len) {
+    enum BufError err;
+    uint32_t start_atom = ptr->offset;
+    err = put_u32_be(ptr, 0);
+    chk_err;
+    err = put_str4(ptr, "mfra");
+    chk_err;
+
+    uint32_t start_tfra = ptr->offset;
+    err = put_u32_be(ptr, 0);
+    chk_err;
+    err = put_str4(ptr, "tfra");
+    chk_err;
+    err = put_u32_be(ptr, 0x01000000);
+    chk_err; // 1 version, 64-bit times and offsets, 3 flags
+    err = put_u32_be(ptr, 1);
+    chk_err; // 4 track_ID
+    err = put_u32_be(ptr, 0);
+    chk_err; // 4 one byte for the traf, trun and sample numbers
+    err = put_u32_be(ptr, entries_len);
+    chk_err; // 4 number_of_entry
+    for (uint32_t i = 0; i < entries_len; ++i) {
+        err = put_u64_be(ptr, entries[i].time);
+        chk_err;
+        err = put_u64_be(ptr, entries[i].moof_offset);
+        chk_err;
+        // The first sample of the only traf and trun of each moof
+        err = put_u8(ptr, 1);
+        chk_err;
+        err = put_u8(ptr, 1);
+        chk_err;
+        err = put_u8(ptr, 1);
+        chk_err;
+    }
+    err = put_u32_be_to_offset(ptr, start_tfra, ptr->offset - start_tfra);
+    chk_err;
+
+    err = put_u32_be(ptr, 16);
+    chk_err;
+    err = put_str4(ptr, "mfro");
+    chk_err;
+    err = put_u32_be(ptr, 0);
+    chk_err; // 1 version, 3 flags
+    err = put_u32_be(ptr, ptr->offset - start_atom + 4);
+    chk_err; // 4 size of the whole mfra
+    err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
+    chk_err;
+    return BUF_OK;
+}
@@ -2,9 +2,13 @@
 
 #include "bitbuf.h"
 
-extern uint32_t pos_sequence_number;
-extern uint32_t pos_base_data_offset;
-extern uint32_t pos_base_media_decode_time;
+// Where the fields patched for each client sit in a moof, 0 when it has
+// none of them
+struct MoofPos {
+    uint32_t sequence_number;
+    uint32_t base_data_offset;
+    uint32_t base_media_decode_time;
+};
 
 struct SampleInfo {
     uint32_t duration;
@@ -15,10 +19,27 @@ struct SampleInfo {
     uint32_t flags;
 };
 
+// Only writes the box header for len bytes of samples, so these can be sent
+// from wherever they already are
+enum BufError
+write_mdat_header(struct BitBuf *ptr, const uint32_t len);
 enum BufError
 write_mdat(struct BitBuf *ptr, const char *data, const uint32_t len);
 enum BufError write_moof(
     struct BitBuf *ptr, const uint32_t sequence_number,
     const uint64_t base_data_offset, const uint64_t base_media_decode_time,
     const uint32_t default_sample_duration,
-    const struct SampleInfo *samples_info, const uint32_t samples_info_len);
+    const struct SampleInfo *samples_info, const uint32_t samples_info_len,
+    struct MoofPos *pos);
+
+// Keyframe fragments of a file, for players to seek without going through
+// every moof, time being the decode time of the first sample
+struct RandomAccess {
+    uint64_t time;
+    uint64_t moof_offset;
+};
+
+// Closes a file with the mfra index of its random access points
+enum BufError write_mfra(
+    struct BitBuf *ptr, const struct RandomAccess *entries,
+    const uint32_t entries_len);
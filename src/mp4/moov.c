@@ -19,6 +19,7 @@ enum BufError write_stbl(struct BitBuf *ptr, const struct MoovInfo *moov_info);
 enum BufError write_stsd(struct BitBuf *ptr, const struct MoovInfo *moov_info);
 enum BufError write_avc1(struct BitBuf *ptr, const struct MoovInfo *moov_info);
 enum BufError write_avcC(struct BitBuf *ptr, const struct MoovInfo *moov_info);
+enum BufError write_hvcC(struct BitBuf *ptr, const struct MoovInfo *moov_info);
 enum BufError write_stts(struct BitBuf *ptr);
 enum BufError write_stsc(struct BitBuf *ptr);
 enum BufError write_stsz(struct BitBuf *ptr);
@@ -470,7 +471,7 @@ enum BufError write_avc1(struct BitBuf *ptr, const struct MoovInfo *moov_info) {
     err = put_u32_be(ptr, 0);
     chk_err;
 
-    err = put_str4(ptr, "avc1");
+    err = put_str4(ptr, moov_info->hevc ? "hvc1" : "avc1");
     chk_err;
 
     err = put_u8(ptr, 0);
@@ -523,7 +524,10 @@ enum BufError write_avc1(struct BitBuf *ptr, const struct MoovInfo *moov_info) {
     chk_err; // 2 depth
     err = put_u16_be(ptr, 0xffff);
     chk_err; // 2 color_table_id
-    err = write_avcC(ptr, moov_info);
+    if (moov_info->hevc)
+        err = write_hvcC(ptr, moov_info);
+    else
+        err = write_avcC(ptr, moov_info);
     chk_err;
 
     err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
@@ -568,6 +572,82 @@ enum BufError write_avcC(struct BitBuf *ptr, const struct MoovInfo *moov_info) {
     return BUF_OK;
 }
 
+static enum BufError write_hvcC_array(
+    struct BitBuf *ptr, uint8_t type, const char *nal, uint16_t nal_length) {
+    enum BufError err;
+    err = put_u8(ptr, 0x80 | type);
+    chk_err; // 1 bit array_completeness + 1 bit reserved + 6 bits type
+    err = put_u16_be(ptr, 1);
+    chk_err; // 2 num nalus
+    err = put_u16_be(ptr, nal_length);
+    chk_err;
+    err = put(ptr, nal, nal_length);
+    chk_err;
+    return BUF_OK;
+}
+
+enum BufError write_hvcC(struct BitBuf *ptr, const struct MoovInfo *moov_info) {
+    enum BufError err;
+    // The SPS RBSP up to general_level_idc, without the emulation
+    // prevention bytes and past the two bytes NAL header
+    uint8_t rbsp[13];
+    unsigned int len = 0, zeros = 0;
+    for (unsigned int i = 2; i < moov_info->sps_length && len < sizeof(rbsp);
+        i++) {
+        uint8_t byte = moov_info->sps[i];
+        if (zeros >= 2 && byte == 3) {
+            zeros = 0;
+            continue;
+        }
+        zeros = byte ? 0 : zeros + 1;
+        rbsp[len++] = byte;
+    }
+    if (len < sizeof(rbsp))
+        return BUF_INCORRECT;
+
+    uint32_t start_atom = ptr->offset;
+    err = put_u32_be(ptr, 0);
+    chk_err;
+
+    err = put_str4(ptr, "hvcC");
+    chk_err;
+
+    err = put_u8(ptr, 1);
+    chk_err; // 1 version
+    err = put(ptr, (const char *)rbsp + 1, 12);
+    chk_err; // profile_tier_level: 1 profile space, tier and profile
+             // + 4 compatibility flags + 6 constraint flags + 1 level
+    err = put_u16_be(ptr, 0xF000);
+    chk_err; // 4 bits reserved (1111) + 12 bits min_spatial_segmentation
+    err = put_u8(ptr, 0xFC);
+    chk_err; // 6 bits reserved (111111) + 2 bits parallelism type
+    // The encoders only ever put out 8 bits 4:2:0
+    err = put_u8(ptr, 0xFD);
+    chk_err; // 6 bits reserved (111111) + 2 bits chroma format (4:2:0)
+    err = put_u8(ptr, 0xF8);
+    chk_err; // 5 bits reserved (11111) + 3 bits luma bit depth - 8
+    err = put_u8(ptr, 0xF8);
+    chk_err; // 5 bits reserved (11111) + 3 bits chroma bit depth - 8
+    err = put_u16_be(ptr, 0);
+    chk_err; // 2 average frame rate
+    err = put_u8(ptr,
+        (((rbsp[0] >> 1) & 7) + 1) << 3 | (rbsp[0] & 1) << 2 | 3);
+    chk_err; // 2 bits constant frame rate + 3 bits temporal layers
+             // + 1 bit temporal id nested + 2 bits nal size length - 1 (11)
+    err = put_u8(ptr, 3);
+    chk_err; // 1 num arrays
+    err = write_hvcC_array(ptr, 32, moov_info->vps, moov_info->vps_length);
+    chk_err; // VPS
+    err = write_hvcC_array(ptr, 33, moov_info->sps, moov_info->sps_length);
+    chk_err; // SPS
+    err = write_hvcC_array(ptr, 34, moov_info->pps, moov_info->pps_length);
+    chk_err; // PPS
+
+    err = put_u32_be_to_offset(ptr, start_atom, ptr->offset - start_atom);
+    chk_err;
+    return BUF_OK;
+}
+
 enum BufError write_stts(struct BitBuf *ptr) {
     enum BufError err;
     uint32_t start_atom = ptr->offset;
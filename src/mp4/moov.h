@@ -3,8 +3,12 @@
 #include "bitbuf.h"
 
 struct MoovInfo {
+    // H.265 gets described by an hvcC from its VPS, SPS and PPS
+    bool hevc;
     uint8_t profile_idc;
     uint8_t level_idc;
+    char *vps;
+    uint16_t vps_length;
     char *sps;
     uint16_t sps_length;
     char *pps;
@@ -1,29 +1,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <arpa/inet.h>
 
 #include "mp4.h"
 
-uint32_t default_sample_size = 40000;
+uint32_t default_sample_size = MP4_TIMESCALE / 30;
 
 enum BufError create_header();
 
+hal_vidcodec vid_codec = HAL_VIDCODEC_H264;
 short vid_width = 1920, vid_height = 1080;
 char vid_framerate = 30;
 
-char buf_pps[128];
+char buf_pps[256];
 uint16_t buf_pps_len = 0;
-char buf_sps[128];
+char buf_sps[256];
 uint16_t buf_sps_len = 0;
+char buf_vps[256];
+uint16_t buf_vps_len = 0;
 struct BitBuf buf_header;
-struct BitBuf buf_mdat;
-struct BitBuf buf_moof;
 
-void set_mp4_config(short width, short height, char framerate)
+// Access units waiting for the current fragment to be closed
+struct Frame *pend_frames[MP4_MAX_SAMPLES];
+unsigned int pend_count = 0;
+unsigned int frag_frames = 1;
+
+// The last closed fragment, valid until the next call to set_frame, its moof
+// gets patched for every client it goes to, and the one rebuilt from the
+// GOP cache for a client joining late
+struct Mp4Fragment frag, catchup;
+
+void set_mp4_config(hal_vidcodec codec, short width, short height,
+    char framerate)
 {
+    vid_codec = codec;
     vid_width = width;
     vid_height = height;
     vid_framerate = framerate;
+    if (framerate > 0)
+        default_sample_size = MP4_TIMESCALE / framerate;
+}
+
+void set_mp4_fragment(unsigned int duration_ms)
+{
+    frag_frames = duration_ms * vid_framerate / 1000;
+    frag_frames = MAX(1, MIN(frag_frames, MP4_MAX_SAMPLES));
 }
 
 enum BufError create_header() {
@@ -33,9 +55,14 @@ enum BufError create_header() {
         return BUF_OK;
     if (buf_pps_len == 0)
         return BUF_OK;
+    if (vid_codec == HAL_VIDCODEC_H265 && buf_vps_len == 0)
+        return BUF_OK;
 
     struct MoovInfo moov_info;
     memset(&moov_info, 0, sizeof(struct MoovInfo));
+    moov_info.hevc = vid_codec == HAL_VIDCODEC_H265;
+    moov_info.vps = buf_vps;
+    moov_info.vps_length = buf_vps_len;
     moov_info.profile_idc = 100;
     moov_info.level_idc = 41;
     moov_info.width = vid_width;
@@ -43,8 +70,7 @@ enum BufError create_header() {
     moov_info.horizontal_resolution = 0x00480000; // 72 dpi
     moov_info.vertical_resolution = 0x00480000;   // 72 dpi
     moov_info.creation_time = 0;
-    moov_info.timescale =
-        default_sample_size * vid_framerate;
+    moov_info.timescale = MP4_TIMESCALE;
     moov_info.sps = buf_sps;
     moov_info.sps_length = buf_sps_len;
     moov_info.pps = buf_pps;
@@ -55,14 +81,27 @@ enum BufError create_header() {
     chk_err return BUF_OK;
 }
 
+// Sets too long for their buffer are left out rather than cut short
+void set_vps(const char *nal_data, const uint32_t nal_len) {
+    if (nal_len > sizeof(buf_vps))
+        return;
+    memcpy(buf_vps, nal_data, nal_len);
+    buf_vps_len = nal_len;
+    create_header();
+}
+
 void set_sps(const char *nal_data, const uint32_t nal_len) {
-    memcpy(buf_sps, nal_data, MIN(nal_len, sizeof(buf_sps)));
+    if (nal_len > sizeof(buf_sps))
+        return;
+    memcpy(buf_sps, nal_data, nal_len);
     buf_sps_len = nal_len;
     create_header();
 }
 
 void set_pps(const char *nal_data, const uint32_t nal_len) {
-    memcpy(buf_pps, nal_data, MIN(nal_len, sizeof(buf_pps)));
+    if (nal_len > sizeof(buf_pps))
+        return;
+    memcpy(buf_pps, nal_data, nal_len);
     buf_pps_len = nal_len;
     create_header();
 }
@@ -74,56 +113,268 @@ enum BufError get_header(struct BitBuf *ptr) {
     return BUF_OK;
 }
 
-enum BufError set_slice(const char *nal_data, const uint32_t nal_len,
-    const enum NalUnitType unit_type) {
+static bool is_sample_nal(hal_vidcodec codec, unsigned char type) {
+    return !frame_nal_is_param(codec, type) && type !=
+        (codec == HAL_VIDCODEC_H265 ? HevcNalUnitType_AUD : NalUnitType_AUD);
+}
+
+static void release_fragment() {
+    for (unsigned int i = 0; i < frag.samples.frame_count; i++)
+        frame_unref(frag.frames[i]);
+    frag.samples.frame_count = 0;
+}
+
+static uint64_t to_media_time(const struct Frame *frame) {
+    return frame->timestamp * (MP4_TIMESCALE / 1000) / 1000;
+}
+
+// Turns access units into a moof and the pieces of its mdat, each of them
+// becomes a single sample made of its length-prefixed NALs and lasts until
+// the next one, next being the frame that follows the fragment when it is
+// already known
+static enum BufError build_fragment(struct Mp4Fragment *out,
+    struct Frame *const *frames, unsigned int count,
+    const struct Frame *next) {
     enum BufError err;
+    struct SampleInfo samples_info[MP4_MAX_SAMPLES];
+    struct Mp4Samples *samples = &out->samples;
+    uint32_t mdat_len = 0;
 
-    const uint32_t samples_info_len = 1;
-    struct SampleInfo samples_info[1];
-    memset(&samples_info[0], 0, sizeof(struct SampleInfo));
-    samples_info[0].size = nal_len + 4; // add size of sample
-    samples_info[0].composition_offset = default_sample_size;
-    samples_info[0].decode_time = default_sample_size;
-    samples_info[0].duration = default_sample_size;
-    samples_info[0].flags = unit_type == NalUnitType_CodedSliceIdr ? 0 : 65536;
+    samples->iov = out->iov;
+    samples->iovcnt = 0;
+    samples->frames = out->frames;
+    samples->frame_count = 0;
+    samples->keyframe = frames[0]->keyframe;
+    samples->time = to_media_time(frames[0]);
+    samples->duration = 0;
+    uint32_t last_duration = default_sample_size;
 
-    buf_moof.offset = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        struct Frame *frame = frames[i];
+        struct SampleInfo *sample = &samples_info[i];
+        memset(sample, 0, sizeof(struct SampleInfo));
+
+        for (unsigned int j = 0; j < frame->nal_count; j++) {
+            struct FrameNal *nal = &frame->nals[j];
+            if (!is_sample_nal(frame->codec, nal->type))
+                continue;
+            uint32_t *len = &out->lens[samples->iovcnt / 2];
+            *len = htonl(nal->size);
+            out->iov[samples->iovcnt].iov_base = len;
+            out->iov[samples->iovcnt++].iov_len = 4;
+            out->iov[samples->iovcnt].iov_base = frame->data + nal->offset;
+            out->iov[samples->iovcnt++].iov_len = nal->size;
+            sample->size += 4 + nal->size;
+        }
+        // Encoder stamps going backwards or stalling keep the last pace
+        const struct Frame *after = i + 1 < count ? frames[i + 1] : next;
+        uint64_t time = to_media_time(frame);
+        if (after && to_media_time(after) > time &&
+            to_media_time(after) - time < MP4_TIMESCALE)
+            last_duration = to_media_time(after) - time;
+        sample->duration = last_duration;
+        sample->decode_time = samples->duration;
+        samples->duration += sample->duration;
+        sample->flags = frame->keyframe ? 0 : 65536;
+        mdat_len += sample->size;
+
+        out->frames[samples->frame_count++] = frame;
+    }
+
+    out->moof.offset = 0;
     err = write_moof(
-        &buf_moof, 0, 0, 0, default_sample_size, samples_info,
-        samples_info_len);
+        &out->moof, 0, 0, 0, default_sample_size, samples_info,
+        samples->frame_count, &out->moof_pos);
     chk_err
 
-    buf_mdat.offset = 0;
-    err = write_mdat(&buf_mdat, nal_data, nal_len);
+    out->mdat.offset = 0;
+    err = write_mdat_header(&out->mdat, mdat_len);
     chk_err
+    samples->size = mdat_len;
 
     return BUF_OK;
 }
 
-enum BufError set_mp4_state(struct Mp4State *state) {
+// How many of the frames fit in a single fragment
+static unsigned int fragment_take(struct Frame *const *frames,
+    unsigned int count) {
+    unsigned int take = 0, nals = 0;
+    while (take < count && take < MP4_MAX_SAMPLES) {
+        nals += frames[take]->nal_count;
+        if (take && nals * 2 > MP4_MAX_IOV)
+            break;
+        take++;
+    }
+    return take;
+}
+
+// The pending frames hand their references over to the fragment
+static enum BufError close_fragment(const struct Frame *next) {
+    enum BufError err = build_fragment(&frag, pend_frames, pend_count, next);
+    pend_count = 0;
+    return err;
+}
+
+enum BufError set_frame(struct Frame *frame, bool *ready) {
+    enum BufError err = BUF_OK;
+    *ready = false;
+    release_fragment();
+
+    // The H.265 SPS has to reach up to the end of its level_idc
+    bool hevc = frame->codec == HAL_VIDCODEC_H265;
+    unsigned int nals = 0;
+    for (unsigned int i = 0; i < frame->nal_count; i++) {
+        struct FrameNal *nal = &frame->nals[i];
+        const char *nal_data = (const char *)frame->data + nal->offset;
+        if (hevc && nal->type == HevcNalUnitType_VPS)
+            set_vps(nal_data, nal->size);
+        else if (nal->type == (hevc ? HevcNalUnitType_SPS : NalUnitType_SPS) &&
+            nal->size >= (hevc ? 15 : 4))
+            set_sps(nal_data, nal->size);
+        else if (nal->type == (hevc ? HevcNalUnitType_PPS : NalUnitType_PPS))
+            set_pps(nal_data, nal->size);
+        else if (is_sample_nal(frame->codec, nal->type))
+            nals++;
+    }
+    if (!nals)
+        return BUF_OK;
+    // A frame has to fit in a fragment on its own
+    if (nals * 2 > MP4_MAX_IOV) {
+        static bool warned = false;
+        if (!warned)
+            fprintf(stderr, "Frames of more than %d slices can't be muxed, "
+                "dropping them\n", MP4_MAX_IOV / 2);
+        warned = true;
+        return BUF_OK;
+    }
+
+    // Fragments always start on a keyframe so any of them can be joined
+    unsigned int pend_nals = 0;
+    for (unsigned int i = 0; i < pend_count; i++)
+        pend_nals += pend_frames[i]->nal_count;
+    if (pend_count && (frame->keyframe ||
+        (pend_nals + nals) * 2 > MP4_MAX_IOV)) {
+        err = close_fragment(frame);
+        *ready = err == BUF_OK;
+    }
+
+    pend_frames[pend_count++] = frame_ref(frame);
+    if (!*ready && pend_count >= frag_frames) {
+        err = close_fragment(NULL);
+        *ready = err == BUF_OK;
+    }
+
+    return err;
+}
+
+static enum BufError patch_fragment(struct Mp4Fragment *fragment,
+    struct Mp4State *state) {
     enum BufError err;
-    if (pos_sequence_number > 0)
+    struct BitBuf *moof = &fragment->moof;
+    const struct MoofPos *pos = &fragment->moof_pos;
+    // Fragments are placed on the encoder clock, so the estimated length
+    // of a fragment's last sample never makes the timeline drift
+    state->base_media_decode_time = fragment->samples.time > state->start_time ?
+        fragment->samples.time - state->start_time : 0;
+    if (pos->sequence_number > 0)
         err = put_u32_be_to_offset(
-            &buf_moof, pos_sequence_number, state->sequence_number);
-    chk_err if (pos_base_data_offset > 0) err = put_u64_be_to_offset(
-        &buf_moof, pos_base_data_offset, state->base_data_offset);
-    chk_err if (pos_base_media_decode_time > 0) err = put_u64_be_to_offset(
-        &buf_moof, pos_base_media_decode_time,
+            moof, pos->sequence_number, state->sequence_number);
+    chk_err if (pos->base_data_offset > 0) err = put_u64_be_to_offset(
+        moof, pos->base_data_offset, state->base_data_offset);
+    chk_err if (pos->base_media_decode_time > 0) err = put_u64_be_to_offset(
+        moof, pos->base_media_decode_time,
         state->base_media_decode_time);
     chk_err state->sequence_number++;
-    state->base_data_offset += buf_moof.offset + buf_mdat.offset;
-    state->base_media_decode_time += state->default_sample_duration;
+    state->base_data_offset += moof->offset + fragment->mdat.offset +
+        fragment->samples.size;
     return BUF_OK;
 }
+
+enum BufError set_mp4_state(struct Mp4State *state) {
+    return patch_fragment(&frag, state);
+}
 enum BufError get_moof(struct BitBuf *ptr) {
-    ptr->buf = buf_moof.buf;
-    ptr->size = buf_moof.size;
-    ptr->offset = buf_moof.offset;
+    ptr->buf = frag.moof.buf;
+    ptr->size = frag.moof.size;
+    ptr->offset = frag.moof.offset;
     return BUF_OK;
 }
 enum BufError get_mdat(struct BitBuf *ptr) {
-    ptr->buf = buf_mdat.buf;
-    ptr->size = buf_mdat.size;
-    ptr->offset = buf_mdat.offset;
+    ptr->buf = frag.mdat.buf;
+    ptr->size = frag.mdat.size;
+    ptr->offset = frag.mdat.offset;
+    return BUF_OK;
+}
+
+enum BufError get_samples(struct Mp4Samples *ptr) {
+    *ptr = frag.samples;
+    return BUF_OK;
+}
+
+enum BufError get_catchup(unsigned int *start, struct Mp4State *state,
+    struct BitBuf *moof, struct BitBuf *mdat, struct Mp4Samples *samples) {
+    struct Frame *const *frames;
+    unsigned int count = gop_cache_get(&frames), end = 0;
+    enum BufError err;
+
+    samples->frame_count = 0;
+    if (!frag.samples.frame_count || !count || !frames[0]->keyframe)
+        return BUF_OK;
+    // The cache gets each frame before the fragments do, the catch-up
+    // stops where the last closed fragment starts
+    while (end < count && frames[end] != frag.frames[0])
+        end++;
+    if (end == count || *start >= end)
+        return BUF_OK;
+
+    unsigned int take = fragment_take(frames + *start, end - *start);
+    err = build_fragment(&catchup, frames + *start, take, frames[*start + take]);
+    chk_err
+    if (!*start)
+        state->start_time = catchup.samples.time;
+    *start += take;
+
+    err = patch_fragment(&catchup, state);
+    chk_err
+    *moof = catchup.moof;
+    *mdat = catchup.mdat;
+    *samples = catchup.samples;
     return BUF_OK;
-}
\ No newline at end of file
+}
+
+enum BufError get_fragment(struct Mp4Fragment *fragment,
+    struct Mp4State *state, struct Frame *const *frames, unsigned int count,
+    unsigned int *taken) {
+    enum BufError err;
+
+    *taken = 0;
+    fragment->samples.frame_count = 0;
+    if (!count)
+        return BUF_OK;
+    unsigned int take = fragment_take(frames, count);
+    err = build_fragment(fragment, frames, take,
+        take < count ? frames[take] : NULL);
+    chk_err
+    if (!state->header_sent) {
+        struct BitBuf header;
+        get_header(&header);
+        state->sequence_number = 1;
+        state->base_data_offset = header.offset;
+        state->start_time = fragment->samples.time;
+        state->header_sent = true;
+        state->nals_count = 0;
+        state->default_sample_duration = default_sample_size;
+    }
+
+    err = patch_fragment(fragment, state);
+    chk_err
+    *taken = take;
+    return BUF_OK;
+}
+
+void free_fragment(struct Mp4Fragment *fragment) {
+    free(fragment->moof.buf);
+    free(fragment->mdat.buf);
+    memset(&fragment->moof, 0, sizeof(fragment->moof));
+    memset(&fragment->mdat, 0, sizeof(fragment->mdat));
+}
@@ -2,7 +2,9 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
+#include "../frame.h"
 #include "bitbuf.h"
 #include "moof.h"
 #include "moov.h"
@@ -12,23 +14,60 @@
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#define MP4_MAX_SAMPLES 64
+#define MP4_MAX_IOV 512
+// Media clock of the track, the usual 90kHz shared with RTP
+#define MP4_TIMESCALE 90000
+
 extern uint32_t default_sample_size;
 
+// Payload of the mdat of the last closed fragment, to be sent right after
+// the header returned by get_mdat. The frames stay referenced until the
+// next call to set_frame.
+struct Mp4Samples {
+    const struct iovec *iov;
+    unsigned int iovcnt;
+    struct Frame *const *frames;
+    unsigned int frame_count;
+    uint32_t size;
+    // Decode time of the first sample and span of the fragment, in
+    // MP4_TIMESCALE units
+    uint64_t time;
+    uint64_t duration;
+    bool keyframe;
+};
+
+// Moof and mdat header of a fragment with the pieces of its payload
+struct Mp4Fragment {
+    struct BitBuf moof;
+    struct MoofPos moof_pos;
+    struct BitBuf mdat;
+    struct Frame *frames[MP4_MAX_SAMPLES];
+    struct iovec iov[MP4_MAX_IOV];
+    uint32_t lens[MP4_MAX_IOV / 2];
+    struct Mp4Samples samples;
+};
+
 struct Mp4State {
     bool header_sent;
 
     uint32_t sequence_number;
     uint64_t base_data_offset;
     uint64_t base_media_decode_time;
+    // Encoder time mapped to the start of this client's timeline
+    uint64_t start_time;
     uint32_t default_sample_duration;
 
     uint32_t nals_count;
 };
 
-void set_mp4_config(short width, short height, char framerate);
+void set_mp4_config(hal_vidcodec codec, short width, short height,
+    char framerate);
+void set_mp4_fragment(unsigned int duration_ms);
 
-enum BufError set_slice(const char *nal_data, const uint32_t nal_len,
-    const enum NalUnitType unit_type);
+// Queues up an access unit, ready tells whether a fragment has been closed
+enum BufError set_frame(struct Frame *frame, bool *ready);
+void set_vps(const char *nal_data, const uint32_t nal_len);
 void set_sps(const char *nal_data, const uint32_t nal_len);
 void set_pps(const char *nal_data, const uint32_t nal_len);
 
@@ -36,4 +75,23 @@ enum BufError get_header(struct BitBuf *ptr);
 
 enum BufError set_mp4_state(struct Mp4State *state);
 enum BufError get_moof(struct BitBuf *ptr);
-enum BufError get_mdat(struct BitBuf *ptr);
\ No newline at end of file
+// The mdat buffer only holds the box header, the samples follow it
+enum BufError get_mdat(struct BitBuf *ptr);
+enum BufError get_samples(struct Mp4Samples *ptr);
+// Fragments of the GOP cache for a client joining after its keyframe, up
+// to the last closed one, start tells where the next one begins and no
+// samples are returned once they have all been built. The first one also
+// sets the start of the client's timeline, each of them only remains valid
+// until the next call.
+enum BufError get_catchup(unsigned int *start, struct Mp4State *state,
+    struct BitBuf *moof, struct BitBuf *mdat, struct Mp4Samples *samples);
+// Builds the next fragment of a file out of frames held by the caller, such
+// as a clip of the pre-event buffer, into a zeroed fragment of its own that
+// any thread may use as it keeps where its moof gets patched. taken tells
+// how many of the frames went into it, the first one opens the timeline of
+// the state. The fragment only borrows the frames and its buffers get
+// reused until free_fragment.
+enum BufError get_fragment(struct Mp4Fragment *fragment,
+    struct Mp4State *state, struct Frame *const *frames, unsigned int count,
+    unsigned int *taken);
+void free_fragment(struct Mp4Fragment *fragment);
@@ -25,6 +25,13 @@ enum NalUnitType {                    //   Table 7-1 NAL unit type codes
     // 24..31           // Unspecified
 };
 
+enum HevcNalUnitType {         //   Table 7-1 of H.265, non-VCL units
+    HevcNalUnitType_VPS = 32,  // Video parameter set
+    HevcNalUnitType_SPS = 33,  // Sequence parameter set
+    HevcNalUnitType_PPS = 34,  // Picture parameter set
+    HevcNalUnitType_AUD = 35,  // Access unit delimiter
+};
+
 char *nal_type_to_str(const enum NalUnitType nal_type);
 
 struct NAL {
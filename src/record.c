@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame.h"
+#include "mp4/mp4.h"
+#include "storage.h"
+
+#define tag "[record]: "
+
+// Files are written in whole blocks starting on block boundaries, which
+// spares the card's controller from rewriting the same erase block many
+// times over
+#define RECORD_BLOCK (128 * 1024)
+// Pending data that does not fill a block is written out after this long
+#define RECORD_FLUSH_MS 2000
+// Fragments waiting to be written, beyond that they get dropped. With a
+// fragment per frame that still covers half a minute.
+#define RECORD_QUEUE_LEN 1024
+// Vectors written at once
+#define RECORD_IOV 256
+
+// The payload of a fragment stays in its frames, only the boxes around it
+// are copied. The first fragment of a file carries the id it has in the
+// storage catalog, 0 when it couldn't get one.
+struct RecordEntry {
+    struct Packet packet;
+    bool start;
+    unsigned int id;
+};
+
+pthread_t recordPid = 0;
+pthread_mutex_t recordLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recordCond = PTHREAD_COND_INITIALIZER;
+
+// Write-behind queue bounded by recordSize bytes, the encoder thread only
+// appends to it and the recording thread takes from its front, sent being
+// what has already been written of the first fragment
+static struct RecordEntry recordQueue[RECORD_QUEUE_LEN];
+static unsigned int queueHead = 0, queueCount = 0, queueSent = 0;
+static unsigned int recordSize = 0, recordQueued = 0;
+static bool recordStop = false;
+
+// Only touched by the encoder thread
+static struct Mp4State recordState;
+static uint64_t fileTime = 0;
+static unsigned int fileId = 0;
+static bool recordSkip = false;
+static unsigned int recordDropped = 0;
+// Keyframe fragments of the current file, written out as its mfra
+static struct RandomAccess *recordIndex = NULL;
+static unsigned int indexCount = 0, indexCap = 0;
+static struct BitBuf recordMfra;
+
+static unsigned long long record_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+// Appends fragments once there is room for all of them, the lock has to
+// be held
+static bool record_queue(struct RecordEntry *entries, unsigned int count) {
+    unsigned int size = 0;
+    for (unsigned int i = 0; i < count; i++)
+        size += entries[i].packet.size;
+    if (recordSize - recordQueued < size ||
+        RECORD_QUEUE_LEN - queueCount < count)
+        return false;
+
+    for (unsigned int i = 0; i < count; i++)
+        recordQueue[(queueHead + queueCount++) % RECORD_QUEUE_LEN] =
+            entries[i];
+    recordQueued += size;
+    pthread_cond_signal(&recordCond);
+    return true;
+}
+
+// Lets go of what has been written from the front of the queue, the lock
+// has to be held
+static void record_release(unsigned int len) {
+    queueSent += len;
+    while (queueCount && queueSent >= recordQueue[queueHead].packet.size) {
+        struct Packet *packet = &recordQueue[queueHead].packet;
+        queueSent -= packet->size;
+        recordQueued -= packet->size;
+        packet_free(packet);
+        queueHead = (queueHead + 1) % RECORD_QUEUE_LEN;
+        queueCount--;
+    }
+}
+
+static void record_index_add(uint64_t moof_offset, uint64_t time) {
+    if (indexCount == indexCap) {
+        unsigned int cap = indexCap ? indexCap * 2 : 256;
+        struct RandomAccess *index =
+            realloc(recordIndex, cap * sizeof(struct RandomAccess));
+        if (!index)
+            return;
+        recordIndex = index;
+        indexCap = cap;
+    }
+    recordIndex[indexCount].moof_offset = moof_offset;
+    recordIndex[indexCount++].time = time;
+}
+
+// Builds the mfra closing the current file, gives its size
+static unsigned int record_index_build() {
+    recordMfra.offset = 0;
+    if (!recordState.header_sent || !indexCount ||
+        write_mfra(&recordMfra, recordIndex, indexCount) != BUF_OK)
+        return 0;
+    return recordMfra.offset;
+}
+
+void record_fragment() {
+    static struct iovec iov[MP4_MAX_IOV + 3];
+    struct BitBuf header, moof, mdat;
+    struct Mp4Samples samples;
+
+    if (!recordSize)
+        return;
+    get_header(&header);
+    if (!header.offset)
+        return;
+    get_samples(&samples);
+
+    // Files start on a keyframe once the current one has lasted long enough,
+    // fragments dropped for lack of room are skipped up to the next one
+    uint64_t span = app_config.record_file_duration * 60ULL * MP4_TIMESCALE;
+    bool start = samples.keyframe &&
+        (!recordState.header_sent || samples.time - fileTime >= span);
+    if (!samples.keyframe && (recordSkip || !recordState.header_sent))
+        return;
+
+    struct Mp4State state = recordState;
+    if (start) {
+        state.sequence_number = 1;
+        state.base_data_offset = header.offset;
+        state.base_media_decode_time = 0;
+        state.start_time = samples.time;
+        state.header_sent = true;
+        state.nals_count = 0;
+        state.default_sample_duration = default_sample_size;
+    }
+
+    get_moof(&moof);
+    get_mdat(&mdat);
+
+    // The moof gets patched for this file, the state only moves forward
+    // once the fragment is in
+    uint64_t moof_offset = state.base_data_offset;
+    if (set_mp4_state(&state) != BUF_OK)
+        return;
+
+    // The mfra closes the previous file ahead of the first fragment of the
+    // next one, both go in or neither does
+    struct RecordEntry entries[2];
+    unsigned int count = 0, iovcnt = 0, id = 0;
+    if (start) {
+        unsigned int index = record_index_build();
+        struct iovec mfra = { .iov_base = recordMfra.buf, .iov_len = index };
+        if (index && packet_init(&entries[count].packet, &mfra, 1, NULL, 0))
+            entries[count++].start = false;
+        id = storage_add(time(NULL));
+        iov[iovcnt].iov_base = header.buf;
+        iov[iovcnt++].iov_len = header.offset;
+    }
+    iov[iovcnt].iov_base = moof.buf;
+    iov[iovcnt++].iov_len = moof.offset;
+    iov[iovcnt].iov_base = mdat.buf;
+    iov[iovcnt++].iov_len = mdat.offset;
+    for (unsigned int i = 0; i < samples.iovcnt; i++)
+        iov[iovcnt++] = samples.iov[i];
+
+    bool queued = false;
+    if (packet_init(&entries[count].packet, iov, iovcnt, samples.frames,
+        samples.frame_count)) {
+        entries[count].start = start;
+        entries[count++].id = id;
+        pthread_mutex_lock(&recordLock);
+        queued = record_queue(entries, count);
+        pthread_mutex_unlock(&recordLock);
+    }
+    if (!queued) {
+        for (unsigned int i = 0; i < count; i++)
+            packet_free(&entries[i].packet);
+        if (id)
+            storage_remove(id);
+        if (!recordDropped++)
+            printf(tag "The card can't keep up, dropping fragments\n");
+        recordSkip = true;
+        return;
+    }
+    if (start) {
+        indexCount = 0;
+        fileTime = samples.time;
+        fileId = id;
+    }
+
+    recordState = state;
+    recordSkip = false;
+    if (samples.keyframe) {
+        record_index_add(moof_offset, state.base_media_decode_time);
+        storage_keyframe(fileId);
+    }
+}
+
+static int record_open(unsigned int id) {
+    char name[sizeof(app_config.record_path) + 32];
+
+    if (!storage_path(id, name, sizeof(name)))
+        return -1;
+    mkdir(app_config.record_path, 0755);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf(tag "Can't create %s: %s\n", name, strerror(errno));
+        storage_remove(id);
+        return -1;
+    }
+    // The whole file gets reserved upfront so it ends up contiguous on the
+    // card, what is left of it goes back when the file is closed
+    off_t expected = (off_t)app_config.mp4_bitrate * 1024 / 8 *
+        app_config.record_file_duration * 60;
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expected + expected / 8);
+    printf(tag "Recording to %s\n", name);
+    return fd;
+}
+
+static void record_close(int fd, unsigned int id, off_t size) {
+    if (fd < 0)
+        return;
+    ftruncate(fd, size);
+    fdatasync(fd);
+    close(fd);
+    storage_written(id, size);
+    storage_close(id);
+}
+
+// Vectors for up to len bytes of the queue, from that far past what has
+// already been written of it
+static int record_gather(struct iovec *iov, unsigned int from,
+    unsigned int len) {
+    unsigned int skip = queueSent + from;
+    int iovcnt = 0;
+    for (unsigned int p = 0; len && iovcnt < RECORD_IOV; p++) {
+        struct Packet *packet =
+            &recordQueue[(queueHead + p) % RECORD_QUEUE_LEN].packet;
+        for (int j = 0; j < packet->iovcnt && len && iovcnt < RECORD_IOV;
+            j++) {
+            if (skip >= packet->iov[j].iov_len) {
+                skip -= packet->iov[j].iov_len;
+                continue;
+            }
+            iov[iovcnt].iov_base = (char *)packet->iov[j].iov_base + skip;
+            iov[iovcnt].iov_len = MIN(packet->iov[j].iov_len - skip, len);
+            len -= iov[iovcnt++].iov_len;
+            skip = 0;
+        }
+    }
+    return iovcnt;
+}
+
+// Writes len bytes from the front of the queue at offset in the file, the
+// lock isn't held as nothing but this thread takes fragments out of it
+static bool record_write(int fd, off_t offset, unsigned int len) {
+    // Kept off the small stack of the thread
+    static struct iovec iov[RECORD_IOV];
+    unsigned int done = 0;
+    while (done < len) {
+        int iovcnt = record_gather(iov, done, len - done);
+        ssize_t n = pwritev(fd, iov, iovcnt, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+static void *record_thread(void *arg) {
+    int fd = -1;
+    unsigned int id = 0;
+    off_t written = 0;
+    bool failed = false;
+    unsigned long long flushed = record_now();
+
+    pthread_mutex_lock(&recordLock);
+    while (true) {
+        // The stream moves on to the next file once the current one is over
+        struct RecordEntry *first = &recordQueue[queueHead];
+        if (queueCount && !queueSent && first->start) {
+            unsigned int next = first->id;
+            first->start = false;
+            pthread_mutex_unlock(&recordLock);
+            record_close(fd, id, written);
+            id = next;
+            fd = record_open(id);
+            written = 0;
+            failed = false;
+            pthread_mutex_lock(&recordLock);
+            continue;
+        }
+
+        // What is left of the current file
+        unsigned int len = 0;
+        bool end = false;
+        for (unsigned int p = 0; p < queueCount && !end; p++) {
+            struct RecordEntry *entry =
+                &recordQueue[(queueHead + p) % RECORD_QUEUE_LEN];
+            end = entry->start;
+            if (!end)
+                len += entry->packet.size;
+        }
+        len -= queueSent;
+        // Only whole blocks go out unless the file or the recording is over
+        // or the data has waited long enough
+        if (!recordStop && !end && record_now() - flushed < RECORD_FLUSH_MS)
+            len = (written + len) / RECORD_BLOCK * RECORD_BLOCK > written ?
+                (written + len) / RECORD_BLOCK * RECORD_BLOCK - written : 0;
+
+        if (!len) {
+            if (recordStop && !queueCount)
+                break;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 500 * 1000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&recordCond, &recordLock, &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&recordLock);
+
+        // Without a file to go to the data still has to leave the queue
+        if (fd >= 0 && !failed && !record_write(fd, written, len)) {
+            printf(tag "Writing failed: %s\n", strerror(errno));
+            failed = true;
+        }
+        written += len;
+        if (fd >= 0 && !failed)
+            storage_written(id, written);
+        flushed = record_now();
+
+        pthread_mutex_lock(&recordLock);
+        record_release(len);
+    }
+    pthread_mutex_unlock(&recordLock);
+
+    record_close(fd, id, written);
+    return NULL;
+}
+
+int start_record() {
+    if (!app_config.mp4_enable) {
+        printf(tag "Recording takes the mp4 stream, which is disabled\n");
+        return EXIT_FAILURE;
+    }
+
+    // Unless set, the buffer holds 10 seconds of the mp4 bitrate
+    recordSize = app_config.record_buffer_size * 1024;
+    if (!recordSize)
+        recordSize = MAX(app_config.mp4_bitrate * 1024 / 8 * 10, 2 * RECORD_BLOCK);
+    recordStop = false;
+
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    size_t stacksize;
+    pthread_attr_getstacksize(&thread_attr, &stacksize);
+    size_t new_stacksize = 16 * 1024;
+    if (pthread_attr_setstacksize(&thread_attr, new_stacksize)) {
+        printf(tag "Can't set stack size %zu\n", new_stacksize);
+    }
+    if (pthread_create(&recordPid, &thread_attr, record_thread, NULL)) {
+        printf(tag "Starting the recording thread failed!\n");
+        recordSize = 0;
+        pthread_attr_destroy(&thread_attr);
+        return EXIT_FAILURE;
+    }
+    if (pthread_attr_setstacksize(&thread_attr, stacksize)) {
+        printf(tag "Error:  Can't set stack size %zu\n", stacksize);
+    }
+    pthread_attr_destroy(&thread_attr);
+    return EXIT_SUCCESS;
+}
+
+// Called once the encoder is stopped, what is left in the queue is written
+// out before the thread ends
+void stop_record() {
+    if (!recordSize)
+        return;
+    // The encoder is done, the last file gets its index as well
+    struct RecordEntry mfra = { .start = false };
+    unsigned int index = record_index_build();
+    struct iovec iov = { .iov_base = recordMfra.buf, .iov_len = index };
+    bool built = index && packet_init(&mfra.packet, &iov, 1, NULL, 0);
+    pthread_mutex_lock(&recordLock);
+    if (built && !record_queue(&mfra, 1))
+        packet_free(&mfra.packet);
+    recordStop = true;
+    pthread_cond_signal(&recordCond);
+    pthread_mutex_unlock(&recordLock);
+    pthread_join(recordPid, NULL);
+
+    recordSize = 0;
+    free(recordIndex);
+    recordIndex = NULL;
+    indexCount = indexCap = 0;
+    free(recordMfra.buf);
+    memset(&recordMfra, 0, sizeof(recordMfra));
+    memset(&recordState, 0, sizeof(recordState));
+}
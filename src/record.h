@@ -0,0 +1,14 @@
+#pragma once
+
+#include "common.h"
+
+extern char keepRunning;
+
+// Fragments of the MP4 channel are copied into a write-behind buffer by the
+// encoder thread and written to files under the record path by a thread of
+// their own, so a slow card never holds up the encoder
+int start_record();
+void stop_record();
+
+// Takes the fragment closed by the last call to set_frame
+void record_fragment();
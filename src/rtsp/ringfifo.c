@@ -1,112 +1,221 @@
 #include "ringfifo.h"
 
 #include <ctype.h>
+#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "rtputils.h"
 #include "rtspservice.h"
 
-#define SLOTS 32
+#define SLOTS 128
+// Distance past which a consumer gives up and jumps to the newest keyframe
+#define SLOTS_LAG (SLOTS / 2)
+
+struct ring {
+    struct ringbuf slots[SLOTS];
+    // Free-running sequence numbers, a slot is found at seq % SLOTS. Only
+    // the encoder moves head and keyPos, only the scheduler moves tail.
+    unsigned int head, tail, keyPos;
+    unsigned int dropped;
+    // Bytes held by the frames in the ring
+    unsigned int bytes;
+};
+
+struct ring rings[RING_STREAMS];
+// Most every ring should keep
+unsigned int ringBudget = 0;
+// Wakes the scheduler up whenever a frame gets published on any ring
+int ringEvent = -1;
+
+static bool ring_in_range(unsigned int pos, unsigned int tail,
+    unsigned int head) {
+    return (int)(pos - tail) >= 0 && (int)(head - pos) > 0;
+}
 
-int writePos = 0;
-int readPos = 0;
-int slot = 0;
+void ring_init(unsigned int budget) {
+    memset(rings, 0, sizeof(rings));
+    ringBudget = budget;
+    ringEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ringEvent < 0)
+        fprintf(stderr, "Can't create the RTSP ring event, polling instead\n");
+}
 
-struct ringbuf ringFifo[SLOTS];
+void ring_free() {
+    printf("Freeing the RTSP ring buffer!\n");
+    for (int s = 0; s < RING_STREAMS; s++) {
+        struct ring *ring = &rings[s];
+        for (int i = 0; i < SLOTS; i++) {
+            frame_unref(ring->slots[i].frame);
+            ring->slots[i].frame = NULL;
+            ring->slots[i].size = 0;
+        }
+        ring->tail = ring->head;
+        ring->bytes = 0;
+    }
+    if (ringEvent >= 0) {
+        close(ringEvent);
+        ringEvent = -1;
+    }
+}
 
-void ring_malloc(int size) {
-    for (int i = 0; i < SLOTS; i++) {
-        ringFifo[i].buffer = malloc(size);
-        ringFifo[i].size = 0;
-        ringFifo[i].frame_type = 0;
+void ring_put(enum ringstream stream, struct Frame *frame, int encode_type) {
+    struct ring *ring = &rings[stream];
+    unsigned int head = ring->head;
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    // Only a stalled scheduler can fill the ring, laggards skip ahead
+    if (head - tail >= SLOTS) {
+        if (!(ring->dropped++ % 100))
+            fprintf(stderr, "RTSP ring is full, dropped %u frames so far\n",
+                ring->dropped);
+        return;
+    }
+
+    struct ringbuf *slot = &ring->slots[head % SLOTS];
+    slot->frame = frame_ref(frame);
+    slot->size = frame->size;
+    slot->frame_type = encode_type;
+    __atomic_add_fetch(&ring->bytes, frame->size, __ATOMIC_RELAXED);
+
+    if (encode_type == FRAME_TYPE_I)
+        __atomic_store_n(&ring->keyPos, head, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    if (ringEvent >= 0) {
+        uint64_t one = 1;
+        write(ringEvent, &one, sizeof(one));
     }
-    writePos = 0;
-    readPos = 0;
-    slot = 0;
 }
 
-void ring_reset() {
-    writePos = 0;
-    readPos = 0;
-    slot = 0;
+// Starts a new consumer on the newest keyframe still in the ring, tells
+// whether there was one or it has to wait for the next
+bool ring_cursor_init(struct ringcursor *cursor, enum ringstream stream) {
+    struct ring *ring = &rings[stream];
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    unsigned int key = __atomic_load_n(&ring->keyPos, __ATOMIC_RELAXED);
+    bool found = ring_in_range(key, tail, head);
+
+    cursor->stream = stream;
+    cursor->pos = found ? key : head;
+    cursor->synced = false;
+    return found;
 }
 
-void ring_free() {
-    printf("Freeing the RTSP ring buffer!\n");
-    for (int i = 0; i < SLOTS; i++) {
-        free(ringFifo[i].buffer);
-        ringFifo[i].size = 0;
+// Hands out the next frame for this cursor, the frame stays valid until
+// the scheduler retires its position
+bool ring_get(struct ringcursor *cursor, struct ringbuf *getinfo) {
+    struct ring *ring = &rings[cursor->stream];
+    unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned int key = __atomic_load_n(&ring->keyPos, __ATOMIC_RELAXED);
+
+    if (!ring_in_range(cursor->pos, ring->tail, head + 1) ||
+        head - cursor->pos > SLOTS_LAG) {
+        cursor->pos = ring_in_range(key, ring->tail, head) &&
+            (int)(key - cursor->pos) > 0 ? key : head;
+        cursor->synced = false;
+    }
+
+    while (cursor->pos != head) {
+        struct ringbuf *slot = &ring->slots[cursor->pos++ % SLOTS];
+        if (!cursor->synced && slot->frame_type != FRAME_TYPE_I)
+            continue;
+        cursor->synced = true;
+        *getinfo = *slot;
+        return true;
     }
+
+    return false;
 }
 
-int ring_add(int count) {
-    return (count + 1) == SLOTS ? 0 : count + 1;
+bool ring_cursor_before(struct ringcursor *cursor, unsigned int pos) {
+    return (int)(cursor->pos - pos) < 0;
 }
 
-int ring_get(struct ringbuf *getinfo) {
-    if (slot > 0) {
-        int pos = readPos;
-        readPos = ring_add(readPos);
-        slot--;
-        getinfo->buffer = (ringFifo[pos].buffer);
-        getinfo->frame_type = ringFifo[pos].frame_type;
-        getinfo->size = ringFifo[pos].size;
-        return ringFifo[pos].size;
-    } else return 0;
+unsigned int ring_head(enum ringstream stream) {
+    return __atomic_load_n(&rings[stream].head, __ATOMIC_ACQUIRE);
 }
 
-void ring_put(unsigned char *buffer, int size, int encode_type) {
+// Sleeps until the encoder publishes a frame or the timeout runs out
+void ring_wait(int timeout_ms) {
+    if (ringEvent < 0) {
+        struct timespec ts = {0, 5 * 1000 * 1000};
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    struct pollfd pfd = { .fd = ringEvent, .events = POLLIN };
+    if (poll(&pfd, 1, timeout_ms) > 0) {
+        uint64_t count;
+        read(ringEvent, &count, sizeof(count));
+    }
+}
 
-    if (slot < SLOTS) {
-        memcpy(ringFifo[writePos].buffer, buffer, size);
-        ringFifo[writePos].size = size;
-        ringFifo[writePos].frame_type = encode_type;
-        writePos = ring_add(writePos);
-        slot++;
+// Drops the frames before pos, every consumer has to be past them, then
+// evicts the oldest ones left while they add up to more than the budget,
+// the consumers still on them will jump to the newest keyframe. The GOP of
+// the newest keyframe is kept for new sessions to start on right away, as
+// long as it is not so long that it would get in the way of the encoder.
+void ring_retire(enum ringstream stream, unsigned int pos) {
+    struct ring *ring = &rings[stream];
+    unsigned int tail = ring->tail, head = ring_head(stream);
+    unsigned int key = __atomic_load_n(&ring->keyPos, __ATOMIC_RELAXED);
+
+    if (!ring_in_range(pos, tail, head + 1))
+        pos = tail;
+    if (ring_in_range(key, tail, head) && head - key <= SLOTS_LAG &&
+        (int)(key - pos) < 0)
+        pos = key;
+    for (; tail != head; tail++) {
+        if (tail == pos) {
+            if (!ringBudget || tail + 1 == head ||
+                __atomic_load_n(&ring->bytes, __ATOMIC_RELAXED) <= ringBudget)
+                break;
+            pos++;
+        }
+        struct ringbuf *slot = &ring->slots[tail % SLOTS];
+        __atomic_sub_fetch(&ring->bytes, slot->size, __ATOMIC_RELAXED);
+        frame_unref(slot->frame);
+        slot->frame = NULL;
+        slot->size = 0;
     }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
 }
 
 /*
-Put the H264 stream data into ringFifo[writePos].buffer so that the schedule_do
-thread can take out the data from ringfifo[readPos].buffer and send it out.
+Put a reference to the H264 frame into the ring so that every session on
+the schedule_do thread can take it out from its own cursor and send it out.
 In the same DESCRIBE step, SPS and PPS encoding will be sent to the client. 
 */
-int put_h264_data_to_buffer(hal_vidstream *stream)
+int put_h264_data_to_buffer(struct Frame *frame)
 {
-    unsigned char *pstr;
-    int iframe = 0, len = 0, off = 0, len2 = 2;
-
-    for (int i = 0; i < stream->count; i++)
-        len += stream->pack[i].length - stream->pack[i].offset;
-
-    int testlen = 0;
-    if (slot < SLOTS) {
-        for (int i = 0; i < stream->count; i++) {
-            memcpy(ringFifo[writePos].buffer + off,
-                stream->pack[i].data + stream->pack[i].offset,
-                stream->pack[i].length - stream->pack[i].offset);
-            pstr = stream->pack[i].data + 
-                stream->pack[i].offset; // Address of valid data
-            off += stream->pack[i].length - 
-                stream->pack[i].offset; // Next address of valid data
-
-            if (pstr[4] == 0x67) {
-                rtsp_update_sps(ringFifo[writePos].buffer + off, 9);
-                iframe = 1;
-            }
-            else if (pstr[4] == 0x68)
-                rtsp_update_pps(ringFifo[writePos].buffer + off, 4);
-        }
-        ringFifo[writePos].size = len;
-        if (iframe)
-            ringFifo[writePos].frame_type = FRAME_TYPE_I;
-        else
-            ringFifo[writePos].frame_type = FRAME_TYPE_P;
-        writePos = ring_add(writePos);
-        slot++;
+    bool hevc = frame->codec == HAL_VIDCODEC_H265;
+
+    for (unsigned int i = 0; i < frame->nal_count; i++) {
+        struct FrameNal *nal = &frame->nals[i];
+        unsigned char *data = frame->data + nal->offset;
+        if (hevc && nal->type == 32)
+            rtsp_update_vps(data, nal->size);
+        else if (nal->type == (hevc ? 33 : 7))
+            rtsp_update_sps(data, nal->size);
+        else if (nal->type == (hevc ? 34 : 8))
+            rtsp_update_pps(data, nal->size);
     }
 
+    ring_put(RING_VIDEO, frame, frame->keyframe ? FRAME_TYPE_I : FRAME_TYPE_P);
+
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+// Every JPEG stands on its own, a session can start from any of them
+int put_mjpeg_data_to_buffer(struct Frame *frame)
+{
+    ring_put(RING_MJPEG, frame, FRAME_TYPE_I);
+
+    return EXIT_SUCCESS;
+}
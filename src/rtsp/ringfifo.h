@@ -1,18 +1,43 @@
 #pragma once
 
 #include "../common.h"
+#include "../frame.h"
 
 struct ringbuf {
-    unsigned char *buffer;
+    struct Frame *frame;
     int frame_type;
     int size;
 };
 
-int ring_add(int count);
-int ring_get(struct ringbuf *getinfo);
-void ring_put(unsigned char *buffer, int size, int encode_type);
+// The encoder channels served over RTSP, each of them with its own ring
+enum ringstream {
+    RING_VIDEO,
+    RING_MJPEG,
+    RING_STREAMS
+};
+
+// Read position of a single consumer, it only ever resumes on a keyframe
+// after falling behind the frames still held by the ring
+struct ringcursor {
+    enum ringstream stream;
+    unsigned int pos;
+    bool synced;
+};
+
+// The encoder thread is the only producer, every consumer runs on the
+// scheduling thread with its own cursor and the ring only lets go of the
+// frames all of them have gone past, short of the last GOP which new
+// consumers start from
+void ring_init(unsigned int budget);
 void ring_free();
-void ring_malloc(int size);
-void ring_reset();
+void ring_put(enum ringstream stream, struct Frame *frame, int encode_type);
+
+bool ring_cursor_init(struct ringcursor *cursor, enum ringstream stream);
+bool ring_get(struct ringcursor *cursor, struct ringbuf *getinfo);
+bool ring_cursor_before(struct ringcursor *cursor, unsigned int pos);
+unsigned int ring_head(enum ringstream stream);
+void ring_wait(int timeout_ms);
+void ring_retire(enum ringstream stream, unsigned int pos);
 
-int put_h264_data_to_buffer(hal_vidstream *stream);
\ No newline at end of file
+int put_h264_data_to_buffer(struct Frame *frame);
+int put_mjpeg_data_to_buffer(struct Frame *frame);
@@ -1,9 +1,11 @@
+#define _GNU_SOURCE
 #include "rtputils.h"
 
 #include <errno.h>
 #include <net/if.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,11 +14,34 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rtspservice.h"
 #include "rtsputils.h"
 
+// Packets handed to the kernel at once, a 200kB keyframe fits in two
+#define RTP_BATCH 128
+// Packets per segmented send, their total must stay under 64kB
+#define RTP_GSO_SEGS 40
+// Frames whose packets are kept around for the sessions lagging behind
+#define RTP_CACHE_FRAMES 4
+// Interleaved frame prefix, RTP header and payload header, the longest
+// being the JPEG one followed by its restart marker header
+#define RTP_TCP_HDR 28
+// Milliseconds between two sender reports
+#define RTCP_INTERVAL 5000
+// Seconds from the NTP epoch to the Unix one
+#define NTP_OFFSET 2208988800U
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
 typedef struct {
     /**/                                   /* byte 0 */
     unsigned char u4CSrcLen : 4; /**/    /* expect 0 */
@@ -29,9 +54,9 @@ typedef struct {
     /**/                                   /* bytes 2, 3 */
     unsigned short u16SeqNum;
     /**/ /* bytes 4-7 */
-    unsigned long long u32TimeStamp;
-    /**/                          /* bytes 8-11 */
-    unsigned long u32SSrc; /**/ /* stream number is used here. */
+    unsigned int u32TimeStamp;
+    /**/                         /* bytes 8-11 */
+    unsigned int u32SSrc; /**/ /* stream number is used here. */
 } StRtpFixedHdr;
 
 typedef struct {
@@ -40,19 +65,6 @@ typedef struct {
     unsigned char u1F : 1;
 } StNaluHdr;
 
-typedef struct {
-    unsigned char u5Type : 5;
-    unsigned char u2Nri : 2;
-    unsigned char u1F : 1;
-} StFuIndicator;
-
-typedef struct {
-    unsigned char u5Type : 5;
-    unsigned char u1R : 1;
-    unsigned char u1E : 1;
-    unsigned char u1S : 1;
-} StFuHdr;
-
 typedef struct _tagStRtpHandle {
     int s32Sock;
     struct sockaddr_in stServAddr;
@@ -62,11 +74,32 @@ typedef struct _tagStRtpHandle {
     unsigned long long u32CurrTime;
     unsigned long long u32PrevTime;
     unsigned int u32SSrc;
+    // Interleaved sessions write to the queue of their RTSP connection
+    struct RtpQueue *pQueue;
+    unsigned char u8Channel, u8RtcpChannel;
+    // RTCP, the viewer reports may come from the control thread when
+    // interleaved so they are guarded by their own lock
+    int s32RtcpSock;
+    struct sockaddr_in stRtcpAddr;
+    unsigned int u32Packets, u32Octets;
+    unsigned long long u64FrameTime, u64LastSr;
+    pthread_mutex_t stStatLock;
+    unsigned int u32LastSrNtp;
+    struct RtcpStats stStats;
     StRtpFixedHdr *pRtpFixedHdr;
     StNaluHdr *pNaluHdr;
-    StFuIndicator *pFuInd;
-    StFuHdr *pFuHdr;
     rtpPayload emPayload;
+
+    // Packets of the access unit being sent, built once per session
+    int s32Gso;
+    int s32PktCnt, s32MsgCnt;
+    struct mmsghdr stMsgs[RTP_BATCH];
+    unsigned short u16SegSize[RTP_BATCH];
+    char s8SegOpen[RTP_BATCH];
+    struct iovec stIov[RTP_BATCH * 2];
+    char s8Hdr[RTP_BATCH][24] __attribute__((aligned(4)));
+    char s8Cmsg[RTP_BATCH][CMSG_SPACE(sizeof(uint16_t))]
+        __attribute__((aligned(8)));
 } StRtpObj, *rtpHandle;
 
 unsigned int rtp_create(unsigned int ip, int port, rtpPayload payload) {
@@ -81,7 +114,8 @@ unsigned int rtp_create(unsigned int ip, int port, rtpPayload payload) {
         goto cleanup;
     }
 
-    handle->s32Sock = -1;
+    handle->s32Sock = handle->s32RtcpSock = -1;
+    pthread_mutex_init(&handle->stStatLock, NULL);
     if ((handle->s32Sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         printf("Failed to create socket\n");
         goto cleanup;
@@ -114,6 +148,15 @@ unsigned int rtp_create(unsigned int ip, int port, rtpPayload payload) {
 
     handle->emPayload = payload;
 
+    for (int i = 0; i < RTP_BATCH; i++) {
+        handle->stMsgs[i].msg_hdr.msg_name = &handle->stServAddr;
+        handle->stMsgs[i].msg_hdr.msg_namelen = sizeof(handle->stServAddr);
+    }
+    // Kernels before 4.18 refuse the option, packets then go one by one
+    int s32Seg = 0;
+    handle->s32Gso = !setsockopt(handle->s32Sock, SOL_UDP, UDP_SEGMENT,
+        &s32Seg, sizeof(s32Seg));
+
     //获取本机网络设备名
     strcpy(stIfr.ifr_name, "eth0");
     if (ioctl(handle->s32Sock, SIOCGIFADDR, &stIfr) < 0) {
@@ -136,12 +179,35 @@ cleanup:
             close(handle->s32Sock);
         }
 
+        pthread_mutex_destroy(&handle->stStatLock);
         free(handle);
     }
 
     return 0;
 }
 
+// A single sender for every viewer of the group, whose packets leave the
+// interface chosen by the routing table for the group address
+unsigned int rtp_create_multicast(unsigned int group, int port, int ttl,
+    rtpPayload payload) {
+    unsigned int rtp = rtp_create(group, port, payload);
+    rtpHandle handle = (rtpHandle)rtp;
+    unsigned char u8Ttl = ttl, u8Loop = 1;
+
+    if (!handle)
+        return 0;
+    if (setsockopt(handle->s32Sock, IPPROTO_IP, IP_MULTICAST_TTL, &u8Ttl,
+            sizeof(u8Ttl)) < 0 ||
+        setsockopt(handle->s32Sock, IPPROTO_IP, IP_MULTICAST_LOOP, &u8Loop,
+            sizeof(u8Loop)) < 0) {
+        printf("Failed to set up the multicast socket\n");
+        rtp_delete(rtp);
+        return 0;
+    }
+
+    return rtp;
+}
+
 void rtp_delete(unsigned int rtp) {
     rtpHandle handle = (rtpHandle)rtp;
 
@@ -149,198 +215,799 @@ void rtp_delete(unsigned int rtp) {
         if (handle->s32Sock >= 0) {
             close(handle->s32Sock);
         }
+        if (handle->s32RtcpSock >= 0) {
+            close(handle->s32RtcpSock);
+        }
 
+        pthread_mutex_destroy(&handle->stStatLock);
         free(handle);
     }
 }
 
-static int rtp_send_naluh264(rtpHandle handle, char *nalBuf, int nalSize) {
-    char *naluPayload;
-    char *sendBuf;
-    int s32Bytes = 0;
-    int ret = 0;
-    struct timeval stTimeval;
-    char *pNaluCurr;
-    int s32NaluRemain;
-    unsigned char u8NaluBytes;
+// Output of an RTSP connection carrying interleaved packets, filled by the
+// scheduler and the control replies, drained whenever the socket allows.
+// Replies go in as control packets so congestion never drops them.
+struct RtpQueue {
+    int fd;
+    pthread_mutex_t lock;
+    struct PacketQueue packets;
+    bool failed;
+};
+
+struct RtpQueue *rtp_queue_create(int fd) {
+    struct RtpQueue *queue = calloc(1, sizeof(struct RtpQueue));
+
+    if (!queue) {
+        printf("Failed to create RTP queue\n");
+        return NULL;
+    }
+    queue->fd = fd;
+    pthread_mutex_init(&queue->lock, NULL);
+    packet_queue_init(&queue->packets);
+    return queue;
+}
 
-    sendBuf = (char*)calloc(MAX_RTP_PKT_LENGTH + 100, sizeof(char));
-    if (!sendBuf) {
-        ret = -1;
-        goto cleanup;
+void rtp_queue_free(struct RtpQueue *queue) {
+    if (!queue)
+        return;
+    packet_queue_reset(&queue->packets);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue);
+}
+
+// Writes out as much as the socket takes without blocking, must be called
+// with the queue lock held
+static int rtp_queue_send(struct RtpQueue *queue) {
+    if (!queue->failed && packet_queue_send(&queue->packets, queue->fd) < 0)
+        queue->failed = true;
+    return queue->failed ? -1 : 0;
+}
+
+int rtp_queue_flush(struct RtpQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    int ret = rtp_queue_send(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+int rtp_queue_write(struct RtpQueue *queue, const char *data, int size) {
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = size };
+    int ret = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (!queue->failed &&
+        packet_queue_push(&queue->packets, &iov, 1, NULL, 0, PACKET_CTRL))
+        ret = rtp_queue_send(queue);
+    pthread_mutex_unlock(&queue->lock);
+    return ret;
+}
+
+unsigned int rtp_create_tcp(struct RtpQueue *queue, int channel,
+    int rtcpChannel, rtpPayload payload) {
+    rtpHandle handle;
+    struct sockaddr_in stAddr;
+    socklen_t u32Len = sizeof(stAddr);
+
+    if (!(handle = (rtpHandle)calloc(1, sizeof(StRtpObj)))) {
+        printf("Failed to create RTP handle\n");
+        return 0;
     }
 
-    handle->pRtpFixedHdr = (StRtpFixedHdr *)sendBuf;
-    handle->pRtpFixedHdr->u2Version = 2;
-    handle->pRtpFixedHdr->u1Marker = 0;
-    handle->pRtpFixedHdr->u7Payload = H264;
+    handle->s32Sock = handle->s32RtcpSock = -1;
+    pthread_mutex_init(&handle->stStatLock, NULL);
+    handle->pQueue = queue;
+    handle->u8Channel = channel;
+    handle->u8RtcpChannel = rtcpChannel;
+    handle->emPayload = payload;
+    if (!getsockname(queue->fd, (struct sockaddr *)&stAddr, &u32Len))
+        handle->u32SSrc = htonl(stAddr.sin_addr.s_addr);
 
-    handle->pRtpFixedHdr->u32TimeStamp =
-        htonl(handle->u32TimeStampCurr * (90000 / 1000));
+    return (unsigned int)handle;
+}
 
-    handle->pRtpFixedHdr->u32SSrc = handle->u32SSrc;
+// Turns the messages left from first on into one per packet, for the
+// batch to go on without segmentation
+static void rtp_unsegment(rtpHandle handle, int first) {
+    int pkt = (handle->stMsgs[first].msg_hdr.msg_iov - handle->stIov) / 2;
+
+    handle->s32MsgCnt = 0;
+    for (; pkt < handle->s32PktCnt; pkt++) {
+        struct msghdr *msg = &handle->stMsgs[handle->s32MsgCnt++].msg_hdr;
+        msg->msg_iov = &handle->stIov[pkt * 2];
+        msg->msg_iovlen = 2;
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+    }
+}
 
-    if (gettimeofday(&stTimeval, NULL) == -1) {
-        printf("Failed to get os time\n");
-        ret = -1;
-        goto cleanup;
+// Hands the whole batch to the kernel, a run of equal sized packets goes
+// out as a single segmented send when the socket supports it
+static int rtp_flush(rtpHandle handle) {
+    int s32Sent = 0, n, ret = 0;
+
+    for (int i = 0; i < handle->s32MsgCnt; i++) {
+        struct msghdr *msg = &handle->stMsgs[i].msg_hdr;
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        if (msg->msg_iovlen <= 2)
+            continue;
+
+        struct cmsghdr *cmsg = (struct cmsghdr *)handle->s8Cmsg[i];
+        msg->msg_control = cmsg;
+        msg->msg_controllen = sizeof(handle->s8Cmsg[i]);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cmsg), &handle->u16SegSize[i], sizeof(uint16_t));
     }
 
-    u8NaluBytes = *nalBuf;
-    pNaluCurr = nalBuf + 1;
-    s32NaluRemain = nalSize - 1;
-
-    if (s32NaluRemain <= MAX_RTP_PKT_LENGTH) {
-        handle->pRtpFixedHdr->u1Marker = 1;
-        handle->pRtpFixedHdr->u16SeqNum =
-            htons(handle->u16SeqNum++);
-        handle->pNaluHdr = (StNaluHdr *)(sendBuf + 12);
-        handle->pNaluHdr->u1F = (u8NaluBytes & 0x80) >> 7;
-        handle->pNaluHdr->u2Nri = (u8NaluBytes & 0x60) >> 5;
-        handle->pNaluHdr->u5Type = u8NaluBytes & 0x1f;
-
-        naluPayload = (sendBuf + 13);
-        memcpy(naluPayload, pNaluCurr, s32NaluRemain);
-
-        s32Bytes = s32NaluRemain + 13;
-        if (sendto(
-                handle->s32Sock, sendBuf, s32Bytes, 0,
-                (struct sockaddr*)&handle->stServAddr,
-                sizeof(handle->stServAddr)) < 0) {
+    while (s32Sent < handle->s32MsgCnt) {
+        n = sendmmsg(handle->s32Sock, handle->stMsgs + s32Sent,
+            handle->s32MsgCnt - s32Sent, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            // The message failed and the ones after it get sent again
+            // packet by packet
+            if (handle->s32Gso && errno == EIO &&
+                handle->stMsgs[s32Sent].msg_hdr.msg_iovlen > 2) {
+                printf("UDP segmentation offload failed, disabling it\n");
+                handle->s32Gso = 0;
+                rtp_unsegment(handle, s32Sent);
+                s32Sent = 0;
+                continue;
+            }
+            // Only the first message failed, the ones after it still go
             ret = -1;
-            goto cleanup;
+            s32Sent++;
+            continue;
         }
-    } else {
-        handle->pFuInd = (StFuIndicator*)(sendBuf + 12);
-        handle->pFuInd->u1F = (u8NaluBytes & 0x80) >> 7;
-        handle->pFuInd->u2Nri = (u8NaluBytes & 0x60) >> 5;
-        handle->pFuInd->u5Type = 28;
-
-        handle->pFuHdr = (StFuHdr *)(sendBuf + 13);
-        handle->pFuHdr->u1R = 0;
-        handle->pFuHdr->u5Type = u8NaluBytes & 0x1f;
-
-        naluPayload = (sendBuf + 14);
-
-        while (s32NaluRemain > 0) {
-            handle->pRtpFixedHdr->u16SeqNum = htons(handle->u16SeqNum++);
-            handle->pRtpFixedHdr->u1Marker =
-                (s32NaluRemain <= MAX_RTP_PKT_LENGTH) ? 1 : 0;
-
-            handle->pFuHdr->u1E = 
-                (s32NaluRemain <= MAX_RTP_PKT_LENGTH) ? 1 : 0;
-            handle->pFuHdr->u1S =
-                (s32NaluRemain == (nalSize - 1)) ? 1 : 0;
-
-            s32Bytes = (s32NaluRemain < MAX_RTP_PKT_LENGTH)
-                           ? s32NaluRemain
-                           : MAX_RTP_PKT_LENGTH;
-
-            memcpy(naluPayload, pNaluCurr, s32Bytes);
-
-            s32Bytes = s32Bytes + 14;
-            if (sendto(
-                    handle->s32Sock, sendBuf, s32Bytes, 0,
-                    (struct sockaddr *)&handle->stServAddr,
-                    sizeof(handle->stServAddr)) < 0) {
-                ret = -1;
-                goto cleanup;
-            }
+        s32Sent += n;
+    }
 
-            pNaluCurr += MAX_RTP_PKT_LENGTH;
-            s32NaluRemain -= MAX_RTP_PKT_LENGTH;
+    handle->s32PktCnt = handle->s32MsgCnt = 0;
+    return ret;
+}
+
+// Appends a packet to the batch and returns its header to be filled in,
+// the payload is sent straight from where it lies
+static char *rtp_add_packet(rtpHandle handle, int hdrLen, char *payload,
+    int size) {
+    if (handle->s32PktCnt == RTP_BATCH)
+        rtp_flush(handle);
+
+    int pkt = handle->s32PktCnt++;
+    unsigned short u16Len = hdrLen + size;
+    handle->u32Packets++;
+    handle->u32Octets += hdrLen - 12 + size;
+    struct iovec *iov = &handle->stIov[pkt * 2];
+    iov[0].iov_base = handle->s8Hdr[pkt];
+    iov[0].iov_len = hdrLen;
+    iov[1].iov_base = payload;
+    iov[1].iov_len = size;
+
+    // Segments must share one size, a shorter one can only end the run
+    if (handle->s32Gso && handle->s32MsgCnt) {
+        int msg = handle->s32MsgCnt - 1;
+        struct msghdr *last = &handle->stMsgs[msg].msg_hdr;
+        if (handle->s8SegOpen[msg] && u16Len <= handle->u16SegSize[msg] &&
+            last->msg_iovlen < RTP_GSO_SEGS * 2) {
+            last->msg_iovlen += 2;
+            handle->s8SegOpen[msg] = u16Len == handle->u16SegSize[msg];
+            return handle->s8Hdr[pkt];
         }
     }
 
-cleanup:
-    if (sendBuf)
-        free((void*)sendBuf);
+    int msg = handle->s32MsgCnt++;
+    handle->stMsgs[msg].msg_hdr.msg_iov = iov;
+    handle->stMsgs[msg].msg_hdr.msg_iovlen = 2;
+    handle->u16SegSize[msg] = u16Len;
+    handle->s8SegOpen[msg] = 1;
+    return handle->s8Hdr[pkt];
+}
 
-    return ret;
+static void rtp_fill_header(rtpHandle handle, char *header,
+    unsigned char u8Payload, int marker) {
+    StRtpFixedHdr *pRtpFixedHdr = (StRtpFixedHdr *)header;
+    memset(header, 0, 12);
+    pRtpFixedHdr->u2Version = 2;
+    pRtpFixedHdr->u1Marker = marker;
+    pRtpFixedHdr->u7Payload = u8Payload;
+    pRtpFixedHdr->u16SeqNum = htons(handle->u16SeqNum++);
+    pRtpFixedHdr->u32TimeStamp = htonl(handle->u32TimeStampCurr);
+    pRtpFixedHdr->u32SSrc = handle->u32SSrc;
 }
 
-static int rtp_send_nalug711(rtpHandle handle, char *buf, int bufsize) {
-    char *sendBuf;
-    int s32Bytes = 0;
-    int ret = 0;
+// The fragments of the last frames sent, their payload headers do not
+// depend on the session so only the RTP header gets filled per viewer
+struct RtpFragment {
+    unsigned char *data;
+    unsigned short size;
+    unsigned char hdr[12];
+    unsigned char hdr_len;
+    unsigned char marker;
+    // Payload built in the cache rather than lying in the frame, queues
+    // have to take a copy of it
+    unsigned char copied;
+};
+
+struct RtpPackets {
+    struct Frame *frame;
+    unsigned int count, max;
+    unsigned int used;
+    struct RtpFragment *frags;
+    // First JPEG payload, its quantization tables then the scan data
+    unsigned char head[MAX_RTP_PKT_LENGTH];
+};
+
+// The parts of a baseline JPEG that RFC 2435 carries, the Huffman tables
+// are left out as receivers use the standard ones the encoders go by
+struct RtpJpeg {
+    unsigned char type, width, height;
+    unsigned short dri;
+    // Luma then chroma table, a set bit of precision tells a 16 bits one
+    const unsigned char *qt[2];
+    unsigned char precision;
+    unsigned int scan, scanLen;
+};
+
+static unsigned char rtp_payload_type(rtpHandle handle) {
+    return handle->emPayload == _mjpeg ? JPEG : H264;
+}
 
-    sendBuf = (char *)calloc(MAX_RTP_PKT_LENGTH + 100, sizeof(char));
-    if (!sendBuf) {
-        ret = -1;
-        goto cleanup;
+// Walks the markers up to the start of scan, only 4:2:2 and 4:2:0 with
+// three components and sizes up to 2040 can be told by RFC 2435
+static bool rtp_jpeg_parse(struct Frame *frame, struct RtpJpeg *jpeg) {
+    const unsigned char *data = frame->data, *seg;
+    const unsigned char *tables[4] = {NULL};
+    unsigned int pos = 2, len, end = frame->size;
+    unsigned int width, height, lumaQt = 0, chromaQt = 0, prec = 0;
+    bool sof = false;
+
+    memset(jpeg, 0, sizeof(*jpeg));
+    if (end < 4 || data[0] != 0xFF || data[1] != 0xD8)
+        return false;
+
+    while (pos + 4 <= end) {
+        if (data[pos] != 0xFF)
+            return false;
+        if (data[pos + 1] == 0xFF) {
+            pos++;
+            continue;
+        }
+        len = data[pos + 2] << 8 | data[pos + 3];
+        if (len < 2 || pos + 2 + len > end)
+            return false;
+        seg = data + pos + 4;
+
+        switch (data[pos + 1]) {
+            case 0xDB:
+                for (unsigned int i = 0; i < len - 2;) {
+                    unsigned int id = seg[i] & 0x0F, bits = seg[i] >> 4;
+                    if (id > 3 || i + 1 + (bits ? 128 : 64) > len - 2)
+                        return false;
+                    tables[id] = seg + i + 1;
+                    prec = bits ? prec | 1 << id : prec & ~(1 << id);
+                    i += 1 + (bits ? 128 : 64);
+                }
+                break;
+            case 0xC0:
+                if (len < 17 || seg[5] != 3 || seg[10] != 0x11 ||
+                    seg[13] != 0x11 || seg[11] != seg[14])
+                    return false;
+                if (seg[7] == 0x21)
+                    jpeg->type = 0;
+                else if (seg[7] == 0x22)
+                    jpeg->type = 1;
+                else
+                    return false;
+                height = seg[1] << 8 | seg[2];
+                width = seg[3] << 8 | seg[4];
+                if (!width || !height || width > 2040 || height > 2040)
+                    return false;
+                jpeg->width = (width + 7) / 8;
+                jpeg->height = (height + 7) / 8;
+                lumaQt = seg[8] & 3;
+                chromaQt = seg[11] & 3;
+                sof = true;
+                break;
+            case 0xC1: case 0xC2: case 0xC3: case 0xC5: case 0xC6:
+            case 0xC7: case 0xC9: case 0xCA: case 0xCB: case 0xCD:
+            case 0xCE: case 0xCF:
+                return false;
+            case 0xDD:
+                if (len < 4)
+                    return false;
+                jpeg->dri = seg[0] << 8 | seg[1];
+                break;
+            case 0xDA:
+                if (!sof || !tables[lumaQt] || !tables[chromaQt])
+                    return false;
+                if (jpeg->dri)
+                    jpeg->type += 64;
+                jpeg->qt[0] = tables[lumaQt];
+                jpeg->qt[1] = tables[chromaQt];
+                jpeg->precision = (prec >> lumaQt & 1) |
+                    (prec >> chromaQt & 1) << 1;
+                // The end of image marker is not sent, nor any padding
+                jpeg->scan = pos + 2 + len;
+                for (unsigned int i = end; i > jpeg->scan + 1 && end - i < 64;
+                    i--)
+                    if (data[i - 2] == 0xFF && data[i - 1] == 0xD9) {
+                        end = i - 2;
+                        break;
+                    }
+                if (end <= jpeg->scan)
+                    return false;
+                jpeg->scanLen = end - jpeg->scan;
+                return true;
+        }
+        pos += 2 + len;
     }
-    handle->pRtpFixedHdr = (StRtpFixedHdr *)sendBuf;
-    handle->pRtpFixedHdr->u7Payload = G711;
-    handle->pRtpFixedHdr->u2Version = 2;
 
-    handle->pRtpFixedHdr->u1Marker = 1;
+    return false;
+}
 
-    handle->pRtpFixedHdr->u32SSrc = handle->u32SSrc;
+static unsigned int rtp_jpeg_tables(const struct RtpJpeg *jpeg) {
+    return (jpeg->precision & 1 ? 128 : 64) + (jpeg->precision & 2 ? 128 : 64);
+}
+
+// The scan data goes out in pieces behind a main header with their offset
+// and, given a restart interval, a restart marker header that does not
+// tie them to the intervals. The quantization tables are sent along with
+// the first piece every time, as told by Q being 255.
+static void rtp_packetize_jpeg(struct RtpPackets *pkts, struct Frame *frame,
+    const struct RtpJpeg *jpeg) {
+    unsigned int tables = rtp_jpeg_tables(jpeg), offset = 0;
+    unsigned int first = MIN(jpeg->scanLen,
+        MAX_RTP_PKT_LENGTH - 4 - tables);
+    unsigned char *head = pkts->head;
+
+    head[0] = 0;
+    head[1] = jpeg->precision;
+    head[2] = tables >> 8;
+    head[3] = tables & 0xFF;
+    memcpy(head + 4, jpeg->qt[0], jpeg->precision & 1 ? 128 : 64);
+    memcpy(head + 4 + (jpeg->precision & 1 ? 128 : 64), jpeg->qt[1],
+        jpeg->precision & 2 ? 128 : 64);
+    memcpy(head + 4 + tables, frame->data + jpeg->scan, first);
+
+    while (offset < jpeg->scanLen) {
+        struct RtpFragment *frag = &pkts->frags[pkts->count++];
+        frag->hdr[0] = 0;
+        frag->hdr[1] = offset >> 16;
+        frag->hdr[2] = offset >> 8;
+        frag->hdr[3] = offset;
+        frag->hdr[4] = jpeg->type;
+        frag->hdr[5] = 255;
+        frag->hdr[6] = jpeg->width;
+        frag->hdr[7] = jpeg->height;
+        frag->hdr_len = 8;
+        if (jpeg->dri) {
+            frag->hdr[8] = jpeg->dri >> 8;
+            frag->hdr[9] = jpeg->dri & 0xFF;
+            frag->hdr[10] = 0xFF;
+            frag->hdr[11] = 0xFF;
+            frag->hdr_len = 12;
+        }
+        frag->marker = 0;
+
+        if (!offset) {
+            frag->data = head;
+            frag->size = 4 + tables + first;
+            frag->copied = 1;
+            offset = first;
+            continue;
+        }
+        frag->data = frame->data + jpeg->scan + offset;
+        frag->size = MIN(jpeg->scanLen - offset, MAX_RTP_PKT_LENGTH);
+        frag->copied = 0;
+        offset += frag->size;
+    }
+}
 
-    handle->pRtpFixedHdr->u16SeqNum = htons(handle->u16SeqNum++);
+struct RtpPackets rtpCache[RTP_CACHE_FRAMES];
+unsigned int rtpCacheClock = 0;
 
-    memcpy(sendBuf + 12, buf, bufsize);
+static struct RtpPackets *rtp_packetize(struct Frame *frame) {
+    struct RtpPackets *pkts = &rtpCache[0];
+    struct RtpJpeg jpeg;
+    unsigned int count = 0;
 
-    handle->pRtpFixedHdr->u32TimeStamp = htonl(handle->u32TimeStampCurr);
-    s32Bytes = bufsize + 12;
-    if (sendto(
-            handle->s32Sock, sendBuf, s32Bytes, 0,
-            (struct sockaddr*)&handle->stServAddr,
-            sizeof(handle->stServAddr)) < 0) {
-        printf("Failed to send!");
-        ret = -1;
-        goto cleanup;
+    for (int i = 0; i < RTP_CACHE_FRAMES; i++) {
+        if (rtpCache[i].frame == frame) {
+            rtpCache[i].used = ++rtpCacheClock;
+            return &rtpCache[i];
+        }
+        if (rtpCache[i].used < pkts->used)
+            pkts = &rtpCache[i];
+    }
+
+    // H.265 NALs open with a two bytes header, RFC 7798
+    unsigned int hdr = frame->codec == HAL_VIDCODEC_H265 ? 2 : 1;
+    if (frame->codec == HAL_VIDCODEC_MJPG) {
+        static bool warned = false;
+        if (!rtp_jpeg_parse(frame, &jpeg)) {
+            if (!warned)
+                fprintf(stderr, "JPEG frames of this kind can't be sent "
+                    "over RTP, dropping them\n");
+            warned = true;
+            return NULL;
+        }
+        unsigned int rest = jpeg.scanLen -
+            MIN(jpeg.scanLen, MAX_RTP_PKT_LENGTH - 4 - rtp_jpeg_tables(&jpeg));
+        count = 1 + (rest + MAX_RTP_PKT_LENGTH - 1) / MAX_RTP_PKT_LENGTH;
+    } else for (unsigned int i = 0; i < frame->nal_count; i++) {
+        if (frame->nals[i].size < hdr)
+            continue;
+        unsigned int remain = frame->nals[i].size - hdr;
+        count += remain <= MAX_RTP_PKT_LENGTH ? 1 :
+            (remain + MAX_RTP_PKT_LENGTH - 1) / MAX_RTP_PKT_LENGTH;
+    }
+    if (count > pkts->max) {
+        struct RtpFragment *frags =
+            realloc(pkts->frags, count * sizeof(struct RtpFragment));
+        if (!frags)
+            return NULL;
+        pkts->frags = frags;
+        pkts->max = count;
+    }
+
+    frame_unref(pkts->frame);
+    pkts->frame = frame_ref(frame);
+    pkts->used = ++rtpCacheClock;
+    pkts->count = 0;
+
+    if (frame->codec == HAL_VIDCODEC_MJPG)
+        rtp_packetize_jpeg(pkts, frame, &jpeg);
+    else for (unsigned int i = 0; i < frame->nal_count; i++) {
+        unsigned char *nal = frame->data + frame->nals[i].offset;
+        if (frame->nals[i].size < hdr)
+            continue;
+        unsigned int remain = frame->nals[i].size - hdr;
+        struct RtpFragment *frag;
+
+        if (remain <= MAX_RTP_PKT_LENGTH) {
+            frag = &pkts->frags[pkts->count++];
+            frag->data = nal;
+            frag->size = remain + hdr;
+            frag->hdr_len = 0;
+            frag->marker = 0;
+            frag->copied = 0;
+            continue;
+        }
+
+        // FU-A indicator then header with the start and end bits, or for
+        // H.265 a payload header of type 49 then the FU header
+        for (unsigned char *pos = nal + hdr; remain > 0;) {
+            unsigned char edges = (pos == nal + hdr ? 0x80 : 0) |
+                (remain <= MAX_RTP_PKT_LENGTH ? 0x40 : 0);
+            frag = &pkts->frags[pkts->count++];
+            frag->data = pos;
+            frag->size = MIN(remain, MAX_RTP_PKT_LENGTH);
+            if (hdr == 2) {
+                frag->hdr[0] = (nal[0] & 0x81) | (49 << 1);
+                frag->hdr[1] = nal[1];
+                frag->hdr[2] = ((nal[0] >> 1) & 0x3F) | edges;
+            } else {
+                frag->hdr[0] = (nal[0] & 0xE0) | 28;
+                frag->hdr[1] = (nal[0] & 0x1F) | edges;
+            }
+            frag->hdr_len = hdr + 1;
+            frag->marker = 0;
+            frag->copied = 0;
+            pos += frag->size;
+            remain -= frag->size;
+        }
+    }
+    if (pkts->count)
+        pkts->frags[pkts->count - 1].marker = 1;
+
+    return pkts;
+}
+
+void rtp_cache_clear() {
+    for (int i = 0; i < RTP_CACHE_FRAMES; i++) {
+        frame_unref(rtpCache[i].frame);
+        free(rtpCache[i].frags);
+        memset(&rtpCache[i], 0, sizeof(rtpCache[i]));
+    }
+}
+
+// Queues the RTP packets of a frame together, each framed with its channel
+// and length so they can share the socket with the replies
+static int rtp_queue_frame(rtpHandle handle, struct RtpPackets *pkts,
+    struct Frame *frame) {
+    struct RtpQueue *queue = handle->pQueue;
+    struct Packet *packet;
+    enum PacketKind kind = PACKET_NONREF;
+    unsigned int size = 0, copied = 0;
+    int ret;
+
+    if (frame->keyframe)
+        kind = PACKET_KEY;
+    else
+        for (unsigned int i = 0; i < frame->nal_count; i++)
+            if (frame_nal_is_ref(frame, &frame->nals[i]))
+                kind = PACKET_REF;
+    for (unsigned int i = 0; i < pkts->count; i++) {
+        size += 16 + pkts->frags[i].hdr_len + pkts->frags[i].size;
+        if (pkts->frags[i].copied)
+            copied += pkts->frags[i].size;
     }
-cleanup:
-    if (sendBuf)
-        free((void*)sendBuf);
 
+    pthread_mutex_lock(&queue->lock);
+    if (queue->failed ||
+        !(packet = packet_queue_reserve(&queue->packets, kind, size)) ||
+        !(packet->iov = malloc(sizeof(struct Frame *) + pkts->count *
+            (2 * sizeof(struct iovec) + RTP_TCP_HDR) + copied))) {
+        ret = queue->failed ? -1 : 0;
+        pthread_mutex_unlock(&queue->lock);
+        return ret;
+    }
+
+    packet->frames = (struct Frame **)(packet->iov + 2 * pkts->count);
+    char *header = (char *)(packet->frames + 1);
+    char *copy = header + pkts->count * RTP_TCP_HDR;
+    for (unsigned int i = 0; i < pkts->count; i++, header += RTP_TCP_HDR) {
+        struct RtpFragment *frag = &pkts->frags[i];
+        unsigned short u16Len = 12 + frag->hdr_len + frag->size;
+        header[0] = '$';
+        header[1] = handle->u8Channel;
+        header[2] = u16Len >> 8;
+        header[3] = u16Len & 0xFF;
+        rtp_fill_header(handle, header + 4, rtp_payload_type(handle),
+            frag->marker);
+        memcpy(header + 16, frag->hdr, frag->hdr_len);
+        packet->iov[2 * i].iov_base = header;
+        packet->iov[2 * i].iov_len = 16 + frag->hdr_len;
+        packet->iov[2 * i + 1].iov_base = frag->data;
+        packet->iov[2 * i + 1].iov_len = frag->size;
+        if (frag->copied) {
+            memcpy(copy, frag->data, frag->size);
+            packet->iov[2 * i + 1].iov_base = copy;
+            copy += frag->size;
+        }
+        handle->u32Packets++;
+        handle->u32Octets += frag->hdr_len + frag->size;
+    }
+    packet->iovcnt = 2 * pkts->count;
+    packet->size = size;
+    packet->frames[0] = frame_ref(frame);
+    packet->frame_count = 1;
+    packet->kind = kind;
+    packet_queue_commit(&queue->packets, packet);
+
+    ret = rtp_queue_send(queue);
+    pthread_mutex_unlock(&queue->lock);
     return ret;
 }
 
-unsigned int rtp_send(unsigned int rtp, char *data, int size,
+static unsigned long long rtcp_monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// Frames are packetized once for all sessions, each of them then only
+// stamps its own RTP headers on the shared fragments
+unsigned int rtp_send_frame(unsigned int rtp, struct Frame *frame,
     unsigned int tstamp) {
-    char *nalBuf, *dataEnd;
     rtpHandle handle = (rtpHandle)rtp;
-    unsigned int naluToken;
-    int nalSize = 0;
+    struct RtpPackets *pkts = rtp_packetize(frame);
 
+    if (!pkts)
+        return -1;
+    // The frame timestamp is the encoder's own, the sender reports go by
+    // when the frame went out instead
     handle->u32TimeStampCurr = tstamp;
+    handle->u64FrameTime = rtcp_monotonic_us();
+    if (handle->pQueue)
+        return rtp_queue_frame(handle, pkts, frame);
+
+    for (unsigned int i = 0; i < pkts->count; i++) {
+        struct RtpFragment *frag = &pkts->frags[i];
+        char *header = rtp_add_packet(handle, 12 + frag->hdr_len,
+            (char *)frag->data, frag->size);
+        rtp_fill_header(handle, header, rtp_payload_type(handle),
+            frag->marker);
+        memcpy(header + 12, frag->hdr, frag->hdr_len);
+    }
 
-    if (_h264 == handle->emPayload) {
-        dataEnd = data + size;
-        for (;data < dataEnd - 5; data++) {
-            memcpy(&naluToken, data, 4 * sizeof(char));
-            if (0x01000000 == naluToken) {
-                data += 4;
-                nalBuf = data;
-                break;
-            }
-        }
-        for (;data < dataEnd - 5; data++) {
-            memcpy(&naluToken, data, 4 * sizeof(char));
-            if (0x01000000 == naluToken) {
-                nalSize = (int)(data - nalBuf);
-                if (rtp_send_naluh264(handle, nalBuf, nalSize) == -1) {
-                    return -1;
-                }
-                data += 4;
-                nalBuf = data;
-            }
+    return rtp_flush(handle);
+}
+
+static void rtcp_put32(unsigned char *p, unsigned int value) {
+    value = htonl(value);
+    memcpy(p, &value, 4);
+}
+
+static unsigned int rtcp_get32(const unsigned char *p) {
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Middle 32 bits of the current NTP time, as echoed back in the reports
+static unsigned int rtcp_ntp_middle(struct timeval *tv) {
+    unsigned int frac = (unsigned int)(((unsigned long long)tv->tv_usec << 32) /
+        1000000);
+    return (tv->tv_sec + NTP_OFFSET) << 16 | frac >> 16;
+}
+
+int rtcp_open(unsigned int rtp, unsigned int ip, int localPort,
+    int remotePort) {
+    rtpHandle handle = (rtpHandle)rtp;
+    struct sockaddr_in stAddr;
+    int s32Reuse = 1;
+
+    if ((handle->s32RtcpSock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        printf("Failed to create the RTCP socket\n");
+        return -1;
+    }
+    setsockopt(handle->s32RtcpSock, SOL_SOCKET, SO_REUSEADDR, &s32Reuse,
+        sizeof(s32Reuse));
+
+    memset(&stAddr, 0, sizeof(stAddr));
+    stAddr.sin_family = AF_INET;
+    stAddr.sin_port = htons(localPort);
+    stAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(handle->s32RtcpSock, (struct sockaddr *)&stAddr,
+            sizeof(stAddr)) < 0) {
+        printf("Failed to bind the RTCP port %d\n", localPort);
+        goto cleanup;
+    }
+
+    // Receivers of a group report to the group itself
+    if (IN_MULTICAST(ntohl(ip))) {
+        struct ip_mreq stMreq;
+        unsigned char u8Ttl, u8Loop = 0;
+        socklen_t u32Len = sizeof(u8Ttl);
+        stMreq.imr_multiaddr.s_addr = ip;
+        stMreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(handle->s32RtcpSock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                &stMreq, sizeof(stMreq)) < 0) {
+            printf("Failed to join the RTCP group\n");
+            goto cleanup;
         }
-        if (data > nalBuf) {
-            nalSize = (int)(data - nalBuf);
-            if (rtp_send_naluh264(handle, nalBuf, nalSize) == -1) {
-                return -1;
+        if (!getsockopt(handle->s32Sock, IPPROTO_IP, IP_MULTICAST_TTL,
+                &u8Ttl, &u32Len))
+            setsockopt(handle->s32RtcpSock, IPPROTO_IP, IP_MULTICAST_TTL,
+                &u8Ttl, sizeof(u8Ttl));
+        setsockopt(handle->s32RtcpSock, IPPROTO_IP, IP_MULTICAST_LOOP,
+            &u8Loop, sizeof(u8Loop));
+    }
+
+    handle->stRtcpAddr.sin_family = AF_INET;
+    handle->stRtcpAddr.sin_port = htons(remotePort);
+    handle->stRtcpAddr.sin_addr.s_addr = ip;
+    return 0;
+
+cleanup:
+    close(handle->s32RtcpSock);
+    handle->s32RtcpSock = -1;
+    return -1;
+}
+
+// Compound packet of a sender report, mapping the RTP clock to the wall
+// clock, and the mandatory source description
+static void rtcp_send_sr(rtpHandle handle) {
+    unsigned char buf[4 + 28 + 20], *pkt = buf + 4;
+    unsigned long long u64Now = rtcp_monotonic_us();
+    unsigned int u32RtpTime = handle->u32TimeStampCurr;
+    struct timeval stTimeval;
+
+    gettimeofday(&stTimeval, NULL);
+    // Extrapolated from when the last frame was sent
+    if (u64Now > handle->u64FrameTime &&
+        u64Now - handle->u64FrameTime < 10000000)
+        u32RtpTime += (u64Now - handle->u64FrameTime) * 9 / 100;
+
+    pkt[0] = 0x80;
+    pkt[1] = SR;
+    pkt[2] = 0;
+    pkt[3] = 6;
+    memcpy(pkt + 4, &handle->u32SSrc, 4);
+    rtcp_put32(pkt + 8, stTimeval.tv_sec + NTP_OFFSET);
+    rtcp_put32(pkt + 12,
+        (unsigned int)(((unsigned long long)stTimeval.tv_usec << 32) /
+            1000000));
+    rtcp_put32(pkt + 16, u32RtpTime);
+    rtcp_put32(pkt + 20, handle->u32Packets);
+    rtcp_put32(pkt + 24, handle->u32Octets);
+
+    pkt[28] = 0x81;
+    pkt[29] = SDES;
+    pkt[30] = 0;
+    pkt[31] = 4;
+    memcpy(pkt + 32, &handle->u32SSrc, 4);
+    pkt[36] = 1;
+    pkt[37] = 7;
+    memcpy(pkt + 38, "divinus", 7);
+    memset(pkt + 45, 0, 3);
+
+    pthread_mutex_lock(&handle->stStatLock);
+    handle->u32LastSrNtp = rtcp_ntp_middle(&stTimeval);
+    pthread_mutex_unlock(&handle->stStatLock);
+
+    if (handle->pQueue) {
+        buf[0] = '$';
+        buf[1] = handle->u8RtcpChannel;
+        buf[2] = 0;
+        buf[3] = 48;
+        rtp_queue_write(handle->pQueue, (char *)buf, sizeof(buf));
+    } else if (handle->s32RtcpSock >= 0) {
+        sendto(handle->s32RtcpSock, pkt, 48, MSG_DONTWAIT,
+            (struct sockaddr *)&handle->stRtcpAddr,
+            sizeof(handle->stRtcpAddr));
+    }
+}
+
+void rtcp_input(unsigned int rtp, const unsigned char *data, int size) {
+    rtpHandle handle = (rtpHandle)rtp;
+    struct timeval stTimeval;
+
+    gettimeofday(&stTimeval, NULL);
+    pthread_mutex_lock(&handle->stStatLock);
+    while (size >= 8) {
+        int len = ((data[2] << 8 | data[3]) + 1) * 4;
+        int count = data[0] & 0x1F;
+        if (data[0] >> 6 != 2 || len > size)
+            break;
+
+        if (data[1] == SR || data[1] == RR) {
+            const unsigned char *block = data + (data[1] == SR ? 28 : 8);
+            for (; count && block + 24 <= data + len; count--, block += 24) {
+                if (memcmp(block, &handle->u32SSrc, 4))
+                    continue;
+                struct RtcpStats *stats = &handle->stStats;
+                unsigned int lsr = rtcp_get32(block + 16);
+                unsigned int dlsr = rtcp_get32(block + 20);
+                unsigned int delay = rtcp_ntp_middle(&stTimeval) - lsr;
+                stats->fraction_lost = block[4];
+                stats->cumulative_lost =
+                    (int)(rtcp_get32(block + 4) << 8) >> 8;
+                stats->jitter = rtcp_get32(block + 12);
+                if (lsr && lsr == handle->u32LastSrNtp && delay >= dlsr)
+                    stats->rtt =
+                        (unsigned int)((unsigned long long)(delay - dlsr) *
+                            1000 >> 16);
+                stats->reported = rtcp_monotonic_us() / 1000;
             }
+        } else if (data[1] == RTPFB && count == 1 && len >= 12 &&
+            !memcmp(data + 8, &handle->u32SSrc, 4)) {
+            // Generic NACK, a lost packet and a mask of the following ones
+            for (const unsigned char *fci = data + 12; fci + 4 <= data + len;
+                fci += 4)
+                handle->stStats.nack_count +=
+                    1 + __builtin_popcount(fci[2] << 8 | fci[3]);
         }
-    } else if (_h264nalu == handle->emPayload) {
-        if (rtp_send_naluh264(handle, data, size) == -1)
-            return -1;
-    } else if (_g711 == handle->emPayload) {
-        if (rtp_send_nalug711(handle, data, size) == -1)
-            return -1;
-    } else return -1;
 
-    return 0;
+        data += len;
+        size -= len;
+    }
+    pthread_mutex_unlock(&handle->stStatLock);
+}
+
+void rtcp_poll(unsigned int rtp) {
+    rtpHandle handle = (rtpHandle)rtp;
+    unsigned char buf[1500];
+    int n;
+
+    while (handle->s32RtcpSock >= 0 &&
+        (n = recv(handle->s32RtcpSock, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        rtcp_input(rtp, buf, n);
+
+    unsigned long long u64Now = rtcp_monotonic_us() / 1000;
+    if (!handle->u32Packets || u64Now - handle->u64LastSr < RTCP_INTERVAL)
+        return;
+    handle->u64LastSr = u64Now;
+    rtcp_send_sr(handle);
+}
+
+void rtp_get_stats(unsigned int rtp, struct RtcpStats *stats) {
+    rtpHandle handle = (rtpHandle)rtp;
+
+    pthread_mutex_lock(&handle->stStatLock);
+    *stats = handle->stStats;
+    pthread_mutex_unlock(&handle->stStatLock);
+    stats->sent = handle->u32Packets;
 }
@@ -5,10 +5,14 @@
 #include <string.h>
 #include <sys/socket.h>
 
+#include "../frame.h"
+
 #define MAX_RTP_PKT_LENGTH 1400
 
 #define H264 96
 #define G711 97
+// Static payload type of RFC 2435
+#define JPEG 26
 
 typedef enum {
     _h264 = 0x100,
@@ -24,5 +28,38 @@ enum H264_FRAME_TYPE {
 };
 
 unsigned int rtp_create(unsigned int ip, int port, rtpPayload payload);
+unsigned int rtp_create_multicast(unsigned int group, int port, int ttl,
+    rtpPayload payload);
 void rtp_delete(unsigned int u32Rtp);
-unsigned int rtp_send(unsigned int rtp, char *data, int size, unsigned int tstamp);
\ No newline at end of file
+// Interleaved transport, packets go out on the RTSP connection through a
+// queue shared by its sessions and replies
+struct RtpQueue *rtp_queue_create(int fd);
+void rtp_queue_free(struct RtpQueue *queue);
+int rtp_queue_flush(struct RtpQueue *queue);
+int rtp_queue_write(struct RtpQueue *queue, const char *data, int size);
+unsigned int rtp_create_tcp(struct RtpQueue *queue, int channel,
+    int rtcpChannel, rtpPayload payload);
+// Timestamps are given in ticks of the payload clock, 90kHz for video
+unsigned int rtp_send_frame(unsigned int rtp, struct Frame *frame,
+    unsigned int tstamp);
+void rtp_cache_clear();
+
+// Reception quality of a session, as told by the last receiver report
+struct RtcpStats {
+    unsigned char fraction_lost; // out of 256, since the previous report
+    int cumulative_lost;
+    unsigned int jitter;         // in ticks of the payload clock
+    unsigned int rtt;            // in ms, once a report echoes a sender one
+    unsigned int nack_count;     // packets asked for again
+    unsigned int sent;           // packets sent so far
+    unsigned long long reported; // monotonic ms of the last report
+};
+
+// RTCP goes over its own socket for UDP sessions and on the RTCP channel of
+// interleaved ones, whose reports are handed over by the RTSP connection
+int rtcp_open(unsigned int rtp, unsigned int ip, int localPort,
+    int remotePort);
+void rtcp_input(unsigned int rtp, const unsigned char *data, int size);
+// Reads the pending reports and sends a sender report when one is due
+void rtcp_poll(unsigned int rtp);
+void rtp_get_stats(unsigned int rtp, struct RtcpStats *stats);
@@ -11,22 +11,25 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../app_config.h"
+#include "../video.h"
 #include "ringfifo.h"
 #include "rtputils.h"
 #include "rtsputils.h"
 
-struct profileid_sps_pps {
-    char base64profileid[10];
-    char base64sps[524];
-    char base64pps[524];
+// Parameter sets last seen in the stream, copied as they are for the SDP
+#define PARAM_SET_MAX 256
+struct ParamSets {
+    unsigned char vps[PARAM_SET_MAX], sps[PARAM_SET_MAX], pps[PARAM_SET_MAX];
+    int vps_len, sps_len, pps_len;
 };
 
 pthread_mutex_t mut;
@@ -34,18 +37,111 @@ pthread_mutex_t mut;
 extern char keepRunning;
 
 #define SDP_EL       "\r\n"
+#define RTSP_MAX_EVENTS 16
 #define RTSP_RTP_AVP "RTP/AVP"
 
-struct profileid_sps_pps psp;
+// Written by the encoder thread, read when answering DESCRIBE
+struct ParamSets params;
+pthread_mutex_t paramLock = PTHREAD_MUTEX_INITIALIZER;
+
+void base64_encode3(char *in, const int in_len, char *out, int out_len);
+
+// Sessions asking for /mjpeg get the MJPEG channel, any other path the
+// main video one
+static enum ringstream rtsp_url_stream(const char *request) {
+    char url[255], *path;
+
+    if (sscanf(request, " %*s %254s ", url) != 1 ||
+        strncmp(url, "rtsp://", 7) || !(path = strchr(url + 7, '/')))
+        return RING_VIDEO;
+    return !strncmp(path, "/mjpeg", 6) && (!path[6] || path[6] == '/') ?
+        RING_MJPEG : RING_VIDEO;
+}
+
+// Appends a parameter set in base64 after its attribute name
+static void rtsp_sdp_param(char *descr, const char *name,
+    unsigned char *set, int len) {
+    char base64[4 * ((PARAM_SET_MAX + 2) / 3) + 1];
+    base64_encode3((char *)set, len, base64, sizeof(base64));
+    strcat(descr, name);
+    strcat(descr, base64);
+}
 
 extern int num_conn;
-int maxFd = 0;
+int rtspEpoll = -1;
 int g_s32DoPlay = 0;
 
 uint32_t s_u32StartPort = RTP_DEFAULT_PORT;
 uint32_t s_uPortPool[MAX_CONNECTION];
 extern int stop_schedule;
 
+// Every multicast viewer is served by this single session, scheduled from
+// the first SETUP on and sending as long as one of them plays
+static rtpSession rtspMulticast;
+static int rtspMulticastViewers = 0, rtspMulticastPlaying = 0;
+
+static int rtsp_multicast_join(rtpTransport *transport) {
+    in_addr_t group = inet_addr(app_config.rtsp_multicast_group);
+    int port = app_config.rtsp_multicast_port;
+
+    if (!app_config.rtsp_multicast_group[0] || !IN_MULTICAST(ntohl(group)))
+        return RTSP_ERR_GENERIC;
+
+    if (!rtspMulticastViewers) {
+        rtspMulticast.rtpHandle =
+            (struct _tagStRtpHandle *)rtp_create_multicast(
+                group, port, app_config.rtsp_multicast_ttl, _h264nalu);
+        if (!rtspMulticast.rtpHandle)
+            return RTSP_ERR_GENERIC;
+        rtspMulticast.pause = 1;
+        if ((rtspMulticast.schedId = schedule_add(&rtspMulticast)) < 0) {
+            rtp_delete((unsigned int)rtspMulticast.rtpHandle);
+            memset(&rtspMulticast, 0, sizeof(rtspMulticast));
+            return RTSP_ERR_GENERIC;
+        }
+        // Reports of every member arrive on the group
+        rtcp_open((unsigned int)rtspMulticast.rtpHandle, group, port + 1,
+            port + 1);
+        printf("Multicast to %s:%d started\n",
+            app_config.rtsp_multicast_group, port);
+    }
+    rtspMulticastViewers++;
+
+    transport->u.udp.isMulticast = 1;
+    transport->u.udp.cliPorts.RTP = transport->u.udp.serPorts.RTP = port;
+    transport->u.udp.cliPorts.RTCP = transport->u.udp.serPorts.RTCP = port + 1;
+    return RTSP_ERR_NOERROR;
+}
+
+static void rtsp_multicast_play(rtpSession *viewer) {
+    viewer->started = 1;
+    viewer->pause = 0;
+    // Joining a group already streaming, the next keyframe is all it gets
+    if (!rtspMulticastPlaying++)
+        schedule_start(rtspMulticast.schedId, NULL);
+    else {
+        g_s32DoPlay++;
+        request_idr();
+    }
+}
+
+static void rtsp_multicast_leave(rtpSession *viewer) {
+    if (viewer->started && !--rtspMulticastPlaying)
+        schedule_stop(rtspMulticast.schedId);
+    if (--rtspMulticastViewers)
+        return;
+
+    schedule_remove(rtspMulticast.schedId);
+    rtp_delete((unsigned int)rtspMulticast.rtpHandle);
+    memset(&rtspMulticast, 0, sizeof(rtspMulticast));
+    printf("Multicast stopped\n");
+}
+
+static int rtsp_is_multicast(rtpSession *session) {
+    return session->transport.type == RTP_TRANSP_RTP_AVP &&
+        session->transport.u.udp.isMulticast;
+}
+
 void rtsp_initserver(rtspBuffer *rtsp, int fd) {
     rtsp->fd = fd;
     rtsp->session_list = (rtspSession*)calloc(1, sizeof(rtspSession));
@@ -72,7 +168,7 @@ int rtp_get_port_pair(rtpPortPair *pair) {
 **输入参数:fd,
    输出参数ppRtspList
 **************************************************************************************************/
-void AddClient(rtspBuffer **ppRtspList, int fd) {
+rtspBuffer *AddClient(rtspBuffer **ppRtspList, int fd) {
     rtspBuffer *pRtsp = NULL, *pRtspNew = NULL;
 
     //在链表头部插入第一个元素
@@ -81,7 +177,7 @@ void AddClient(rtspBuffer **ppRtspList, int fd) {
         /*分配空间*/
         if (!(*ppRtspList = (rtspBuffer *)calloc(1, sizeof(rtspBuffer)))) {
             fprintf(stderr, "alloc memory error %s,%i\n", __FILE__, __LINE__);
-            return;
+            return NULL;
         }
         pRtsp = *ppRtspList;
     } else {
@@ -94,22 +190,18 @@ void AddClient(rtspBuffer **ppRtspList, int fd) {
             if (!(pRtspNew->next =
                       (rtspBuffer *)calloc(1, sizeof(rtspBuffer)))) {
                 fprintf(stderr, "error calloc %s,%i\n", __FILE__, __LINE__);
-                return;
+                return NULL;
             }
             pRtsp = pRtspNew->next;
             pRtsp->next = NULL;
         }
     }
 
-    //设置最大轮询id号
-    if (maxFd < fd) {
-        maxFd = fd;
-    }
-
     /*初始化新添加的客户端*/
     rtsp_initserver(pRtsp, fd);
     fprintf(
         stderr, "Incoming RTSP connection accepted on socket: %d\n", pRtsp->fd);
+    return pRtsp;
 }
 
 /*根据缓冲区的内容，填充后边两个长度数据,检查缓冲区中消息的完整性
@@ -137,7 +229,8 @@ int rtsp_full_msg_rcvd(rtspBuffer *rtsp, int *hdr_len, int *body_len) {
             (uint16_t *)&rtsp->in_buffer[2]; /*跳过通道标志符*/
 
         /*转化为主机字节序，因为长度是网络字节序*/
-        if ((bl = ntohs(*intlvd_len)) <= rtsp->in_size) {
+        if (rtsp->in_size >= 4 &&
+            4 + (bl = ntohs(*intlvd_len)) <= rtsp->in_size) {
             fprintf(
                 stderr, "Interleaved RTP or RTCP packet arrived (len: %hu).\n",
                 bl);
@@ -469,7 +562,8 @@ char *GetSdpId(char *buffer) {
 **pDescr:	输出
 s8Str	:输出
 **************************************************************************************************/
-void GetSdpDescr(rtspBuffer *pRtsp, char *pDescr, char *s8Str) {
+void GetSdpDescr(rtspBuffer *pRtsp, char *pDescr, char *s8Str,
+    enum ringstream stream) {
     /*/=====================================
             char const* const SdpPrefixFmt =
                             "v=0\r\n"	//版本信息
@@ -557,31 +651,48 @@ void GetSdpDescr(rtspBuffer *pRtsp, char *pDescr, char *s8Str) {
     sprintf(rtp_port, "%d", s_u32StartPort);
     strcat(pDescr, rtp_port);
     strcat(pDescr, " RTP/AVP "); /* Use UDP */
+    // RFC 2435 has a static payload type, described all the same
+    if (stream == RING_MJPEG) {
+        strcat(pDescr, "26\r\n");
+        strcat(pDescr, "b=RR:0\r\n");
+        strcat(pDescr, "a=rtpmap:26 JPEG/90000\r\n");
+        strcat(pDescr, "a=control:trackID=0\r\n");
+        return;
+    }
     strcat(pDescr, "96\r\n");
     // strcat(pDescr, "\r\n");
     strcat(pDescr, "b=RR:0\r\n");
     /**** Dynamically defined payload ****/
     strcat(pDescr, "a=rtpmap:96");
     strcat(pDescr, " ");
-    strcat(pDescr, "H264/90000");
-    strcat(pDescr, "\r\n");
-    strcat(pDescr, "a=fmtp:96 packetization-mode=1;");
-    strcat(pDescr, "profile-level-id=");
-    strcat(pDescr, psp.base64profileid);
-    strcat(pDescr, ";sprop-parameter-sets=");
-    strcat(pDescr, psp.base64sps);
-    strcat(pDescr, ",");
-    strcat(pDescr, psp.base64pps);
-    strcat(pDescr, ";");
+    strcat(pDescr, app_config.mp4_codec_h265 ? "H265/90000" : "H264/90000");
     strcat(pDescr, "\r\n");
+    // Decoders get set up from here, without waiting for in-band ones
+    pthread_mutex_lock(&paramLock);
+    if (app_config.mp4_codec_h265) {
+        // RFC 7798 has each parameter set in its own attribute
+        if (params.vps_len && params.sps_len && params.pps_len) {
+            rtsp_sdp_param(pDescr, "a=fmtp:96 sprop-vps=",
+                params.vps, params.vps_len);
+            rtsp_sdp_param(pDescr, ";sprop-sps=", params.sps, params.sps_len);
+            rtsp_sdp_param(pDescr, ";sprop-pps=", params.pps, params.pps_len);
+            strcat(pDescr, "\r\n");
+        }
+    } else {
+        strcat(pDescr, "a=fmtp:96 packetization-mode=1");
+        if (params.sps_len >= 4 && params.pps_len) {
+            // profile_idc, the constraint flags and level_idc
+            sprintf(pDescr + strlen(pDescr), ";profile-level-id=%02X%02X%02X",
+                params.sps[1], params.sps[2], params.sps[3]);
+            rtsp_sdp_param(pDescr, ";sprop-parameter-sets=",
+                params.sps, params.sps_len);
+            rtsp_sdp_param(pDescr, ",", params.pps, params.pps_len);
+        }
+        strcat(pDescr, "\r\n");
+    }
+    pthread_mutex_unlock(&paramLock);
     strcat(pDescr, "a=control:trackID=0");
     strcat(pDescr, "\r\n");
-
-    printf(
-        "\n\n%s,%d===>psp.base64profileid=%s,psp.base64sps=%s,psp.base64pps=%"
-        "s\n\n",
-        __FUNCTION__, __LINE__, psp.base64profileid, psp.base64sps,
-        psp.base64pps);
 }
 
 /*添加时间戳*/
@@ -609,7 +720,7 @@ int SendDescribeReply(
     int s32MbLen;
 
     /* 分配空间，处理内部错误*/
-    s32MbLen = 2048;
+    s32MbLen = 1024 + strlen(descr);
     pMsgBuf = (char *)malloc(s32MbLen);
     if (!pMsgBuf) {
         fprintf(stderr, "send_describe_reply(): unable to allocate memory\n");
@@ -659,6 +770,7 @@ int rtsp_describe(rtspBuffer *rtsp) {
     char s8Descr[MAX_DESCR_LENGTH];
     char server[128];
     char s8Str[128];
+    enum ringstream stream;
 
     if (!sscanf(rtsp->in_buffer, " %*s %254s ", s8Url)) {
         fprintf(stderr, "Error %s,%i\n", __FILE__, __LINE__);
@@ -700,7 +812,13 @@ int rtsp_describe(rtspBuffer *rtsp) {
         }
     }
 
-    GetSdpDescr(rtsp, s8Descr, s8Str);
+    stream = rtsp_url_stream(rtsp->in_buffer);
+    if (stream == RING_MJPEG && !app_config.mjpeg_enable) {
+        send_reply(404, 0, rtsp); /* Not Found */
+        return RTSP_ERR_NOERROR;
+    }
+
+    GetSdpDescr(rtsp, s8Descr, s8Str, stream);
     SendDescribeReply(rtsp, object, s8Descr, s8Str);
     return RTSP_ERR_NOERROR;
 }
@@ -760,6 +878,10 @@ int send_setup_reply(
     switch (pRtpSes->transport.type) {
     case RTP_TRANSP_RTP_AVP:
         if (pRtpSes->transport.u.udp.isMulticast) {
+            sprintf(
+                s8Str + strlen(s8Str),
+                "RTP/AVP;multicast;destination=%s;ttl=%d;port=",
+                app_config.rtsp_multicast_group, app_config.rtsp_multicast_ttl);
         } else {
             sprintf(
                 s8Str + strlen(s8Str),
@@ -794,12 +916,19 @@ int send_setup_reply(
 }
 
 int rtsp_setup(rtspBuffer *rtsp) {
-    char s8TranStr[128], *s8Str;
+    char s8TranStr[256], *s8Str;
     char *pStr;
     rtpTransport Transport;
     int s32SessionID = 0;
     rtpSession *rtp_s, *rtp_s_prec;
     rtspSession *rtsp_s;
+    enum ringstream stream = rtsp_url_stream(rtsp->in_buffer);
+    rtpPayload payload = stream == RING_MJPEG ? _mjpeg : _h264nalu;
+
+    if (stream == RING_MJPEG && !app_config.mjpeg_enable) {
+        send_reply(404, 0, rtsp); /* Not Found */
+        return RTSP_ERR_NOERROR;
+    }
 
     if ((s8Str = strstr(rtsp->in_buffer, RTSP_HDR_TRANSPORT)) == NULL) {
         fprintf(stderr, "Error %s,%i\n", __FILE__, __LINE__);
@@ -840,8 +969,10 @@ int rtsp_setup(rtspBuffer *rtsp) {
 
     //起始状态为暂停
     rtp_s->pause = 1;
+    rtp_s->stream = stream;
 
     rtp_s->rtpHandle = NULL;
+    rtp_s->schedId = -1;
 
     Transport.type = RTP_TRANSP_NONE;
     //经抓包发现s8TranStr="RTP/AVP;unicast;client_port=5004-5005"
@@ -851,12 +982,51 @@ int rtsp_setup(rtspBuffer *rtsp) {
     {
         // Transport: RTP/AVP
         pStr += strlen(RTSP_RTP_AVP);
-        if (!*pStr || (*pStr == ';') || (*pStr == ' ') || (*pStr == '/')) {
-            //单播
-            if (strstr(
-                    s8TranStr,
-                    "unicast")) // pStr="unicast;client_port=5004-5005"
-            {
+        if (!strncmp(pStr, "/TCP", 4)) {
+            // RTP/AVP/TCP: packets share the control connection, framed
+            // with '$', the channel and their length
+            if ((pStr = strstr(s8TranStr, "interleaved="))) {
+                sscanf(pStr + 12, "%d", &(Transport.u.tcp.interleaved.RTP));
+                if ((pStr = strchr(pStr, '-')))
+                    sscanf(pStr + 1, "%d", &(Transport.u.tcp.interleaved.RTCP));
+                else
+                    Transport.u.tcp.interleaved.RTCP =
+                        Transport.u.tcp.interleaved.RTP + 1;
+            } else {
+                Transport.u.tcp.interleaved.RTP = 0;
+                Transport.u.tcp.interleaved.RTCP = 1;
+            }
+
+            if (!rtsp->queue) {
+                struct epoll_event ev;
+                if (!(rtsp->queue = rtp_queue_create(rtsp->fd))) {
+                    send_reply(500, 0, rtsp); /* Internal server error */
+                    return RTSP_ERR_GENERIC;
+                }
+                // The scheduler writes too, the loop only has to resume
+                // whenever the socket drains
+                ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                ev.data.ptr = rtsp;
+                epoll_ctl(rtspEpoll, EPOLL_CTL_MOD, rtsp->fd, &ev);
+            }
+            rtp_s->rtpHandle = (struct _tagStRtpHandle *)rtp_create_tcp(
+                rtsp->queue, Transport.u.tcp.interleaved.RTP,
+                Transport.u.tcp.interleaved.RTCP, payload);
+
+            Transport.rtpFd = rtsp->fd;
+            Transport.type = RTP_TRANSP_RTP_AVP_TCP;
+        } else if (!*pStr || (*pStr == ';') || (*pStr == ' ') ||
+            (*pStr == '/')) {
+            if (strstr(s8TranStr, "multicast")) {
+                // The group is set by the server, whatever was asked for,
+                // and only carries the main video
+                if (stream != RING_VIDEO ||
+                    rtsp_multicast_join(&Transport) != RTSP_ERR_NOERROR) {
+                    send_reply(461, 0, rtsp); // Unsupported Transport
+                    return RTSP_ERR_NOERROR;
+                }
+            } else {
+                //单播
                 //如果指定了客户端端口号，填充对应的两个端口号
                 if ((pStr = strstr(
                          s8TranStr,
@@ -880,28 +1050,18 @@ int rtsp_setup(rtspBuffer *rtsp) {
                 rtp_s->rtpHandle = (struct _tagStRtpHandle *)rtp_create(
                     (unsigned int)(((struct sockaddr_in *)(&rtsp->stClientAddr))
                                        ->sin_addr.s_addr),
-                    Transport.u.udp.cliPorts.RTP, _h264nalu);
+                    Transport.u.udp.cliPorts.RTP, payload);
                 printf("<><><><>Creat RTP<><><><>\n");
+                if (rtp_s->rtpHandle)
+                    rtcp_open((unsigned int)rtp_s->rtpHandle,
+                        (unsigned int)(((struct sockaddr_in *)(&rtsp->stClientAddr))
+                                           ->sin_addr.s_addr),
+                        Transport.u.udp.serPorts.RTCP,
+                        Transport.u.udp.cliPorts.RTCP);
 
                 Transport.u.udp.isMulticast = 0;
-            } else {
-                printf("multicast not codeing\n");
-                // multicast 多播处理....
             }
             Transport.type = RTP_TRANSP_RTP_AVP;
-        } else if (!strncmp(s8TranStr, "/TCP", 4)) {
-            if ((pStr = strstr(s8TranStr, "interleaved"))) {
-                pStr = strstr(s8TranStr, "=");
-                sscanf(pStr + 1, "%d", &(Transport.u.tcp.interleaved.RTP));
-                if ((pStr = strstr(pStr, "-")))
-                    sscanf(pStr + 1, "%d", &(Transport.u.tcp.interleaved.RTCP));
-                else
-                    Transport.u.tcp.interleaved.RTCP =
-                        Transport.u.tcp.interleaved.RTP + 1;
-            } else {
-            }
-
-            Transport.rtpFd = rtsp->fd;
         }
     }
     printf("pstr=%s\n", pStr);
@@ -934,7 +1094,14 @@ int rtsp_setup(rtspBuffer *rtsp) {
     }
 
     rtsp->session_list->session_id = s32SessionID;
-    rtsp->session_list->rtpSession->schedId = schedule_add(rtp_s);
+    if (rtsp_is_multicast(rtp_s)) {
+        rtp_s->schedId = -1;
+    } else if ((rtp_s->schedId = schedule_add(rtp_s)) < 0) {
+        rtp_delete((unsigned int)rtp_s->rtpHandle);
+        rtp_s->rtpHandle = NULL;
+        send_reply(453, 0, rtsp); // Not Enough Bandwidth
+        return RTSP_ERR_NOERROR;
+    }
 
     send_setup_reply(rtsp, rtsp_s, rtp_s);
 
@@ -999,7 +1166,10 @@ int rtsp_play(rtspBuffer *rtsp) {
             for (pRtpSesn = pRtspSesn->rtpSession; pRtpSesn != NULL;
                  pRtpSesn = pRtpSesn->next) {
                 //播放所有演示
-                if (!pRtpSesn->started) {
+                if (rtsp_is_multicast(pRtpSesn)) {
+                    if (!pRtpSesn->started)
+                        rtsp_multicast_play(pRtpSesn);
+                } else if (!pRtpSesn->started) {
                     //开始新的播放
                     printf("\t+++++++++++++++++++++\n");
                     printf("\tstart to play %d now!\n", pRtpSesn->schedId);
@@ -1105,13 +1275,16 @@ int rtsp_teardown(rtspBuffer *rtsp) {
 
         pRtpSesn = pRtpSesn->next;
 
-        rtp_delete((unsigned int)pRtpSesnTemp->rtpHandle);
-        schedule_remove(pRtpSesnTemp->schedId);
+        if (rtsp_is_multicast(pRtpSesnTemp)) {
+            rtsp_multicast_leave(pRtpSesnTemp);
+        } else {
+            schedule_remove(pRtpSesnTemp->schedId);
+            rtp_delete((unsigned int)pRtpSesnTemp->rtpHandle);
+        }
         g_s32DoPlay--;
     }
     if (g_s32DoPlay == 0) {
-        printf("no user online now resetfifo\n");
-        ring_reset;
+        printf("no user online now\n");
         rtsp_portpool_init(RTP_DEFAULT_PORT);
     }
     if (pRtspSesn->rtpSession == NULL) {
@@ -1268,11 +1441,19 @@ void rtsp_remove_msg(int len, rtspBuffer *rtsp) {
     }
 }
 
-void rtsp_discard_msg(rtspBuffer *rtsp) {
-    int hlen, blen;
+// Receiver reports and NACKs of an interleaved viewer share its connection
+static void rtsp_interleaved_rtcp(rtspBuffer *rtsp, int hlen, int blen) {
+    unsigned char channel = rtsp->in_buffer[1];
+    rtpSession *rtp_s;
 
-    if (rtsp_full_msg_rcvd(rtsp, &hlen, &blen) > 0)
-        rtsp_remove_msg(hlen + blen, rtsp);
+    if (!rtsp->session_list)
+        return;
+    for (rtp_s = rtsp->session_list->rtpSession; rtp_s; rtp_s = rtp_s->next)
+        if (rtp_s->rtpHandle &&
+            rtp_s->transport.type == RTP_TRANSP_RTP_AVP_TCP &&
+            rtp_s->transport.u.tcp.interleaved.RTCP == channel)
+            rtcp_input((unsigned int)rtp_s->rtpHandle,
+                (unsigned char *)rtsp->in_buffer + hlen, blen);
 }
 
 /**************************************************************************************************
@@ -1281,9 +1462,23 @@ void rtsp_discard_msg(rtspBuffer *rtsp) {
 **
 **************************************************************************************************/
 int rtsp_handler(rtspBuffer *rtsp) {
-    int s32Meth;
+    int s32Meth, s32Res, hlen, blen;
+
+    while (rtsp->in_size) {
+        /*消息还没有接收完整，等待更多数据*/
+        s32Res = rtsp_full_msg_rcvd(rtsp, &hlen, &blen);
+        if (s32Res == RTSP_MSG_NOT_FULL)
+            break;
+        if (s32Res < 0)
+            return RTSP_ERR_GENERIC;
+        /*交叉存取的RTCP数据包交给对应的会话*/
+        if (s32Res == RTSP_MSG_INTERLEAVED) {
+            rtsp_interleaved_rtcp(rtsp, hlen, blen);
+            rtsp_remove_msg(hlen + blen, rtsp);
+            continue;
+        }
 
-    while (rtsp->in_size) { //根据pRtsp的in_buffer来判断方法类型，出错返回-1
+        //根据pRtsp的in_buffer来判断方法类型，出错返回-1
         s32Meth = rtsp_validate_method(rtsp);
         if (s32Meth < 0) {
             //错误的请求，请求的方法不存在
@@ -1296,200 +1491,192 @@ int rtsp_handler(rtspBuffer *rtsp) {
             printf("exit Rtsp_state_machine\r\n");
         }
         //丢弃处理之后的消息
-        rtsp_discard_msg(rtsp);
-        printf("4\r\n");
+        rtsp_remove_msg(hlen + blen, rtsp);
     }
     return RTSP_ERR_NOERROR;
 }
 
-/**************************************************************************************************
-**用select休眠，有RTSP数据或超时100ms唤醒。当有RTSP数据时，唤醒，先tcp_read
-**返回值:
-        ERR_NOERROR:
-有很多原因，分情况:无内存，正常等都产生这个错误 ERR_GENERIC:
-内部错误 ERR_CONNECTION_CLOSE:	连接关闭
-**
-**************************************************************************************************/
-int rtsp_server(rtspBuffer *rtsp) {
-    fd_set rset, wset; /*读写I/O描述集*/
-    struct timeval t;
-    int size;
-    static char buffer[RTSP_BUFFERSIZE + 1]; /* +1 to control the final '\0'*/
+// Sends what the state machine queued, the rest waits for EPOLLOUT
+static int rtsp_flush(rtspBuffer *rtsp) {
     int n;
-    int res;
-    struct sockaddr ClientAddr;
 
-    if (!buffer)
-        return RTSP_ERR_NOERROR;
-
-    /*变量初始化*/
-    FD_ZERO(&rset);
-    FD_ZERO(&wset);
-    t.tv_sec = 0; /*select 时间间隔*/
-    t.tv_usec = 100000;
+    // Replies must not cut into an interleaved packet being written
+    if (rtsp->queue) {
+        if (rtsp->out_size > 0 &&
+            rtp_queue_write(rtsp->queue, rtsp->out_buffer, rtsp->out_size) < 0)
+            return RTSP_ERR_GENERIC;
+        rtsp->out_size = 0;
+        return rtp_queue_flush(rtsp->queue) < 0 ?
+            RTSP_ERR_GENERIC : RTSP_ERR_NOERROR;
+    }
 
-    FD_SET(rtsp->fd, &rset);
+    while (rtsp->out_size > 0) {
+        n = send(rtsp->fd, rtsp->out_buffer, rtsp->out_size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            fprintf(stderr, "send error %s %i\n", __FILE__, __LINE__);
+            return RTSP_ERR_GENERIC;
+        }
+        rtsp->out_size -= n;
+        memmove(rtsp->out_buffer, rtsp->out_buffer + n, rtsp->out_size);
+    }
 
-    /*调用select等待对应描述符变化*/
-    if (select(maxFd + 1, &rset, 0, 0, &t) < 0) {
-        fprintf(stderr, "select error %s %d\n", __FILE__, __LINE__);
-        send_reply(500, NULL, rtsp);
-        return RTSP_ERR_GENERIC; // errore interno al server
+    if (rtsp->out_pending != (rtsp->out_size > 0)) {
+        struct epoll_event ev;
+        rtsp->out_pending = rtsp->out_size > 0;
+        ev.events = EPOLLIN | EPOLLRDHUP | (rtsp->out_pending ? EPOLLOUT : 0);
+        ev.data.ptr = rtsp;
+        epoll_ctl(rtspEpoll, EPOLL_CTL_MOD, rtsp->fd, &ev);
     }
 
-    /*有可供读进的rtsp包*/
-    if (FD_ISSET(rtsp->fd, &rset)) {
-        memset(buffer, 0, sizeof(buffer));
-        size = sizeof(buffer) - 1; /*最后一位用于填充字符串结束标识*/
+    return RTSP_ERR_NOERROR;
+}
 
-        /*读入数据到缓冲区中*/
+/**************************************************************************************************
+**读取套接字上所有可用的数据，只处理已经完整接收的RTSP消息，其余留待下次
+**返回值:
+        ERR_NOERROR:		正常
+        ERR_GENERIC:		内部错误
+        ERR_CONNECTION_CLOSE:	连接关闭
+**
+**************************************************************************************************/
+int rtsp_server(rtspBuffer *rtsp) {
+    int n;
+    struct sockaddr ClientAddr;
 
-        //读取客户端RTSP包的IP,PORT及判断RTSP包的大小和内容
-        //返回0:关闭	返回负数:错误		大于0:表示接收数据的大小
-        n = tcp_read(rtsp->fd, buffer, size, &ClientAddr);
-        if (n == 0) {
-            return RTSP_ERR_CONNECTION_CLOSE;
+    for (;;) {
+        /*始终保留一个字节作为字符串结束标识*/
+        int room = RTSP_BUFFERSIZE - 1 - rtsp->in_size;
+        if (room <= 0) {
+            fprintf(
+                stderr, "RTSP buffer overflow (input RTSP message is most "
+                        "likely invalid).\n");
+            send_reply(500, NULL, rtsp);
+            rtsp_flush(rtsp);
+            return RTSP_ERR_GENERIC;
         }
 
+        n = tcp_read(rtsp->fd, &rtsp->in_buffer[rtsp->in_size], room,
+            &ClientAddr);
+        if (n == 0)
+            return RTSP_ERR_CONNECTION_CLOSE;
         if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
             fprintf(stderr, "read() error %s %d\n", __FILE__, __LINE__);
-            send_reply(500, NULL, rtsp); //服务器内部错误消息
             return RTSP_ERR_GENERIC;
         }
 
-        //检查读入的数据是否产生溢出
-        if (rtsp->in_size + n > RTSP_BUFFERSIZE) {
-            fprintf(
-                stderr, "RTSP buffer overflow (input RTSP message is most "
-                        "likely invalid).\n");
-            send_reply(500, NULL, rtsp);
-            return RTSP_ERR_GENERIC; //数据溢出错误
-        }
-
-        /*填充数据*/
-        memcpy(&(rtsp->in_buffer[rtsp->in_size]), buffer, n);
         rtsp->in_size += n;
-        //清空buffer
-        memset(buffer, 0, n);
-        //添加客户端地址信息
+        rtsp->in_buffer[rtsp->in_size] = '\0';
         memcpy(&rtsp->stClientAddr, &ClientAddr, sizeof(ClientAddr));
 
         //对接收到的RTSP包进行方法判断，然后根据方法进行状态机处理
-        if ((res = rtsp_handler(rtsp)) == RTSP_ERR_GENERIC) {
+        if (rtsp_handler(rtsp) == RTSP_ERR_GENERIC) {
             fprintf(stderr, "Invalid input message.\n");
-            return RTSP_ERR_NOERROR;
+            rtsp->in_size = 0;
+            memset(rtsp->in_buffer, 0, sizeof(rtsp->in_buffer));
         }
     }
 
-    /*有发送数据*/
-    if (rtsp->out_size > 0) {
-        //将数据发送出去
-        n = tcp_write(rtsp->fd, rtsp->out_buffer, rtsp->out_size);
-        printf("5\r\n");
-        if (n < 0) {
-            fprintf(stderr, "tcp_write error %s %i\n", __FILE__, __LINE__);
-            send_reply(500, NULL, rtsp);
-            return RTSP_ERR_GENERIC; // errore interno al server
+    return rtsp_flush(rtsp);
+}
+
+// Tears down whatever the client left running and unlinks it from the list
+static void rtsp_drop_connection(rtspBuffer **rtsp_list, rtspBuffer *rtsp,
+    int res, int *conn_count) {
+    rtspBuffer **link;
+    rtpSession *r = NULL, *t = NULL;
+
+    if (res == RTSP_ERR_CONNECTION_CLOSE)
+        fprintf(stderr, "fd:%d,RTSP connection closed by client.\n", rtsp->fd);
+    else
+        fprintf(stderr, "fd:%d,RTSP connection closed by server.\n", rtsp->fd);
+
+    /*客户端在发送TEARDOWN 之前就截断了连接，但是会话却没有被释放*/
+    if (rtsp->session_list != NULL) {
+        r = rtsp->session_list->rtpSession;
+        /*释放所有会话*/
+        while (r != NULL) {
+            t = r->next;
+            if (rtsp_is_multicast(r)) {
+                rtsp_multicast_leave(r);
+            } else {
+                schedule_remove(r->schedId);
+                rtp_delete((unsigned int)(r->rtpHandle));
+            }
+            r = t;
         }
 
-        //清空发送缓冲区
-        memset(rtsp->out_buffer, 0, rtsp->out_size);
-        rtsp->out_size = 0;
+        /*释放链表头指针*/
+        free(rtsp->session_list);
+        rtsp->session_list = NULL;
+
+        g_s32DoPlay--;
+        if (g_s32DoPlay == 0) {
+            printf("user abort! no user online now\n");
+            /* 重新将所有可用的RTP端口号放入到port_pool[MAX_SESSION] 中 */
+            rtsp_portpool_init(RTP_DEFAULT_PORT);
+        }
+        fprintf(
+            stderr,
+            "WARNING! fd:%d RTSP connection truncated before "
+            "ending operations.\n",
+            rtsp->fd);
     }
 
-    //如果需要RTCP在此出加入对RTCP数据的接收，并存放在缓存中。
-    //继而在schedule_do线程中对其处理。
-    // rtcp控制处理,检查读入RTCP数据报
+    epoll_ctl(rtspEpoll, EPOLL_CTL_DEL, rtsp->fd, NULL);
+    rtp_queue_free(rtsp->queue);
+    close(rtsp->fd);
+    --*conn_count;
+    num_conn--;
 
-    return RTSP_ERR_NOERROR;
+    for (link = rtsp_list; *link != NULL; link = &(*link)->next) {
+        if (*link == rtsp) {
+            *link = rtsp->next;
+            break;
+        }
+    }
+    free(rtsp);
 }
 
-void rtsp_schedule_connections(rtspBuffer **rtsp_list, int *conn_count) {
-    int res;
-    rtspBuffer *pRtsp = *rtsp_list, *pRtspN = NULL;
-    rtpSession *r = NULL, *t = NULL;
-
-    while (pRtsp != NULL) {
-        if ((res = rtsp_server(pRtsp)) != RTSP_ERR_NOERROR) {
-            if (res == RTSP_ERR_CONNECTION_CLOSE || res == RTSP_ERR_GENERIC) {
-                /*连接已经关闭*/
-                if (res == RTSP_ERR_CONNECTION_CLOSE)
-                    fprintf(
-                        stderr, "fd:%d,RTSP connection closed by client.\n",
-                        pRtsp->fd);
-                else
-                    fprintf(
-                        stderr, "fd:%d,RTSP connection closed by server.\n",
-                        pRtsp->fd);
-
-                /*客户端在发送TEARDOWN 之前就截断了连接，但是会话却没有被释放*/
-                if (pRtsp->session_list != NULL) {
-                    r = pRtsp->session_list->rtpSession;
-                    /*释放所有会话*/
-                    while (r != NULL) {
-                        t = r->next;
-                        rtp_delete((unsigned int)(r->rtpHandle));
-                        schedule_remove(r->schedId);
-                        r = t;
-                    }
+static void rtsp_accept_connections(int mainFd, rtspBuffer **rtsp_list,
+    int *conn_count) {
+    int fd;
+    rtspBuffer *rtsp;
+    struct epoll_event ev;
+
+    /*监听套接字是非阻塞的，一次接收所有等待中的连接*/
+    while ((fd = tcp_accept(mainFd)) >= 0) {
+        if (*conn_count >= MAX_CLIENTS) {
+            fprintf(stderr, "exceed the MAX client, ignore this connecting\n");
+            close(fd);
+            continue;
+        }
 
-                    /*释放链表头指针*/
-                    free(pRtsp->session_list);
-                    pRtsp->session_list = NULL;
-
-                    g_s32DoPlay--;
-                    if (g_s32DoPlay == 0) {
-                        printf("user abort! no user online now resetfifo\n");
-                        ring_reset;
-                        /* 重新将所有可用的RTP端口号放入到port_pool[MAX_SESSION]
-                         * 中 */
-                        rtsp_portpool_init(RTP_DEFAULT_PORT);
-                    }
-                    fprintf(
-                        stderr,
-                        "WARNING! fd:%d RTSP connection truncated before "
-                        "ending operations.\n",
-                        pRtsp->fd);
-                }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (!(rtsp = AddClient(rtsp_list, fd))) {
+            close(fd);
+            continue;
+        }
 
-                // wait for
-                close(pRtsp->fd);
-                --*conn_count;
-                num_conn--;
-
-                /*释放rtsp缓冲区*/
-                if (pRtsp == *rtsp_list) {
-                    //链表第一个元素就出错，则pRtspN为空
-                    printf("first error,pRtsp is null\n");
-                    *rtsp_list = pRtsp->next;
-                    free(pRtsp);
-                    pRtsp = *rtsp_list;
-                } else {
-                    //不是链表中的第一个，则把当前出错任务删除，并把next任务存放在pRtspN(上一个没有出错的任务)
-                    //指向的next，和当前需要处理的pRtsp中.
-                    printf("dell current fd:%d\n", pRtsp->fd);
-                    pRtspN->next = pRtsp->next;
-                    free(pRtsp);
-                    pRtsp = pRtspN->next;
-                    printf("current next fd:%d\n", pRtsp->fd);
-                }
+        ++*conn_count;
+        num_conn++;
 
-                /*适当情况下，释放调度器本身*/
-                if (pRtsp == NULL && *conn_count < 0) {
-                    fprintf(stderr, "to stop cchedule_do thread\n");
-                    stop_schedule = 1;
-                }
-            } else {
-                printf("current fd:%d\n", pRtsp->fd);
-                pRtsp = pRtsp->next;
-            }
-        } else {
-            // printf("6\r\n");
-            //没有出错
-            //上一个处理没有出错的list存放在pRtspN中,需要处理的任务放在pRtst中
-            pRtspN = pRtsp;
-            pRtsp = pRtsp->next;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.ptr = rtsp;
+        if (epoll_ctl(rtspEpoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            fprintf(stderr, "Can't watch the RTSP connection %d\n", fd);
+            rtsp_drop_connection(rtsp_list, rtsp, RTSP_ERR_GENERIC,
+                conn_count);
+            continue;
         }
+        fprintf(stderr, "%s Connection reached: %d\n", __FUNCTION__, num_conn);
     }
 }
 
@@ -1502,50 +1689,61 @@ void rtsp_portpool_init(int port) {
     }
 }
 
+// Serves the listener and every control connection until shutdown, the
+// handshake of a client is answered as soon as each message is complete
 void rtsp_eventloop(int mainFd) {
-    static int s32ConCnt = 0; //已经连接的客户端数
-    int s32Fd = -1;
-    static rtspBuffer *pRtspList = NULL;
-    rtspBuffer *p = NULL;
-    unsigned int u32FdFound;
-
-    //	printf("%s\n", __FUNCTION__);
-    /*接收连接，创建一个新的socket*/
-    if (s32ConCnt != -1) {
-        /*接收新连接，创建一个新的socket,返回其描述符*/
-        //无阻塞查询是否有连接，有连接时返回值>0,无连接时返回值<0
-        s32Fd = tcp_accept(mainFd);
-    }
-
-    /*处理新创建的连接*/
-    if (s32Fd >= 0) {
-        /*查找列表中是否存在此连接的socket*/
-        for (u32FdFound = 0, p = pRtspList; p != NULL; p = p->next) {
-            if (p->fd == s32Fd) {
-                u32FdFound = 1;
-                break;
-            }
+    int s32ConCnt = 0; //已经连接的客户端数
+    rtspBuffer *pRtspList = NULL;
+    rtspBuffer *pRtsp;
+    struct epoll_event ev, events[RTSP_MAX_EVENTS];
+    int i, n, res;
+
+    rtspEpoll = epoll_create1(EPOLL_CLOEXEC);
+    if (rtspEpoll < 0) {
+        fprintf(stderr, "Can't create the RTSP event loop\n");
+        return;
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(rtspEpoll, EPOLL_CTL_ADD, mainFd, &ev) < 0) {
+        fprintf(stderr, "Can't watch the RTSP listener\n");
+        close(rtspEpoll);
+        rtspEpoll = -1;
+        return;
+    }
+
+    while (keepRunning) {
+        n = epoll_wait(rtspEpoll, events, RTSP_MAX_EVENTS, 500);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait error %s %d\n", __FILE__, __LINE__);
+            break;
         }
-        if (!u32FdFound) {
-            /*创建一个连接，增加一个客户端*/
-            if (s32ConCnt < MAX_CONNECTION) {
-                ++s32ConCnt;
-                //将新连接添加到链表里，并初始化其会话
-                AddClient(&pRtspList, s32Fd);
-            } else {
-                fprintf(
-                    stderr, "exceed the MAX client, ignore this connecting\n");
-                return;
+
+        for (i = 0; i < n; i++) {
+            pRtsp = events[i].data.ptr;
+            if (!pRtsp) {
+                rtsp_accept_connections(mainFd, &pRtspList, &s32ConCnt);
+                continue;
             }
-            num_conn++;
-            fprintf(
-                stderr, "%s Connection reached: %d\n", __FUNCTION__, num_conn);
+
+            if (events[i].events & EPOLLERR)
+                res = RTSP_ERR_GENERIC;
+            else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP))
+                res = rtsp_server(pRtsp);
+            else
+                res = rtsp_flush(pRtsp);
+            if (res != RTSP_ERR_NOERROR)
+                rtsp_drop_connection(&pRtspList, pRtsp, res, &s32ConCnt);
         }
     }
 
-    /*对已有的连接进行调度*/
-    // printf("7\r\n");
-    rtsp_schedule_connections(&pRtspList, &s32ConCnt);
+    while (pRtspList)
+        rtsp_drop_connection(
+            &pRtspList, pRtspList, RTSP_ERR_GENERIC, &s32ConCnt);
+    close(rtspEpoll);
+    rtspEpoll = -1;
 }
 
 void rtsp_interrupt(int signal) {
@@ -1594,9 +1792,6 @@ char *base64_encode2(const unsigned char *bindata, char *base64, int binlength)
     return base64;
 }
 
-// base64_encode3(ringFifo[writePos].buffer+off,9,psp.base64sps, 512);
-// base64_encode3(ringFifo[writePos].buffer+off, 4, psp.base64pps, 512);  00 00 00
-// 01 68 ce 3c 80
 void base64_encode3(char *in, const int in_len, char *out, int out_len) {
     static const char *codes =
         "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -1630,20 +1825,24 @@ void base64_encode3(char *in, const int in_len, char *out, int out_len) {
     *p = 0;
 }
 
-void rtsp_update_sps(unsigned char *data, int len) {
-    int i;
-    if (len > 21)
+static void rtsp_update_param(unsigned char *set, int *set_len,
+    unsigned char *data, int len) {
+    if (len <= 0 || len > PARAM_SET_MAX)
         return;
-    sprintf(
-        psp.base64profileid, "%x%x%x", data[1], data[2],
-        data[3]); // sps[0] 0x67
-    base64_encode3(data, len, psp.base64sps, 512);
+    pthread_mutex_lock(&paramLock);
+    memcpy(set, data, len);
+    *set_len = len;
+    pthread_mutex_unlock(&paramLock);
+}
+
+void rtsp_update_vps(unsigned char *data, int len) {
+    rtsp_update_param(params.vps, &params.vps_len, data, len);
+}
+
+void rtsp_update_sps(unsigned char *data, int len) {
+    rtsp_update_param(params.sps, &params.sps_len, data, len);
 }
 
 void rtsp_update_pps(unsigned char *data, int len) {
-    int i;
-    if (len > 21)
-        return;
-    char pic1_paramBase64[512] = {0};
-    base64_encode3(data, len, psp.base64pps, 512);
+    rtsp_update_param(params.pps, &params.pps_len, data, len);
 }
\ No newline at end of file
@@ -9,5 +9,7 @@ void rtsp_interrupt(int signal);
 void rtsp_portpool_init(int port);
 void *rtsp_schedule_thread(void);
 int rtsp_server(rtspBuffer *rtsp);
+// Parameter sets exactly as found in the stream, without their start code
+void rtsp_update_vps(unsigned char *data, int len);
 void rtsp_update_sps(unsigned char *data, int len);
 void rtsp_update_pps(unsigned char *data, int len);
\ No newline at end of file
@@ -10,6 +10,8 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "../app_config.h"
+#include "../video.h"
 #include "ringfifo.h"
 #include "rtputils.h"
 #include "rtspservice.h"
@@ -168,6 +170,9 @@ int tcp_write(int connectSocketId, char *dataBuf, int dataSize) {
 }
 
 rtspSchedList sched[MAX_CONNECTION];
+// Held while the scheduler sends, a removed session is no longer in use
+// once schedule_remove returns and its handle can be freed
+pthread_mutex_t schedLock = PTHREAD_MUTEX_INITIALIZER;
 
 int stop_schedule = 0;
 int num_conn = 2;
@@ -181,7 +186,6 @@ int rtsp_init_schedule() {
         sched[i].session = NULL;
         sched[i].playAction = NULL;
         sched[i].valid = 0;
-        sched[i].BeginFrame = 0;
     }
 
     {
@@ -207,59 +211,142 @@ int rtsp_init_schedule() {
     return 0;
 }
 
+// Loss, out of 256, above which a report counts against the bitrate and
+// below which it counts for it, the rate moves once enough agree in a row
+#define ABR_LOSS_HIGH 13
+#define ABR_LOSS_LOW 3
+#define ABR_LOWER_AFTER 2
+#define ABR_RAISE_AFTER 3
+
+// Takes the worst viewer of the reports received since the last pass,
+// lowers the encoder bitrate by a quarter on sustained losses and gives it
+// back a tenth at a time once they have cleared
+static void rtsp_adapt_bitrate() {
+    static unsigned int bitrate = 0;
+    static int lossy = 0, clean = 0;
+    static bool unsupported = false;
+    struct RtcpStats stats;
+    int i, loss, worst = -1, viewers = 0;
+    unsigned int target;
+
+    if (!app_config.rtsp_adaptive_bitrate || !app_config.mp4_enable ||
+        unsupported)
+        return;
+    if (!bitrate)
+        bitrate = app_config.mp4_bitrate;
+
+    for (i = 0; i < MAX_CONNECTION; ++i) {
+        if (!sched[i].valid || sched[i].session->pause ||
+            !sched[i].session->rtpHandle ||
+            sched[i].session->stream != RING_VIDEO)
+            continue;
+        viewers++;
+        rtp_get_stats((unsigned int)sched[i].session->rtpHandle, &stats);
+        loss = -1;
+        if (stats.reported != sched[i].reported)
+            loss = stats.fraction_lost;
+        // Asked again for, the loss the last report may not tell yet
+        if (stats.nack_count > sched[i].nacked && stats.sent > sched[i].sent) {
+            unsigned int nacks = (stats.nack_count - sched[i].nacked) * 256 /
+                (stats.sent - sched[i].sent);
+            if ((int)nacks > loss)
+                loss = nacks > 255 ? 255 : nacks;
+        }
+        sched[i].reported = stats.reported;
+        sched[i].nacked = stats.nack_count;
+        sched[i].sent = stats.sent;
+        if (loss > worst)
+            worst = loss;
+    }
+
+    target = bitrate;
+    if (!viewers)
+        target = app_config.mp4_bitrate, lossy = clean = 0;
+    else if (worst < 0)
+        return;
+    else if (worst > ABR_LOSS_HIGH)
+        lossy++, clean = 0;
+    else if (worst < ABR_LOSS_LOW)
+        clean++, lossy = 0;
+    else
+        lossy = clean = 0;
+
+    if (lossy >= ABR_LOWER_AFTER) {
+        target = bitrate * 3 / 4;
+        if (target < app_config.rtsp_min_bitrate)
+            target = app_config.rtsp_min_bitrate;
+        lossy = 0;
+    } else if (clean >= ABR_RAISE_AFTER) {
+        target = bitrate + app_config.mp4_bitrate / 10;
+        if (target > app_config.mp4_bitrate)
+            target = app_config.mp4_bitrate;
+        clean = 0;
+    }
+
+    if (target == bitrate)
+        return;
+    printf("Adjusting the bitrate to %u kbps (loss %d/256)\n", target, worst);
+    // The encoder keeps its rate when the channel has none to change, such
+    // as with a fixed QP, there is nothing left to adapt then
+    if (set_video_bitrate(target)) {
+        fprintf(stderr, "Setting the bitrate failed, no longer adapting it\n");
+        unsupported = true;
+        return;
+    }
+    bitrate = target;
+}
+
 void *rtsp_schedule_thread() {
-    int i = 0;
-    struct timeval now;
-    unsigned long long mnow;
-    char *pDataBuf, *pFindNal;
-    unsigned int ringbuffer;
-    struct timespec ts = {0, 33333};
-    int s32FileId;
-    unsigned int u32NaluToken;
-    char *pNalStart = NULL;
-    int s32NalSize;
-    int s32FindNal = 0;
-    int buflen = 0, ringbuflen = 0, ringbuftype;
+    int i = 0, s;
+    unsigned int tstamp, oldest[RING_STREAMS];
     struct ringbuf ringinfo;
 
     do {
-        nanosleep(&ts, NULL);
+        ring_wait(500);
 
-        s32FindNal = 0;
-
-        ringbuflen = ring_get(&ringinfo);
-        if (ringbuflen == 0)
-            continue;
-        s32FindNal = 1;
+        // Every session drains its ring at its own pace, paused ones
+        // rejoin on a keyframe and hold nothing back meanwhile
+        for (s = 0; s < RING_STREAMS; s++)
+            oldest[s] = ring_head(s);
+        pthread_mutex_lock(&schedLock);
         for (i = 0; i < MAX_CONNECTION; ++i) {
-            if (sched[i].valid) {
-                if (!sched[i].session->pause) {
-                    gettimeofday(&now, NULL);
-                    mnow = (now.tv_sec * 1000 + now.tv_usec / 1000);
-                    if ((sched[i].session->rtpHandle) && (s32FindNal)) {
-                        buflen = ringbuflen;
-                        if (ringinfo.frame_type == FRAME_TYPE_I)
-                            sched[i].BeginFrame = 1;
-                        sched[i].playAction(
-                            (unsigned int)(sched[i].session->rtpHandle),
-                            ringinfo.buffer, ringinfo.size, mnow);
-                    }
-                }
+            if (!sched[i].valid || sched[i].session->pause ||
+                !sched[i].session->rtpHandle)
+                continue;
+            while (ring_get(&sched[i].cursor, &ringinfo)) {
+                // The 90kHz clock follows the encoder, not the time of sending
+                tstamp = (unsigned int)(ringinfo.frame->timestamp * 9 / 100);
+                sched[i].playAction(
+                    (unsigned int)(sched[i].session->rtpHandle),
+                    ringinfo.frame, tstamp);
             }
+            s = sched[i].cursor.stream;
+            if (ring_cursor_before(&sched[i].cursor, oldest[s]))
+                oldest[s] = sched[i].cursor.pos;
+            rtcp_poll((unsigned int)(sched[i].session->rtpHandle));
         }
+        rtsp_adapt_bitrate();
+        pthread_mutex_unlock(&schedLock);
+        for (s = 0; s < RING_STREAMS; s++)
+            ring_retire(s, oldest[s]);
     } while (!stop_schedule);
+    rtp_cache_clear();
 
     return RTSP_ERR_NOERROR;
 }
 
 int schedule_add(rtpSession *session) {
     int i;
+    pthread_mutex_lock(&schedLock);
     for (i = 0; i < MAX_CONNECTION; ++i) {
         if (!sched[i].valid) {
             sched[i].valid = 1;
             sched[i].session = session;
+            sched[i].reported = 0;
+            sched[i].nacked = sched[i].sent = 0;
 
-            sched[i].playAction = rtp_send;
+            sched[i].playAction = rtp_send_frame;
+            pthread_mutex_unlock(&schedLock);
             printf(
                 "**adding a schedule object action %s,%d**\n", __FILE__,
                 __LINE__);
@@ -267,23 +354,44 @@ int schedule_add(rtpSession *session) {
             return i;
         }
     }
+    pthread_mutex_unlock(&schedLock);
     return RTSP_ERR_GENERIC;
 }
 
 int schedule_start(int id, playArgs *args) {
+    if (id < 0 || id >= MAX_CONNECTION)
+        return RTSP_ERR_GENERIC;
+    pthread_mutex_lock(&schedLock);
+    // Rather than waiting out the GOP, the encoder being asked once the
+    // lock is released
+    bool idr =
+        !ring_cursor_init(&sched[id].cursor, sched[id].session->stream) &&
+        sched[id].session->stream == RING_VIDEO;
     sched[id].session->pause = 0;
     sched[id].session->started = 1;
+    pthread_mutex_unlock(&schedLock);
+    if (idr)
+        request_idr();
 
     g_s32DoPlay++;
 
     return RTSP_ERR_NOERROR;
 }
 
-void schedule_stop(int id) {}
+void schedule_stop(int id) {
+    if (id < 0 || id >= MAX_CONNECTION)
+        return;
+    pthread_mutex_lock(&schedLock);
+    sched[id].session->pause = 1;
+    pthread_mutex_unlock(&schedLock);
+}
 
 int schedule_remove(int id) {
+    if (id < 0 || id >= MAX_CONNECTION)
+        return RTSP_ERR_GENERIC;
+    pthread_mutex_lock(&schedLock);
     sched[id].valid = 0;
-    sched[id].BeginFrame = 0;
+    pthread_mutex_unlock(&schedLock);
     return RTSP_ERR_NOERROR;
 }
 
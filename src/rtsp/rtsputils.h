@@ -1,6 +1,8 @@
 #pragma once
 
 #include "rtspdefines.h"
+#include "../frame.h"
+#include "ringfifo.h"
 
 #include <ctype.h>
 #include <math.h>
@@ -43,6 +45,8 @@ typedef struct _rtpTransport {
 typedef struct _rtpSession {
     struct _tagStRtpHandle *rtpHandle;
     rtpTransport transport;
+    // Ring of the encoder channel the session is fed from
+    enum ringstream stream;
     unsigned char pause;
     unsigned char started;
     int schedId;
@@ -68,6 +72,9 @@ typedef struct _rtspBuffer {
     unsigned int in_size;
     char out_buffer[RTSP_BUFFERSIZE + MAX_DESCR_LENGTH];
     int out_size;
+    int out_pending;
+    // Set once a session is interleaved, everything written goes through it
+    struct RtpQueue *queue;
 
     unsigned int rtsp_cseq;
     char descr[MAX_DESCR_LENGTH];
@@ -84,7 +91,10 @@ int tcp_read(int fd, void *buffer, int nbytes, struct sockaddr *Addr);
 int tcp_send(int fd, void *dataBuf, unsigned int dataSize);
 int tcp_write(int fd, char *buffer, int nbytes);
 
+// Unicast sessions, each with its own sender and port pair
 #define MAX_CONNECTION 10
+// Control connections, multicast viewers only hold one of these
+#define MAX_CLIENTS 64
 
 typedef struct _play_args {
     struct tm playback_time;
@@ -94,14 +104,17 @@ typedef struct _play_args {
     float end_time;
 } playArgs;
 
-typedef unsigned int (*rtpPlayAct)(unsigned int rtp, char *data, int size,
+typedef unsigned int (*rtpPlayAct)(unsigned int rtp, struct Frame *frame,
     unsigned int tstamp);
 
 typedef struct _rtspSchedList {
     int valid;
-    int BeginFrame;
+    struct ringcursor cursor;
     rtpSession *session;
     rtpPlayAct playAction;
+    // Receiver report state already accounted for by the bitrate control
+    unsigned long long reported;
+    unsigned int nacked, sent;
 } rtspSchedList;
 
 void rtsp_deinit_schedule();
@@ -123,7 +136,8 @@ typedef enum {
     RR = 201,
     SDES = 202, /*Source description items, including CNAME,NAME,EMAIL,etc*/
     BYE = 203,  /*Indicates end of participation*/
-    APP = 204   /*Application-specific functions*/
+    APP = 204,  /*Application-specific functions*/
+    RTPFB = 205 /*Transport layer feedback, a generic NACK with format 1*/
 } rtcp_pkt_type;
 
 #define SERVER_RTSP_PORT_DEFAULT 554
@@ -1,30 +1,56 @@
 #include "server.h"
 
+#include "storage.h"
+#include "video.h"
+
 char keepRunning = 1;
 
-enum StreamType { STREAM_H264, STREAM_JPEG, STREAM_MJPEG, STREAM_MP4 };
+// Replies are single responses written out by the server thread like the
+// streams, the connection being closed once they are out
+enum StreamType { STREAM_H264, STREAM_JPEG, STREAM_MJPEG, STREAM_MP4,
+    STREAM_REPLY };
 
 struct Client {
     int socket_fd;
     enum StreamType type;
     struct Mp4State mp4;
     unsigned int nalCnt;
+    // Raw stream clients get the GOP cache along with their first frame
+    bool started;
+
+    // Filled by the encoder callbacks and drained by the server thread,
+    // both under the lock
+    pthread_mutex_t lock;
+    struct PacketQueue queue;
+    bool closing, writable;
 };
 
 #define MAX_CLIENTS 50
 struct Client client_fds[MAX_CLIENTS];
-pthread_mutex_t client_fds_mutex;
+
+#define MAX_CONNS 256
+#define CONN_TIMEOUT 15
+
+// Tags of the descriptors watched by the server thread, pending connections
+// are tagged with their own index below MAX_CONNS
+#define EV_LISTEN MAX_CONNS
+#define EV_NOTIFY (MAX_CONNS + 1)
+#define EV_CLIENT (MAX_CONNS + 2)
+
+int epoll_fd = -1, notify_fd = -1;
 
 void close_socket_fd(int socket_fd) {
     shutdown(socket_fd, SHUT_RDWR);
     close(socket_fd);
 }
 
+// Must be called with the client lock held
 void free_client(int i) {
     if (client_fds[i].socket_fd < 0)
         return;
     close_socket_fd(client_fds[i].socket_fd);
     client_fds[i].socket_fd = -1;
+    packet_queue_reset(&client_fds[i].queue);
 }
 
 int send_to_fd(int client_fd, char *buf, ssize_t size) {
@@ -47,212 +73,389 @@ int send_to_fd_nonblock(int client_fd, char *buf, ssize_t size) {
     return 0;
 }
 
-int send_to_client(int i, char *buf, ssize_t size) {
-    ;
-    if (send_to_fd(client_fds[i].socket_fd, buf, size) < 0) {
-        free_client(i);
-        return -1;
-    }
-    return 0;
+// Gathers the pieces of a single HTTP chunk into the given vectors, the size
+// line and the trailer are only wrapped around them once it is complete
+struct Chunk {
+    struct iovec *iov;
+    int iovcnt, iovmax;
+    unsigned int size;
+    char len_buf[16];
+};
+
+static void chunk_init(struct Chunk *chunk, struct iovec *iov, int iovmax) {
+    chunk->iov = iov;
+    chunk->iovcnt = 1;
+    chunk->iovmax = iovmax;
+    chunk->size = 0;
 }
 
-void send_h264_to_client(unsigned char index, const void *p) {
-    const hal_vidstream *stream = (const hal_vidstream *)p;
+static bool chunk_add(struct Chunk *chunk, const void *data,
+    unsigned int size) {
+    if (chunk->iovcnt >= chunk->iovmax - 1)
+        return false;
+    chunk->iov[chunk->iovcnt].iov_base = (void *)data;
+    chunk->iov[chunk->iovcnt++].iov_len = size;
+    chunk->size += size;
+    return true;
+}
 
-    for (unsigned int i = 0; i < stream->count; ++i) {
-        hal_vidpack *pack = &stream->pack[i];
-        unsigned int pack_len = pack->length - pack->offset;
-        unsigned char *pack_data = pack->data + pack->offset;
+static void chunk_end(struct Chunk *chunk) {
+    chunk->iov[0].iov_base = chunk->len_buf;
+    chunk->iov[0].iov_len = sprintf(chunk->len_buf, "%X\r\n", chunk->size);
+    chunk->iov[chunk->iovcnt].iov_base = "\r\n";
+    chunk->iov[chunk->iovcnt++].iov_len = 2;
+}
 
-        ssize_t nal_start = 3;
-        if (!nal_chk3(pack_data, 0)) {
-            ++nal_start;
-            if (!nal_chk4(pack_data, 0))
-                continue;
+// Wakes up the server thread so it starts writing out the new packets
+void notify_server(void) {
+    uint64_t one = 1;
+    if (notify_fd >= 0)
+        write(notify_fd, &one, sizeof(one));
+}
+
+// Writes out the queued packets until the socket is full
+void flush_client(int i) {
+    struct Client *client = &client_fds[i];
+    pthread_mutex_lock(&client->lock);
+    if (client->socket_fd >= 0) {
+        int ret = packet_queue_send(&client->queue, client->socket_fd);
+        if (ret > 0)
+            client->writable = false;
+        else if (ret < 0 || client->closing)
+            free_client(i);
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+// Hands a socket over to the server thread, the response header goes out
+// through the queue like everything else written to it, as a control packet
+// no amount of media can push out
+static void queue_client(int client_fd, enum StreamType type,
+    const struct iovec *iov, int iovcnt) {
+    for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
+        struct Client *client = &client_fds[i];
+        pthread_mutex_lock(&client->lock);
+        if (client->socket_fd >= 0) {
+            pthread_mutex_unlock(&client->lock);
+            continue;
+        }
+
+        client->type = type;
+        client->nalCnt = 0;
+        client->started = false;
+        client->mp4.header_sent = false;
+        packet_queue_init(&client->queue);
+        client->closing = type == STREAM_REPLY;
+        client->writable = true;
+        packet_queue_push(&client->queue, iov, iovcnt, NULL, 0, PACKET_CTRL);
+        if (type == STREAM_H264)
+            client->queue.resync = true;
+
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+        struct epoll_event ev = { .events = EPOLLOUT | EPOLLET | EPOLLRDHUP,
+            .data.u32 = EV_CLIENT + i };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            packet_queue_reset(&client->queue);
+            pthread_mutex_unlock(&client->lock);
+            break;
         }
+        client->socket_fd = client_fd;
+        pthread_mutex_unlock(&client->lock);
+        return;
+    }
 
-        struct NAL nal;
-        nal_parse_header(&nal, (pack_data + nal_start)[0]);
+    static char response2[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                              "Content-Length: 0\r\nConnection: close\r\n\r\n";
+    send_to_fd_nonblock(client_fd, response2, sizeof(response2) - 1);
+    close_socket_fd(client_fd);
+}
 
-        pthread_mutex_lock(&client_fds_mutex);
-        for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
-            if (client_fds[i].socket_fd < 0)
-                continue;
-            if (client_fds[i].type != STREAM_H264)
-                continue;
+void add_client(int client_fd, enum StreamType type, char *header, int len) {
+    struct iovec iov = { .iov_base = header, .iov_len = len };
+    queue_client(client_fd, type, &iov, 1);
+}
 
-            if (client_fds[i].nalCnt == 0 &&
-                nal.unit_type != NalUnitType_SPS)
-                continue;
+// A slow client only ever holds up its own reply
+static void queue_reply_iov(int client_fd, const struct iovec *iov,
+    int iovcnt) {
+    queue_client(client_fd, STREAM_REPLY, iov, iovcnt);
+}
 
-            printf("NAL: %s send to %d\n", nal_type_to_str(nal.unit_type), i);
-
-            static char len_buf[50];
-            ssize_t len_size = sprintf(len_buf, "%zX\r\n", (ssize_t)pack_len);
-            if (send_to_client(i, len_buf, len_size) < 0)
-                continue; // send <SIZE>\r\n
-            if (send_to_client(i, pack_data, pack_len) < 0)
-                continue; // send <DATA>
-            if (send_to_client(i, "\r\n", 2) < 0)
-                continue; // send \r\n
-
-            client_fds[i].nalCnt++;
-            if (client_fds[i].nalCnt == 300) {
-                char end[] = "0\r\n\r\n";
-                if (send_to_client(i, end, sizeof(end)) < 0)
-                    continue;
-                free_client(i);
-            }
-        }
-        pthread_mutex_unlock(&client_fds_mutex);
+static void queue_reply(int client_fd, const char *buf, int len) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+    queue_client(client_fd, STREAM_REPLY, &iov, 1);
+}
+
+// Responses too long to be queued are written by a thread of their own in
+// blocking mode, a stalled client is given up on after a while
+static void set_blocking(int client_fd) {
+    struct timeval timeout = { .tv_sec = CONN_TIMEOUT };
+    fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Queues a frame as a single chunk of Annex-B units, the client lock has to
+// be held. Only the encoder thread calls it, which lets the vectors grow
+// with the largest frame seen.
+static bool queue_h264(struct Client *client, struct Frame *frame) {
+    static struct iovec *iov = NULL;
+    static int iovmax = 0;
+    struct Chunk chunk;
+    if (iovmax < 2 * (int)frame->nal_count + 2) {
+        struct iovec *grown =
+            realloc(iov, (2 * frame->nal_count + 2) * sizeof(struct iovec));
+        if (!grown)
+            return false;
+        iov = grown;
+        iovmax = 2 * frame->nal_count + 2;
+    }
+    chunk_init(&chunk, iov, iovmax);
+
+    // A raw stream can only be picked up again from the parameter sets
+    enum PacketKind kind = PACKET_NONREF;
+    for (unsigned int i = 0; i < frame->nal_count; ++i) {
+        struct FrameNal *nal = &frame->nals[i];
+        unsigned char *nal_data = frame->data + nal->offset;
+
+        if (!chunk_add(&chunk, "\x00\x00\x00\x01", 4) ||
+            !chunk_add(&chunk, nal_data, nal->size))
+            break;
+        if (frame_nal_is_param(frame->codec, nal->type))
+            kind = PACKET_KEY;
+        else if (frame_nal_is_ref(frame, nal) && kind == PACKET_NONREF)
+            kind = PACKET_REF;
     }
+    if (!chunk.size)
+        return false;
+    chunk_end(&chunk);
+
+    if (!packet_queue_push(&client->queue, chunk.iov, chunk.iovcnt, &frame,
+        1, kind))
+        return false;
+    client->nalCnt += frame->nal_count;
+    return true;
 }
 
-void send_mp4_to_client(unsigned char index, const void *p) {
-    const hal_vidstream *stream = (const hal_vidstream *)p;
+void send_h264_to_client(unsigned char index, struct Frame *frame) {
+    struct Frame *const *cached;
+    unsigned int cached_count = gop_cache_get(&cached);
 
-    for (unsigned int i = 0; i < stream->count; ++i) {
-        hal_vidpack *pack = &stream->pack[i];
-        unsigned int pack_len = pack->length - pack->offset;
-        unsigned char *pack_data = pack->data + pack->offset;
+    bool queued = false, idr = false;
+    for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
+        struct Client *client = &client_fds[i];
+        pthread_mutex_lock(&client->lock);
+        if (client->socket_fd < 0 || client->closing ||
+            client->type != STREAM_H264) {
+            pthread_mutex_unlock(&client->lock);
+            continue;
+        }
 
-        ssize_t nal_start = 3;
-        if (!nal_chk3(pack_data, 0)) {
-            ++nal_start;
-            if (!nal_chk4(pack_data, 0))
-                continue;
+        // Everything since the last keyframe, the frame itself is the last
+        // one cached and follows as usual, or a keyframe asked for when
+        // there is no such thing
+        if (!client->started) {
+            client->started = true;
+            if (!cached_count || !cached[0]->keyframe)
+                idr = true;
+            for (unsigned int j = 0; j + 1 < cached_count; j++)
+                queued |= queue_h264(client, cached[j]);
         }
 
-        struct NAL nal;
-        unsigned char *nal_end = pack_data + pack_len;
-        while (nal_end - pack_data > nal_start) {
-            unsigned char *bound = memstr(
-                pack_data += nal_start,
-                nal_start == 3 ? "\x00\x00\x01" : "\x00\x00\x00\x01",
-                nal_end - pack_data - nal_start, nal_start
-            );
-            size_t size = (bound ? bound : nal_end) - pack_data;
-            nal_parse_header(&nal, pack_data[0]);
-
-            if (nal.unit_type == NalUnitType_SPS && size >= 4 && size <= UINT16_MAX)
-                set_sps(pack_data, size);
-            else if (nal.unit_type == NalUnitType_PPS && size <= UINT16_MAX)
-                set_pps(pack_data, size);
-            else if (nal.unit_type == NalUnitType_CodedSliceIdr)
-                set_slice(pack_data, size, nal.unit_type);
-            else if (nal.unit_type == NalUnitType_CodedSliceNonIdr)
-                set_slice(pack_data, pack_len, nal.unit_type);
-
-            pack_data += size;
+        if (queue_h264(client, frame)) {
+            queued = true;
+            if (client->nalCnt >= 300) {
+                struct iovec end = { .iov_base = "0\r\n\r\n", .iov_len = 5 };
+                packet_queue_push(&client->queue, &end, 1, NULL, 0,
+                    PACKET_CTRL);
+                client->closing = true;
+            }
         }
+        pthread_mutex_unlock(&client->lock);
+    }
 
-        static enum BufError err;
-        static char len_buf[50];
-        pthread_mutex_lock(&client_fds_mutex);
-        for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
-            if (client_fds[i].socket_fd < 0)
-                continue;
-            if (client_fds[i].type != STREAM_MP4)
-                continue;
+    // The encoder takes the video lock, so it's asked once no client lock
+    // is held any more
+    if (idr)
+        request_idr();
+    if (queued)
+        notify_server();
+}
 
-            if (!client_fds[i].mp4.header_sent) {
-                struct BitBuf header_buf;
-                err = get_header(&header_buf);
-                chk_err_continue ssize_t len_size =
-                    sprintf(len_buf, "%zX\r\n", header_buf.offset);
-                if (send_to_client(i, len_buf, len_size) < 0)
-                    continue; // send <SIZE>\r\n
-                if (send_to_client(i, header_buf.buf, header_buf.offset) < 0)
-                    continue; // send <DATA>
-                if (send_to_client(i, "\r\n", 2) < 0)
-                    continue; // send \r\n
-
-                client_fds[i].mp4.sequence_number = 1;
-                client_fds[i].mp4.base_data_offset = header_buf.offset;
-                client_fds[i].mp4.base_media_decode_time = 0;
-                client_fds[i].mp4.header_sent = true;
-                client_fds[i].mp4.nals_count = 0;
-                client_fds[i].mp4.default_sample_duration =
-                    default_sample_size;
-            }
+// Starts a client on the fragments of the GOP cache preceding the last
+// closed one, the header goes out with the first of them. The client lock
+// has to be held.
+static bool queue_mp4_catchup(struct Client *client, struct BitBuf *header) {
+    static struct iovec iov[MP4_MAX_IOV + 5];
+    struct BitBuf moof_buf, mdat_buf;
+    struct Mp4Samples samples;
+    struct Mp4State state;
+    unsigned int start = 0;
+
+    state.sequence_number = 1;
+    state.base_data_offset = header->offset;
+    state.base_media_decode_time = 0;
+    state.nals_count = 0;
+    state.default_sample_duration = default_sample_size;
+    state.header_sent = false;
+
+    for (;;) {
+        struct Chunk chunk;
+        chunk_init(&chunk, iov, MP4_MAX_IOV + 5);
+        if (get_catchup(&start, &state, &moof_buf, &mdat_buf, &samples) !=
+            BUF_OK || !samples.frame_count)
+            break;
+        if (!state.header_sent)
+            chunk_add(&chunk, header->buf, header->offset);
+        chunk_add(&chunk, moof_buf.buf, moof_buf.offset);
+        chunk_add(&chunk, mdat_buf.buf, mdat_buf.offset);
+        for (unsigned int j = 0; j < samples.iovcnt; j++)
+            chunk_add(&chunk, samples.iov[j].iov_base, samples.iov[j].iov_len);
+        chunk_end(&chunk);
+        if (!packet_queue_push(&client->queue, chunk.iov, chunk.iovcnt,
+            samples.frames, samples.frame_count,
+            state.header_sent ? PACKET_REF : PACKET_KEY))
+            break;
+        state.header_sent = true;
+        client->mp4 = state;
+    }
+
+    return client->mp4.header_sent;
+}
+
+void send_mp4_to_client(unsigned char index) {
+    enum BufError err;
+    struct BitBuf header_buf, moof_buf, mdat_buf;
+    struct Mp4Samples samples;
+    get_header(&header_buf);
+    if (!header_buf.offset)
+        return;
+    get_moof(&moof_buf);
+    get_mdat(&mdat_buf);
+    get_samples(&samples);
+
+    // Fragments are cut on keyframes and dropping one from the middle of
+    // the queue would leave a hole in the timeline, so none of them are
+    // treated as non-reference
+    enum PacketKind kind = samples.keyframe ? PACKET_KEY : PACKET_REF;
+
+    // Only ever called from the encoder thread, too big for its stack
+    static struct iovec iov[MP4_MAX_IOV + 5];
+    bool queued = false, idr = false;
+    for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
+        struct Client *client = &client_fds[i];
+        pthread_mutex_lock(&client->lock);
+        if (client->socket_fd < 0 || client->closing ||
+            client->type != STREAM_MP4) {
+            pthread_mutex_unlock(&client->lock);
+            continue;
+        }
 
-            err = set_mp4_state(&client_fds[i].mp4);
-            chk_err_continue {
-                struct BitBuf moof_buf;
-                err = get_moof(&moof_buf);
-                chk_err_continue ssize_t len_size =
-                    sprintf(len_buf, "%zX\r\n", (ssize_t)moof_buf.offset);
-                if (send_to_client(i, len_buf, len_size) < 0)
-                    continue; // send <SIZE>\r\n
-                if (send_to_client(i, moof_buf.buf, moof_buf.offset) < 0)
-                    continue; // send <DATA>
-                if (send_to_client(i, "\r\n", 2) < 0)
-                    continue; // send \r\n
+        // A new client gets the header along with its first fragment, or
+        // the fragments rebuilt from the GOP cache when it joins after the
+        // keyframe
+        struct Chunk chunk;
+        struct Mp4State state = client->mp4;
+        chunk_init(&chunk, iov, MP4_MAX_IOV + 5);
+        if (!state.header_sent) {
+            if (kind != PACKET_KEY && !queue_mp4_catchup(client, &header_buf)) {
+                idr = true;
+                pthread_mutex_unlock(&client->lock);
+                continue;
             }
-            {
-                struct BitBuf mdat_buf;
-                err = get_mdat(&mdat_buf);
-                chk_err_continue ssize_t len_size =
-                    sprintf(len_buf, "%zX\r\n", (ssize_t)mdat_buf.offset);
-                if (send_to_client(i, len_buf, len_size) < 0)
-                    continue; // send <SIZE>\r\n
-                if (send_to_client(i, mdat_buf.buf, mdat_buf.offset) < 0)
-                    continue; // send <DATA>
-                if (send_to_client(i, "\r\n", 2) < 0)
-                    continue; // send \r\n
+            state = client->mp4;
+        }
+        if (!state.header_sent) {
+            chunk_add(&chunk, header_buf.buf, header_buf.offset);
+            state.sequence_number = 1;
+            state.base_data_offset = header_buf.offset;
+            state.base_media_decode_time = 0;
+            state.start_time = samples.time;
+            state.header_sent = true;
+            state.nals_count = 0;
+            state.default_sample_duration = default_sample_size;
+        }
+
+        // The state only moves forward once the fragment is queued
+        err = set_mp4_state(&state);
+        if (err == BUF_OK) {
+            chunk_add(&chunk, moof_buf.buf, moof_buf.offset);
+            chunk_add(&chunk, mdat_buf.buf, mdat_buf.offset);
+            for (unsigned int j = 0; j < samples.iovcnt; j++)
+                chunk_add(&chunk, samples.iov[j].iov_base,
+                    samples.iov[j].iov_len);
+            chunk_end(&chunk);
+            if (packet_queue_push(&client->queue, chunk.iov, chunk.iovcnt,
+                samples.frames, samples.frame_count, kind)) {
+                client->mp4 = state;
+                queued = true;
             }
         }
-        pthread_mutex_unlock(&client_fds_mutex);
+        pthread_mutex_unlock(&client->lock);
     }
+
+    // Same as for raw streams, outside of the client locks
+    if (idr)
+        request_idr();
+    if (queued)
+        notify_server();
 }
 
-void send_mjpeg(unsigned char index, char *buf, ssize_t size) {
-    static char prefix_buf[128];
+void send_mjpeg(unsigned char index, struct Frame *frame) {
+    char prefix_buf[128];
     ssize_t prefix_size = sprintf(
         prefix_buf,
         "--boundarydonotcross\r\nContent-Type:image/jpeg\r\nContent-Length: "
-        "%lu\r\n\r\n",
-        size);
-    buf[size++] = '\r';
-    buf[size++] = '\n';
-
-    pthread_mutex_lock(&client_fds_mutex);
+        "%u\r\n\r\n",
+        frame->size);
+
+    // Every frame is a key packet, a lagging client just skips to the newest
+    struct iovec iov[3] = {
+        { .iov_base = prefix_buf, .iov_len = prefix_size },
+        { .iov_base = frame->data, .iov_len = frame->size },
+        { .iov_base = "\r\n", .iov_len = 2 }
+    };
+    bool queued = false;
     for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
-        if (client_fds[i].socket_fd < 0)
-            continue;
-        if (client_fds[i].type != STREAM_MJPEG)
-            continue;
-        if (send_to_client(i, prefix_buf, prefix_size) < 0)
-            continue; // send <SIZE>\r\n
-        if (send_to_client(i, buf, size) < 0)
-            continue; // send <DATA>\r\n
+        struct Client *client = &client_fds[i];
+        pthread_mutex_lock(&client->lock);
+        if (client->socket_fd >= 0 && client->type == STREAM_MJPEG)
+            queued |= packet_queue_push(&client->queue, iov, 3, &frame, 1,
+                PACKET_KEY);
+        pthread_mutex_unlock(&client->lock);
     }
-    pthread_mutex_unlock(&client_fds_mutex);
+
+    if (queued)
+        notify_server();
 }
 
-void send_jpeg(unsigned char index, char *buf, ssize_t size) {
-    static char prefix_buf[128];
+void send_jpeg(unsigned char index, struct Frame *frame) {
+    char prefix_buf[128];
     ssize_t prefix_size = sprintf(
         prefix_buf,
         "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: "
-        "%lu\r\nConnection: close\r\n\r\n",
-        size);
-    buf[size++] = '\r';
-    buf[size++] = '\n';
-
-    pthread_mutex_lock(&client_fds_mutex);
+        "%u\r\nConnection: close\r\n\r\n",
+        frame->size);
+
+    struct iovec iov[3] = {
+        { .iov_base = prefix_buf, .iov_len = prefix_size },
+        { .iov_base = frame->data, .iov_len = frame->size },
+        { .iov_base = "\r\n", .iov_len = 2 }
+    };
+    bool queued = false;
     for (unsigned int i = 0; i < MAX_CLIENTS; ++i) {
-        if (client_fds[i].socket_fd < 0)
-            continue;
-        if (client_fds[i].type != STREAM_JPEG)
-            continue;
-        if (send_to_client(i, prefix_buf, prefix_size) < 0)
-            continue; // send <SIZE>\r\n
-        if (send_to_client(i, buf, size) < 0)
-            continue; // send <DATA>\r\n
-        free_client(i);
+        struct Client *client = &client_fds[i];
+        pthread_mutex_lock(&client->lock);
+        if (client->socket_fd >= 0 && !client->closing &&
+            client->type == STREAM_JPEG) {
+            queued |= packet_queue_push(&client->queue, iov, 3, &frame, 1,
+                PACKET_KEY);
+            client->closing = true;
+        }
+        pthread_mutex_unlock(&client->lock);
     }
-    pthread_mutex_unlock(&client_fds_mutex);
+
+    if (queued)
+        notify_server();
 }
 
 struct jpegtask {
@@ -264,6 +467,7 @@ struct jpegtask {
 };
 void *send_jpeg_thread(void *vargp) {
     struct jpegtask task = *((struct jpegtask *)vargp);
+    free(vargp);
     hal_jpegdata jpeg = {0};
     printf(
         "Requesting a JPEG snapshot (%ux%u, qfactor %u, color2Gray %d)...\n",
@@ -297,43 +501,271 @@ void *send_jpeg_thread(void *vargp) {
     return NULL;
 }
 
-int send_file(const int client_fd, const char *path) {
-    if (access(path, F_OK) != -1) { // file exists
-        const char *mime = (path);
-        FILE *file = fopen(path, "r");
-        if (file == NULL) {
-            close_socket_fd(client_fd);
-            return 0;
+// Clips are cut out of the pre-event buffer, from and to are in seconds
+// relative to its newest frame and the end may lie ahead, by this much at
+// most
+#define CLIP_MAX_AHEAD 5
+struct cliptask {
+    int client_fd;
+    double from, to;
+};
+
+// A fragment along with the vectors sending it, too big for a thread stack
+struct ClipWork {
+    struct Mp4Fragment fragment;
+    struct iovec iov[MP4_MAX_IOV + 2];
+};
+
+static int send_iov_to_fd(int client_fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt) {
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+        ssize_t len = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        while (iovcnt && (size_t)len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
         }
-        char header[1024];
-        int header_len = sprintf(
-            header,
-            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nTransfer-Encoding: "
-            "chunked\r\nConnection: keep-alive\r\n\r\n",
-            mime);
-        send_to_fd(client_fd, header, header_len); // zero ending string!
-        const int buf_size = 1024;
-        char buf[buf_size + 2];
-        char len_buf[50];
-        ssize_t len_size;
-        while (1) {
-            ssize_t size = fread(buf, sizeof(char), buf_size, file);
-            if (size <= 0) {
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return 0;
+}
+
+// Goes through the fragments of the clip, sending them when asked to, and
+// returns the size of the whole file
+static uint64_t send_clip_fragments(int client_fd, struct ClipWork *work,
+    struct Frame *const *frames, unsigned int *count, bool send) {
+    struct Mp4State state;
+    unsigned int taken;
+    memset(&state, 0, sizeof(state));
+
+    for (unsigned int pos = 0; pos < *count; pos += taken) {
+        struct Mp4Fragment *fragment = &work->fragment;
+        if (get_fragment(fragment, &state, frames + pos, *count - pos,
+            &taken) != BUF_OK || !taken) {
+            *count = pos;
+            break;
+        }
+        if (!send)
+            continue;
+
+        int iovcnt = 0;
+        work->iov[iovcnt].iov_base = fragment->moof.buf;
+        work->iov[iovcnt++].iov_len = fragment->moof.offset;
+        work->iov[iovcnt].iov_base = fragment->mdat.buf;
+        work->iov[iovcnt++].iov_len = fragment->mdat.offset;
+        for (unsigned int i = 0; i < fragment->samples.iovcnt; i++)
+            work->iov[iovcnt++] = fragment->samples.iov[i];
+        if (send_iov_to_fd(client_fd, work->iov, iovcnt))
+            break;
+    }
+    return state.base_data_offset;
+}
+
+void *send_clip_thread(void *vargp) {
+    struct cliptask task = *((struct cliptask *)vargp);
+    free(vargp);
+
+    // An end still ahead is waited for, a little longer than it takes to
+    // come before settling for what there is
+    uint64_t first, last;
+    bool ready = preroll_range(&first, &last);
+    int64_t from = (int64_t)last + (int64_t)(task.from * 1000000);
+    int64_t to = (int64_t)last + (int64_t)(task.to * 1000000);
+    for (unsigned int i = 0; ready && (int64_t)last < to &&
+        i < (task.to + 2) * 10; i++) {
+        usleep(100000);
+        ready = preroll_range(&first, &last);
+    }
+
+    // Room for the span at twice the frame rate and the GOP before it
+    struct BitBuf header;
+    unsigned int max = (task.to - task.from + 4) * MAX(app_config.mp4_fps, 1) * 2;
+    struct Frame **frames = malloc(max * sizeof(struct Frame *));
+    struct ClipWork *work = calloc(1, sizeof(struct ClipWork));
+    unsigned int count = 0;
+    get_header(&header);
+    if (ready && frames && work && header.offset)
+        count = preroll_cut(MAX(from, 0), MAX(to, 0), frames, max);
+
+    uint64_t size = 0;
+    if (count)
+        size = send_clip_fragments(task.client_fd, work, frames, &count, false);
+    if (!count) {
+        static char response2[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        send_to_fd(task.client_fd, response2, sizeof(response2) - 1);
+    } else {
+        char buf[256];
+        int buf_len = sprintf(buf,
+            "HTTP/1.1 200 OK\r\nContent-Type: video/mp4\r\n"
+            "Content-Length: %llu\r\n"
+            "Content-Disposition: attachment; filename=\"clip.mp4\"\r\n"
+            "Connection: close\r\n\r\n", (unsigned long long)size);
+        if (!send_to_fd(task.client_fd, buf, buf_len) &&
+            !send_to_fd(task.client_fd, header.buf, header.offset))
+            send_clip_fragments(task.client_fd, work, frames, &count, true);
+        printf("Clip of %u frames has been sent!\n", count);
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+        frame_unref(frames[i]);
+    if (work)
+        free_fragment(&work->fragment);
+    free(work);
+    free(frames);
+    close_socket_fd(task.client_fd);
+    return NULL;
+}
+
+char *request_header(const char *name);
+
+static const char *file_mime(const char *path) {
+    static const char *types[][2] = {
+        {".mp4", "video/mp4"}, {".html", "text/html"},
+        {".js", "application/javascript"}, {".css", "text/css"},
+        {".json", "application/json"}, {".jpg", "image/jpeg"},
+        {".png", "image/png"}, {".svg", "image/svg+xml"}};
+    const char *ext = strrchr(path, '.');
+    for (unsigned int i = 0; ext && i < sizeof(types) / sizeof(*types); i++)
+        if (!strcasecmp(ext, types[i][0]))
+            return types[i][1];
+    return "application/octet-stream";
+}
+
+// Parses a single range of the Range header against the file size, false
+// when the header is there but none of the file can be served
+static bool parse_range(const char *range, off_t size, off_t *start,
+    off_t *end) {
+    *start = 0;
+    *end = size - 1;
+    if (!range || !starts_with(range, "bytes="))
+        return true;
+    range += 6;
+
+    char *remain;
+    if (*range == '-') {
+        long long suffix = strtoll(range + 1, &remain, 10);
+        if (remain == range + 1 || suffix <= 0)
+            return false;
+        *start = suffix < size ? size - suffix : 0;
+        return size > 0;
+    }
+    long long first = strtoll(range, &remain, 10);
+    if (remain == range || *remain != '-' || first >= size)
+        return false;
+    *start = first;
+    range = remain + 1;
+    if (*range >= '0' && *range <= '9') {
+        long long last = strtoll(range, &remain, 10);
+        if (last < first)
+            return false;
+        if (last < size)
+            *end = last;
+    }
+    return true;
+}
+
+// Static files go out on a thread of their own, a recording being hours of
+// video, and straight from the page cache to the socket
+struct filetask {
+    int client_fd;
+    int file_fd;
+    off_t start, end, size;
+    bool partial;
+    const char *mime;
+};
+
+void *send_file_thread(void *vargp) {
+    struct filetask task = *((struct filetask *)vargp);
+    free(vargp);
+
+    char header[512];
+    int header_len;
+    if (task.partial)
+        header_len = sprintf(header,
+            "HTTP/1.1 206 Partial Content\r\nContent-Type: %s\r\n"
+            "Accept-Ranges: bytes\r\nContent-Range: bytes %lld-%lld/%lld\r\n"
+            "Content-Length: %lld\r\nConnection: close\r\n\r\n",
+            task.mime, (long long)task.start, (long long)task.end,
+            (long long)task.size, (long long)(task.end - task.start + 1));
+    else
+        header_len = sprintf(header,
+            "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n"
+            "Accept-Ranges: bytes\r\nContent-Length: %lld\r\n"
+            "Connection: close\r\n\r\n",
+            task.mime, (long long)task.size);
+
+    if (!send_to_fd(task.client_fd, header, header_len)) {
+        off_t offset = task.start;
+        while (offset <= task.end) {
+            ssize_t len = sendfile(task.client_fd, task.file_fd, &offset,
+                MIN(task.end - offset + 1, 1024 * 1024));
+            if (len < 0 && errno == EINTR)
+                continue;
+            if (len <= 0)
                 break;
-            }
-            len_size = sprintf(len_buf, "%zX\r\n", size);
-            buf[size++] = '\r';
-            buf[size++] = '\n';
-            send_to_fd(client_fd, len_buf, len_size); // send <SIZE>\r\n
-            send_to_fd(client_fd, buf, size);         // send <DATA>\r\n
         }
-        char end[] = "0\r\n\r\n";
-        send_to_fd(client_fd, end, sizeof(end));
-        fclose(file);
+    }
+    close(task.file_fd);
+    close_socket_fd(task.client_fd);
+    return NULL;
+}
+
+int send_file(const int client_fd, const char *path) {
+    struct stat st;
+    int file_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0)
+        return 0;
+    if (fstat(file_fd, &st) || !S_ISREG(st.st_mode)) {
+        close(file_fd);
+        return 0;
+    }
+
+    struct filetask *task = malloc(sizeof(struct filetask));
+    if (!task) {
+        close(file_fd);
         close_socket_fd(client_fd);
         return 1;
     }
-    return 0;
+    task->client_fd = client_fd;
+    task->file_fd = file_fd;
+    task->size = st.st_size;
+    task->mime = file_mime(path);
+    char *range = request_header("Range");
+    task->partial = range != NULL;
+    if (!parse_range(range, st.st_size, &task->start, &task->end)) {
+        char response2[128];
+        int respLen = sprintf(response2,
+            "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n",
+            (long long)st.st_size);
+        queue_reply(client_fd, response2, respLen);
+        free(task);
+        close(file_fd);
+        return 1;
+    }
+
+    set_blocking(client_fd);
+
+    pthread_t thread_id;
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&thread_attr, 16 * 1024);
+    if (pthread_create(&thread_id, &thread_attr, send_file_thread, task)) {
+        free(task);
+        close(file_fd);
+        close_socket_fd(client_fd);
+    }
+    pthread_attr_destroy(&thread_attr);
+    return 1;
 }
 
 int send_mjpeg_html(const int client_fd) {
@@ -354,8 +786,7 @@ int send_mjpeg_html(const int client_fd) {
         "%lu\r\nConnection: close\r\n\r\n%s",
         strlen(html), html);
     buf[buf_len++] = 0;
-    send_to_fd(client_fd, buf, buf_len);
-    close_socket_fd(client_fd);
+    queue_reply(client_fd, buf, buf_len);
     return 1;
 }
 
@@ -378,8 +809,7 @@ int send_video_html(const int client_fd) {
         "%lu\r\nConnection: close\r\n\r\n%s",
         strlen(html), html);
     buf[buf_len++] = 0;
-    send_to_fd(client_fd, buf, buf_len);
-    close_socket_fd(client_fd);
+    queue_reply(client_fd, buf, buf_len);
     return 1;
 }
 
@@ -401,8 +831,7 @@ int send_image_html(const int client_fd) {
         "%lu\r\nConnection: close\r\n\r\n%s",
         strlen(html), html);
     buf[buf_len++] = 0;
-    send_to_fd(client_fd, buf, buf_len);
-    close_socket_fd(client_fd);
+    queue_reply(client_fd, buf, buf_len);
     return 1;
 }
 
@@ -470,6 +899,8 @@ void parse_request(char *request) {
         if (e[1] == '\r' && e[2] == '\n')
             break;
     }
+    // Headers left over from the previous request must not be found
+    h->name = NULL;
 }
 
 char *request_header(const char *name)
@@ -483,6 +914,399 @@ char *request_header(const char *name)
 
 header_t *request_headers(void) { return reqhdr; }
 
+void handle_request(int client_fd) {
+    parse_request(request);
+
+    if (equals(uri, "/exit")) {
+        // exit
+        char response2[] = "HTTP/1.1 200 OK\r\nContent-Length: "
+                          "11\r\nConnection: close\r\n\r\nClosing...";
+        queue_reply(client_fd, response2,
+            sizeof(response2) - 1); // zero ending string!
+        keepRunning = 0;
+        return;
+    }
+
+    // send JPEG html page
+    if (equals(uri, "/image.html") &&
+        app_config.jpeg_enable) {
+        send_image_html(client_fd);
+        return;
+    }
+    // send MJPEG html page
+    if (equals(uri, "/mjpeg.html") &&
+        app_config.mjpeg_enable) {
+        send_mjpeg_html(client_fd);
+        return;
+    }
+    // send MP4 html page
+    if (equals(uri, "/video.html") &&
+        app_config.mp4_enable) {
+        send_video_html(client_fd);
+        return;
+    }
+
+    // if h264 stream is requested add client_fd socket to client_fds array
+    // and send h264 stream with http_thread, named after the actual codec
+    if (equals(uri, app_config.mp4_codec_h265 ? "/video.265" : "/video.264")) {
+        int respLen = sprintf(
+            response, "HTTP/1.1 200 OK\r\nContent-Type: "
+                    "application/octet-stream\r\nTransfer-Encoding: "
+                    "chunked\r\nConnection: keep-alive\r\n\r\n");
+        add_client(client_fd, STREAM_H264, response, respLen);
+        return;
+    }
+
+    if (equals(uri, "/video.mp4") && app_config.mp4_enable) {
+        int respLen = sprintf(
+            response, "HTTP/1.1 200 OK\r\nContent-Type: "
+                    "video/mp4\r\nTransfer-Encoding: "
+                    "chunked\r\nConnection: keep-alive\r\n\r\n");
+        add_client(client_fd, STREAM_MP4, response, respLen);
+        return;
+    }
+
+    // If the MJPEG stream is requested add client_fd socket to client_fds array
+    // and send it with the HTTP thread
+    if (app_config.mjpeg_enable && equals(uri, "/mjpeg")) {
+        int respLen = sprintf(
+            response, "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nPragma: "
+                    "no-cache\r\nConnection: close\r\nContent-Type: "
+                    "multipart/x-mixed-replace; "
+                    "boundary=boundarydonotcross\r\n\r\n");
+        add_client(client_fd, STREAM_MJPEG, response, respLen);
+        return;
+    }
+
+    if (app_config.jpeg_enable && starts_with(uri, "/image.jpg")) {
+        {
+            struct jpegtask *task = malloc(sizeof(struct jpegtask));
+            if (!task) {
+                close_socket_fd(client_fd);
+                return;
+            }
+            task->client_fd = client_fd;
+            task->width = app_config.jpeg_width;
+            task->height = app_config.jpeg_height;
+            task->qfactor = app_config.jpeg_qfactor;
+            task->color2Gray = 3;
+
+            if (!empty(query)) {
+                char *remain;
+                while (query) {
+                    char *value = split(&query, "&");
+                    if (!value || !*value) continue;
+                    char *key = split(&value, "=");
+                    if (!key || !*key || !value || !*value) continue;
+                    if (equals(key, "width")) {
+                        short result = strtol(value, &remain, 10);
+                        if (remain != value)
+                            task->width = result;
+                    }
+                    else if (equals(key, "height")) {
+                        short result = strtol(value, &remain, 10);
+                        if (remain != value)
+                            task->height = result;
+                    }
+                    else if (equals(key, "qfactor")) {
+                        short result = strtol(value, &remain, 10);
+                        if (remain != value)
+                            task->qfactor = result;
+                    }
+                    else if (equals(key, "color2gray")) {
+                        short result = strtol(value, &remain, 10);
+                        if (remain != value)
+                            task->color2Gray = result;
+                    }
+                }
+            }
+
+            set_blocking(client_fd);
+            pthread_t thread_id;
+            pthread_attr_t thread_attr;
+            pthread_attr_init(&thread_attr);
+            size_t stacksize;
+            pthread_attr_getstacksize(&thread_attr, &stacksize);
+            size_t new_stacksize = 16 * 1024;
+            if (pthread_attr_setstacksize(&thread_attr, new_stacksize)) {
+                printf("Error:  Can't set stack size %ld\n", new_stacksize);
+            }
+            pthread_attr_setdetachstate(
+                &thread_attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(
+                &thread_id, &thread_attr, send_jpeg_thread, task)) {
+                free(task);
+                close_socket_fd(client_fd);
+            }
+            if (pthread_attr_setstacksize(&thread_attr, stacksize)) {
+                printf("Error:  Can't set stack size %ld\n", stacksize);
+            }
+            pthread_attr_destroy(&thread_attr);
+        }
+        return;
+    }
+
+    if (app_config.mp4_enable && equals(uri, "/api/idr")) {
+        bool ok = !request_idr();
+        int respLen = sprintf(response,
+            "HTTP/1.1 %s\r\n" \
+            "Content-Type: application/json;charset=UTF-8\r\n" \
+            "Connection: close\r\n" \
+            "\r\n" \
+            "{\"idr\":%s}",
+            ok ? "200 OK" : "503 Service Unavailable", ok ? "true" : "false");
+        queue_reply(client_fd, response, respLen);
+        return;
+    }
+
+    if (app_config.mp4_enable && app_config.mp4_preroll &&
+        equals(uri, "/api/clip")) {
+        struct cliptask *task = malloc(sizeof(struct cliptask));
+        if (!task) {
+            close_socket_fd(client_fd);
+            return;
+        }
+        task->client_fd = client_fd;
+        task->from = -10;
+        task->to = 0;
+        if (!empty(query)) {
+            char *remain;
+            while (query) {
+                char *value = split(&query, "&");
+                if (!value || !*value) continue;
+                unescape_uri(value);
+                char *key = split(&value, "=");
+                if (!key || !*key || !value || !*value) continue;
+                if (equals(key, "from")) {
+                    double result = strtod(value, &remain);
+                    if (remain != value)
+                        task->from = result;
+                }
+                else if (equals(key, "to")) {
+                    double result = strtod(value, &remain);
+                    if (remain != value)
+                        task->to = result;
+                }
+            }
+        }
+        // Both ends are brought within what the buffer holds and what is
+        // about to come, the start has to stay in it until the end comes in
+        if (!isfinite(task->from) || !isfinite(task->to))
+            task->from = task->to = 0;
+        task->from = MAX(MIN(task->from, 0), -(double)app_config.mp4_preroll);
+        task->to = MIN(task->to, task->from + app_config.mp4_preroll);
+        task->to = MIN(task->to, CLIP_MAX_AHEAD);
+        if (task->from >= task->to) {
+            free(task);
+            static char response2[] = "HTTP/1.1 400 Bad Request\r\n"
+                                      "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            queue_reply(client_fd, response2, sizeof(response2) - 1);
+            return;
+        }
+
+        // A stalled client gives up the frames it holds after a while
+        set_blocking(client_fd);
+
+        pthread_t thread_id;
+        pthread_attr_t thread_attr;
+        pthread_attr_init(&thread_attr);
+        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&thread_attr, 16 * 1024);
+        if (pthread_create(&thread_id, &thread_attr, send_clip_thread, task)) {
+            free(task);
+            close_socket_fd(client_fd);
+        }
+        pthread_attr_destroy(&thread_attr);
+        return;
+    }
+
+    if (app_config.osd_enable && starts_with(uri, "/api/osd/") &&
+        uri[9] && uri[9] >= '0' && uri[9] <= (MAX_OSD - 1 + '0'))
+    {
+        char id = uri[9] - '0';
+        if (!empty(query))
+        {
+            char *remain;
+            while (query) {
+                char *value = split(&query, "&");
+                if (!value || !*value) continue;
+                unescape_uri(value);
+                char *key = split(&value, "=");
+                if (!key || !*key || !value || !*value) continue;
+                if (equals(key, "font"))
+                    strcpy(osds[id].font, !empty(value) ? value : DEF_FONT);
+                else if (equals(key, "text"))
+                    strcpy(osds[id].text, value);
+                else if (equals(key, "size")) {
+                    double result = strtod(value, &remain);
+                    if (remain == value) continue;
+                    osds[id].size = (result != 0 ? result : DEF_SIZE);
+                }
+                else if (equals(key, "posx")) {
+                    short result = strtol(value, &remain, 10);
+                    if (remain != value)
+                        osds[id].posx = result;
+                }
+                else if (equals(key, "posy")) {
+                    short result = strtol(value, &remain, 10);
+                    if (remain != value)
+                        osds[id].posy = result;
+                }
+            }
+            osds[id].updt = 1;
+        }
+        int respLen = sprintf(response,
+            "HTTP/1.1 200 OK\r\n" \
+            "Content-Type: application/json;charset=UTF-8\r\n" \
+            "Connection: close\r\n" \
+            "\r\n" \
+            "{\"id\":%d,\"pos\":[%d,%d],\"font\":\"%s\",\"size\":%.1f,\"text\":\"%s\"}", 
+            id, osds[id].posx, osds[id].posy, osds[id].font, osds[id].size, osds[id].text);
+        queue_reply(client_fd, response, respLen);
+        return;
+    }
+
+    if (app_config.record_enable && equals(uri, "/api/records")) {
+        char *json = storage_json();
+        if (!json) {
+            close_socket_fd(client_fd);
+            return;
+        }
+        int jsonLen = strlen(json);
+        int respLen = sprintf(response,
+            "HTTP/1.1 200 OK\r\n" \
+            "Content-Type: application/json;charset=UTF-8\r\n" \
+            "Content-Length: %d\r\n" \
+            "Connection: close\r\n" \
+            "\r\n", jsonLen);
+        struct iovec iov[2] = {
+            { .iov_base = response, .iov_len = respLen },
+            { .iov_base = json, .iov_len = jsonLen } };
+        queue_reply_iov(client_fd, iov, 2);
+        free(json);
+        return;
+    }
+
+    // Recordings go by the names listed in the catalog, whatever else lies
+    // under the record path stays out of reach
+    if (app_config.record_enable && starts_with(uri, "/records/") &&
+        storage_contains(uri + 9)) {
+        char path[sizeof(app_config.record_path) + 32];
+        size_t len = strlen(app_config.record_path);
+        sprintf(path, "%s%s%s", app_config.record_path,
+            len && app_config.record_path[len - 1] != '/' ? "/" : "", uri + 9);
+        if (send_file(client_fd, path))
+            return;
+    }
+
+    if (app_config.web_enable_static && send_file(client_fd, uri))
+        return;
+
+    static char response2[] = "HTTP/1.1 404 Not Found\r\nContent-Length: "
+                             "11\r\nConnection: close\r\n\r\n";
+    queue_reply(
+        client_fd, response2, sizeof(response2) - 1); // zero ending string!
+}
+
+// Connections whose request line and headers have not been fully received
+// yet, these are handled by the event loop until they can be dispatched
+struct Connection {
+    int socket_fd;
+    time_t last_active;
+    char *buf;
+    unsigned int size;
+};
+struct Connection conns[MAX_CONNS];
+
+void free_conn(struct Connection *conn, bool close_fd) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->socket_fd, NULL);
+    if (close_fd)
+        close_socket_fd(conn->socket_fd);
+    conn->socket_fd = -1;
+    free(conn->buf);
+    conn->buf = NULL;
+    conn->size = 0;
+}
+
+void accept_conns(int server_fd) {
+    while (keepRunning) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                printf("Web server error: accept failed with %s\n", strerror(errno));
+            return;
+        }
+
+        struct Connection *conn = NULL;
+        for (unsigned int i = 0; i < MAX_CONNS; i++)
+            if (conns[i].socket_fd < 0) {
+                conn = &conns[i];
+                break;
+            }
+        if (!conn) {
+            static char response2[] = "HTTP/1.1 503 Service Unavailable\r\n"
+                                      "Content-Length: 0\r\nConnection: close\r\n\r\n";
+            send_to_fd_nonblock(client_fd, response2, sizeof(response2) - 1);
+            close_socket_fd(client_fd);
+            continue;
+        }
+        fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP,
+            .data.u32 = conn - conns };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            close_socket_fd(client_fd);
+            continue;
+        }
+        conn->socket_fd = client_fd;
+        conn->last_active = time(NULL);
+    }
+}
+
+void read_conn(struct Connection *conn) {
+    if (!conn->buf && !(conn->buf = malloc(MAX_REQSIZE))) {
+        free_conn(conn, true);
+        return;
+    }
+
+    while (conn->size < MAX_REQSIZE - 1) {
+        ssize_t len = recv(conn->socket_fd, conn->buf + conn->size,
+            MAX_REQSIZE - 1 - conn->size, 0);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (len <= 0) {
+            free_conn(conn, true);
+            return;
+        }
+
+        // Only the bytes just received (plus the tail of the previous chunk)
+        // need to be searched for the end of the headers
+        unsigned int from = conn->size > 3 ? conn->size - 3 : 0;
+        conn->size += len;
+        conn->buf[conn->size] = '\0';
+        conn->last_active = time(NULL);
+        if (!strstr(conn->buf + from, "\r\n\r\n"))
+            continue;
+
+        // The request is complete, the handlers queue their responses or
+        // hand the socket over to a thread of their own
+        int client_fd = conn->socket_fd;
+        memcpy(request, conn->buf, conn->size + 1);
+        free_conn(conn, false);
+        handle_request(client_fd);
+        return;
+    }
+
+    if (conn->size >= MAX_REQSIZE - 1) {
+        static char response2[] = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                                  "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        send_to_fd_nonblock(conn->socket_fd, response2, sizeof(response2) - 1);
+        free_conn(conn, true);
+    }
+}
+
 void *server_thread(void *vargp) {
     int server_fd = *((int *)vargp);
     int enable = 1;
@@ -503,219 +1327,88 @@ void *server_thread(void *vargp) {
         return NULL;
     }
     listen(server_fd, 128);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
 
-    while (keepRunning) {
-        // waiting for a new connection
-        int client_fd = accept(server_fd, NULL, NULL);
-        if (client_fd == -1)
-            break;
-
-        recv(client_fd, request, MAX_REQSIZE, 0);
-        parse_request(request);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        printf("Web server error: %s (%d)\n", strerror(errno), errno);
+        keepRunning = 0;
+        close_socket_fd(server_fd);
+        return NULL;
+    }
+    for (unsigned int i = 0; i < MAX_CONNS; i++)
+        conns[i].socket_fd = -1;
+    {
+        struct epoll_event ev = { .events = EPOLLIN, .data.u32 = EV_LISTEN };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+        ev.data.u32 = EV_NOTIFY;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, notify_fd, &ev);
+    }
 
-        if (equals(uri, "/exit")) {
-            // exit
-            char response2[] = "HTTP/1.1 200 OK\r\nContent-Length: "
-                              "11\r\nConnection: close\r\n\r\nClosing...";
-            send_to_fd(
-                client_fd, response2,
-                sizeof(response2) - 1); // zero ending string!
-            close_socket_fd(client_fd);
-            keepRunning = 0;
+    struct epoll_event events[32];
+    time_t last_sweep = time(NULL);
+    while (keepRunning) {
+        int count = epoll_wait(epoll_fd, events, 32, 1000);
+        if (count < 0 && errno != EINTR) {
+            printf("Web server error: %s (%d)\n", strerror(errno), errno);
             break;
         }
 
-        // send JPEG html page
-        if (equals(uri, "/image.html") &&
-            app_config.jpeg_enable) {
-            send_image_html(client_fd);
-            continue;
-        }
-        // send MJPEG html page
-        if (equals(uri, "/mjpeg.html") &&
-            app_config.mjpeg_enable) {
-            send_mjpeg_html(client_fd);
-            continue;
-        }
-        // send MP4 html page
-        if (equals(uri, "/video.html") &&
-            app_config.mp4_enable) {
-            send_video_html(client_fd);
-            continue;
-        }
-
-        // if h264 stream is requested add client_fd socket to client_fds array
-        // and send h264 stream with http_thread
-        if (equals(uri, "/video.264")) {
-            int respLen = sprintf(
-                response, "HTTP/1.1 200 OK\r\nContent-Type: "
-                        "application/octet-stream\r\nTransfer-Encoding: "
-                        "chunked\r\nConnection: keep-alive\r\n\r\n");
-            send_to_fd(client_fd, response, respLen);
-            pthread_mutex_lock(&client_fds_mutex);
-            for (uint32_t i = 0; i < MAX_CLIENTS; ++i)
-                if (client_fds[i].socket_fd < 0) {
-                    client_fds[i].socket_fd = client_fd;
-                    client_fds[i].type = STREAM_H264;
-                    client_fds[i].nalCnt = 0;
-                    break;
-                }
-            pthread_mutex_unlock(&client_fds_mutex);
-            continue;
-        }
-
-        if (equals(uri, "/video.mp4") && app_config.mp4_enable) {
-            int respLen = sprintf(
-                response, "HTTP/1.1 200 OK\r\nContent-Type: "
-                        "video/mp4\r\nTransfer-Encoding: "
-                        "chunked\r\nConnection: keep-alive\r\n\r\n");
-            send_to_fd(client_fd, response, respLen);
-            pthread_mutex_lock(&client_fds_mutex);
-            for (uint32_t i = 0; i < MAX_CLIENTS; ++i)
-                if (client_fds[i].socket_fd < 0) {
-                    client_fds[i].socket_fd = client_fd;
-                    client_fds[i].type = STREAM_MP4;
-                    client_fds[i].mp4.header_sent = false;
-                    break;
-                }
-            pthread_mutex_unlock(&client_fds_mutex);
-            continue;
-        }
-
-        // If the MJPEG stream is requested add client_fd socket to client_fds array
-        // and send it with the HTTP thread
-        if (app_config.mjpeg_enable && equals(uri, "/mjpeg")) {
-            int respLen = sprintf(
-                response, "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nPragma: "
-                        "no-cache\r\nConnection: close\r\nContent-Type: "
-                        "multipart/x-mixed-replace; "
-                        "boundary=boundarydonotcross\r\n\r\n");
-            send_to_fd(client_fd, response, respLen);
-            pthread_mutex_lock(&client_fds_mutex);
-            for (uint32_t i = 0; i < MAX_CLIENTS; ++i)
-                if (client_fds[i].socket_fd < 0) {
-                    client_fds[i].socket_fd = client_fd;
-                    client_fds[i].type = STREAM_MJPEG;
-                    break;
-                }
-            pthread_mutex_unlock(&client_fds_mutex);
-            continue;
-        }
-
-        if (app_config.jpeg_enable && starts_with(uri, "/image.jpg")) {
-            {
-                struct jpegtask task;
-                task.client_fd = client_fd;
-                task.width = app_config.jpeg_width;
-                task.height = app_config.jpeg_height;
-                task.qfactor = app_config.jpeg_qfactor;
-                task.color2Gray = 3;
-
-                if (!empty(query)) {
-                    char *remain;
-                    while (query) {
-                        char *value = split(&query, "&");
-                        if (!value || !*value) continue;
-                        char *key = split(&value, "=");
-                        if (!key || !*key || !value || !*value) continue;
-                        if (equals(key, "width")) {
-                            short result = strtol(value, &remain, 10);
-                            if (remain != value)
-                                task.width = result;
-                        }
-                        else if (equals(key, "height")) {
-                            short result = strtol(value, &remain, 10);
-                            if (remain != value)
-                                task.height = result;
-                        }
-                        else if (equals(key, "qfactor")) {
-                            short result = strtol(value, &remain, 10);
-                            if (remain != value)
-                                task.qfactor = result;
-                        }
-                        else if (equals(key, "color2gray")) {
-                            short result = strtol(value, &remain, 10);
-                            if (remain != value)
-                                task.color2Gray = result;
-                        }
-                    }
-                }
-
-                pthread_t thread_id;
-                pthread_attr_t thread_attr;
-                pthread_attr_init(&thread_attr);
-                size_t stacksize;
-                pthread_attr_getstacksize(&thread_attr, &stacksize);
-                size_t new_stacksize = 16 * 1024;
-                if (pthread_attr_setstacksize(&thread_attr, new_stacksize)) {
-                    printf("Error:  Can't set stack size %ld\n", new_stacksize);
-                }
-                pthread_create(
-                    &thread_id, &thread_attr, send_jpeg_thread, (void *)&task);
-                if (pthread_attr_setstacksize(&thread_attr, stacksize)) {
-                    printf("Error:  Can't set stack size %ld\n", stacksize);
-                }
-                pthread_attr_destroy(&thread_attr);
+        for (int i = 0; i < count && keepRunning; i++) {
+            unsigned int id = events[i].data.u32;
+            if (id == EV_LISTEN) {
+                accept_conns(server_fd);
+                continue;
             }
-            continue;
-        }
-
-        if (app_config.osd_enable && starts_with(uri, "/api/osd/") &&
-            uri[9] && uri[9] >= '0' && uri[9] <= (MAX_OSD - 1 + '0'))
-        {
-            char id = uri[9] - '0';
-            if (!empty(query))
-            {
-                char *remain;
-                while (query) {
-                    char *value = split(&query, "&");
-                    if (!value || !*value) continue;
-                    unescape_uri(value);
-                    char *key = split(&value, "=");
-                    if (!key || !*key || !value || !*value) continue;
-                    if (equals(key, "font"))
-                        strcpy(osds[id].font, !empty(value) ? value : DEF_FONT);
-                    else if (equals(key, "text"))
-                        strcpy(osds[id].text, value);
-                    else if (equals(key, "size")) {
-                        double result = strtod(value, &remain);
-                        if (remain == value) continue;
-                        osds[id].size = (result != 0 ? result : DEF_SIZE);
-                    }
-                    else if (equals(key, "posx")) {
-                        short result = strtol(value, &remain, 10);
-                        if (remain != value)
-                            osds[id].posx = result;
-                    }
-                    else if (equals(key, "posy")) {
-                        short result = strtol(value, &remain, 10);
-                        if (remain != value)
-                            osds[id].posy = result;
-                    }
+            if (id == EV_NOTIFY) {
+                uint64_t value;
+                read(notify_fd, &value, sizeof(value));
+                for (unsigned int j = 0; j < MAX_CLIENTS; j++)
+                    if (client_fds[j].socket_fd >= 0 && client_fds[j].writable)
+                        flush_client(j);
+                continue;
+            }
+            if (id >= EV_CLIENT) {
+                struct Client *client = &client_fds[id - EV_CLIENT];
+                if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+                    pthread_mutex_lock(&client->lock);
+                    free_client(id - EV_CLIENT);
+                    pthread_mutex_unlock(&client->lock);
+                } else if (events[i].events & EPOLLOUT) {
+                    client->writable = true;
+                    flush_client(id - EV_CLIENT);
                 }
-                osds[id].updt = 1;
+                continue;
             }
-            int respLen = sprintf(response,
-                "HTTP/1.1 200 OK\r\n" \
-                "Content-Type: application/json;charset=UTF-8\r\n" \
-                "Connection: close\r\n" \
-                "\r\n" \
-                "{\"id\":%d,\"pos\":[%d,%d],\"font\":\"%s\",\"size\":%.1f,\"text\":\"%s\"}", 
-                id, osds[id].posx, osds[id].posy, osds[id].font, osds[id].size, osds[id].text);
-            send_to_fd(client_fd, response, respLen);
-            close_socket_fd(client_fd);
-            continue;
+
+            struct Connection *conn = &conns[id];
+            if (conn->socket_fd < 0)
+                continue;
+            if (events[i].events & EPOLLIN)
+                read_conn(conn);
+            else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+                free_conn(conn, true);
         }
 
-        if (app_config.web_enable_static && send_file(client_fd, uri))
+        // Drop the peers which connected but never completed a request
+        time_t now = time(NULL);
+        if (now - last_sweep < 1)
             continue;
+        last_sweep = now;
+        for (unsigned int i = 0; i < MAX_CONNS; i++)
+            if (conns[i].socket_fd >= 0 &&
+                now - conns[i].last_active > CONN_TIMEOUT)
+                free_conn(&conns[i], true);
+    }
 
-        static char response2[] = "HTTP/1.1 404 Not Found\r\nContent-Length: "
-                                 "11\r\nConnection: close\r\n\r\n";
-        send_to_fd(
-            client_fd, response2, sizeof(response2) - 1); // zero ending string!
-        close_socket_fd(client_fd);
+    for (unsigned int i = 0; i < MAX_CONNS; i++)
+        if (conns[i].socket_fd >= 0)
+            free_conn(&conns[i], true);
+    for (unsigned int i = 0; i < MAX_CLIENTS; i++) {
+        pthread_mutex_lock(&client_fds[i].lock);
+        free_client(i);
+        pthread_mutex_unlock(&client_fds[i].lock);
     }
+    close(epoll_fd);
     close_socket_fd(server_fd);
     printf("Shutdown server thread\n");
     return NULL;
@@ -747,8 +1440,9 @@ int start_server() {
     for (uint32_t i = 0; i < MAX_CLIENTS; ++i) {
         client_fds[i].socket_fd = -1;
         client_fds[i].type = -1;
+        pthread_mutex_init(&client_fds[i].lock, NULL);
     }
-    pthread_mutex_init(&client_fds_mutex, NULL);
+    notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
     // Start the server and HTTP video streams thread
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -780,7 +1474,10 @@ int stop_server() {
     close_socket_fd(server_fd);
     pthread_join(server_thread_id, NULL);
 
-    pthread_mutex_destroy(&client_fds_mutex);
+    for (uint32_t i = 0; i < MAX_CLIENTS; ++i)
+        pthread_mutex_destroy(&client_fds[i].lock);
+    close(notify_fd);
+    notify_fd = -1;
     printf("Shutting down server...\n");
     return EXIT_SUCCESS;
 }
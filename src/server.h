@@ -2,6 +2,8 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <regex.h>
@@ -10,10 +12,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "frame.h"
 #include "jpeg.h"
 #include "mp4/mp4.h"
 #include "mp4/nal.h"
@@ -24,7 +33,8 @@ extern char keepRunning;
 int start_server();
 int stop_server();
 
-void send_jpeg(unsigned char chn_index, char *buf, ssize_t size);
-void send_mjpeg(unsigned char chn_index, char *buf, ssize_t size);
-void send_h264_to_client(unsigned char chn_index, const void *p);
-void send_mp4_to_client(unsigned char chn_index, const void *p);
\ No newline at end of file
+void send_jpeg(unsigned char chn_index, struct Frame *frame);
+void send_mjpeg(unsigned char chn_index, struct Frame *frame);
+void send_h264_to_client(unsigned char chn_index, struct Frame *frame);
+// Sends the fragment closed by the last call to set_frame
+void send_mp4_to_client(unsigned char chn_index);
\ No newline at end of file
@@ -0,0 +1,384 @@
+#include "storage.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#define tag "[storage]: "
+
+// Space is checked at least this often, and whenever a file starts or ends
+#define STORAGE_CHECK_S 10
+
+struct Recording {
+    unsigned int id;
+    char name[32];
+    time_t start, end;
+    uint64_t size;
+    unsigned int keyframes;
+    // Being written, or queued up to be, and kept from eviction
+    bool open;
+};
+
+pthread_t storagePid = 0;
+pthread_mutex_t storageLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t storageCond = PTHREAD_COND_INITIALIZER;
+
+// Ordered as recorded, which makes the ids ascending and the oldest file
+// the first one
+static struct Recording *catalog = NULL;
+static unsigned int catalogCount = 0, catalogCap = 0;
+static unsigned int nextId = 1;
+static uint64_t storageUsed = 0;
+static uint64_t storageQuota = 0, storageFree = 0;
+static bool storageStop = false;
+
+static int storage_join(char *path, size_t size, const char *name) {
+    size_t len = strlen(app_config.record_path);
+    bool slash = len && app_config.record_path[len - 1] != '/';
+    return snprintf(path, size, "%s%s%s",
+        app_config.record_path, slash ? "/" : "", name);
+}
+
+static struct Recording *storage_find(unsigned int id) {
+    unsigned int lo = 0, hi = catalogCount;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (catalog[mid].id < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < catalogCount && catalog[lo].id == id ? &catalog[lo] : NULL;
+}
+
+static struct Recording *storage_append() {
+    if (catalogCount == catalogCap) {
+        unsigned int cap = catalogCap ? catalogCap * 2 : 64;
+        struct Recording *grown =
+            realloc(catalog, cap * sizeof(struct Recording));
+        if (!grown)
+            return NULL;
+        catalog = grown;
+        catalogCap = cap;
+    }
+    struct Recording *rec = &catalog[catalogCount++];
+    memset(rec, 0, sizeof(*rec));
+    rec->id = nextId++;
+    return rec;
+}
+
+static void storage_drop(struct Recording *rec) {
+    storageUsed -= rec->size;
+    catalogCount--;
+    memmove(rec, rec + 1,
+        (catalogCount - (rec - catalog)) * sizeof(struct Recording));
+}
+
+unsigned int storage_add(time_t start) {
+    struct tm tm;
+    char name[16];
+
+    localtime_r(&start, &tm);
+    strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &tm);
+
+    pthread_mutex_lock(&storageLock);
+    // Files started within the same second get told apart by a suffix
+    unsigned int same = 0;
+    for (unsigned int i = catalogCount; i-- && catalog[i].start == start;)
+        same++;
+    struct Recording *rec = storage_append();
+    unsigned int id = 0;
+    if (rec) {
+        if (same)
+            snprintf(rec->name, sizeof(rec->name), "%s_%u.mp4", name, same);
+        else
+            snprintf(rec->name, sizeof(rec->name), "%s.mp4", name);
+        rec->start = rec->end = start;
+        rec->open = true;
+        id = rec->id;
+        pthread_cond_signal(&storageCond);
+    }
+    pthread_mutex_unlock(&storageLock);
+    return id;
+}
+
+void storage_remove(unsigned int id) {
+    pthread_mutex_lock(&storageLock);
+    struct Recording *rec = storage_find(id);
+    if (rec)
+        storage_drop(rec);
+    pthread_mutex_unlock(&storageLock);
+}
+
+bool storage_path(unsigned int id, char *path, size_t size) {
+    pthread_mutex_lock(&storageLock);
+    struct Recording *rec = storage_find(id);
+    if (rec)
+        storage_join(path, size, rec->name);
+    pthread_mutex_unlock(&storageLock);
+    return rec != NULL;
+}
+
+void storage_keyframe(unsigned int id) {
+    pthread_mutex_lock(&storageLock);
+    struct Recording *rec = storage_find(id);
+    if (rec) {
+        rec->keyframes++;
+        rec->end = time(NULL);
+    }
+    pthread_mutex_unlock(&storageLock);
+}
+
+void storage_written(unsigned int id, uint64_t size) {
+    pthread_mutex_lock(&storageLock);
+    struct Recording *rec = storage_find(id);
+    if (rec) {
+        storageUsed += size - rec->size;
+        rec->size = size;
+        rec->end = time(NULL);
+    }
+    pthread_mutex_unlock(&storageLock);
+}
+
+void storage_close(unsigned int id) {
+    pthread_mutex_lock(&storageLock);
+    struct Recording *rec = storage_find(id);
+    if (rec)
+        rec->open = false;
+    pthread_cond_signal(&storageCond);
+    pthread_mutex_unlock(&storageLock);
+}
+
+bool storage_contains(const char *name) {
+    bool found = false;
+    pthread_mutex_lock(&storageLock);
+    for (unsigned int i = 0; i < catalogCount && !found; i++)
+        found = !strcmp(catalog[i].name, name);
+    pthread_mutex_unlock(&storageLock);
+    return found;
+}
+
+char *storage_json() {
+    pthread_mutex_lock(&storageLock);
+    size_t size = 256 + catalogCount * 160;
+    char *json = malloc(size);
+    if (!json) {
+        pthread_mutex_unlock(&storageLock);
+        return NULL;
+    }
+    int len = sprintf(json,
+        "{\"quota\":%llu,\"used\":%llu,\"free\":%llu,\"records\":[",
+        (unsigned long long)storageQuota, (unsigned long long)storageUsed,
+        (unsigned long long)storageFree);
+    for (unsigned int i = 0; i < catalogCount; i++) {
+        struct Recording *rec = &catalog[i];
+        len += sprintf(json + len,
+            "%s{\"name\":\"%s\",\"start\":%lld,\"end\":%lld,\"size\":%llu,"
+            "\"keyframes\":%u,\"open\":%s}",
+            i ? "," : "", rec->name, (long long)rec->start,
+            (long long)rec->end, (unsigned long long)rec->size,
+            rec->keyframes, rec->open ? "true" : "false");
+    }
+    sprintf(json + len, "]}");
+    pthread_mutex_unlock(&storageLock);
+    return json;
+}
+
+static uint32_t storage_be32(const unsigned char *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// Keyframes of a finished file, as listed by the mfra at its end
+static unsigned int storage_count_keyframes(const char *path, off_t size) {
+    unsigned char buf[32];
+    unsigned int count = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return 0;
+
+    if (size >= 16 && pread(fd, buf, 16, size - 16) == 16 &&
+        !memcmp(buf + 4, "mfro", 4)) {
+        uint32_t mfra = storage_be32(buf + 12);
+        if (mfra >= sizeof(buf) && mfra <= size &&
+            pread(fd, buf, sizeof(buf), size - mfra) == sizeof(buf) &&
+            !memcmp(buf + 4, "mfra", 4) && !memcmp(buf + 12, "tfra", 4))
+            count = storage_be32(buf + 28);
+    }
+    close(fd);
+    return count;
+}
+
+static int storage_compare(const void *a, const void *b) {
+    const struct Recording *x = a, *y = b;
+    if (x->start != y->start)
+        return x->start < y->start ? -1 : 1;
+    return strcmp(x->name, y->name);
+}
+
+// The only time the directory gets listed, files left from earlier runs are
+// picked up by their names
+static void storage_scan() {
+    char path[sizeof(app_config.record_path) + 32];
+    struct dirent *entry;
+
+    mkdir(app_config.record_path, 0755);
+    DIR *dir = opendir(app_config.record_path);
+    if (!dir) {
+        printf(tag "Can't open %s: %s\n",
+            app_config.record_path, strerror(errno));
+        return;
+    }
+
+    while ((entry = readdir(dir))) {
+        struct tm tm = {0};
+        struct stat st;
+        int end = 0;
+        size_t len = strlen(entry->d_name);
+        if (len >= sizeof(catalog->name) || len < 4 ||
+            strcmp(entry->d_name + len - 4, ".mp4") ||
+            sscanf(entry->d_name, "%4d%2d%2d-%2d%2d%2d%n", &tm.tm_year,
+                &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+                &tm.tm_sec, &end) != 6 || end != 15)
+            continue;
+        storage_join(path, sizeof(path), entry->d_name);
+        if (stat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+
+        struct Recording *rec = storage_append();
+        if (!rec)
+            break;
+        tm.tm_year -= 1900;
+        tm.tm_mon--;
+        tm.tm_isdst = -1;
+        memcpy(rec->name, entry->d_name, len + 1);
+        rec->start = mktime(&tm);
+        rec->end = st.st_mtime;
+        rec->size = st.st_size;
+        rec->keyframes = storage_count_keyframes(path, st.st_size);
+        storageUsed += rec->size;
+    }
+    closedir(dir);
+
+    // Ids follow the order of recording, as with the files to come
+    qsort(catalog, catalogCount, sizeof(struct Recording), storage_compare);
+    for (unsigned int i = 0; i < catalogCount; i++)
+        catalog[i].id = i + 1;
+    nextId = catalogCount + 1;
+    printf(tag "%u recordings taking %llu MB\n", catalogCount,
+        (unsigned long long)(storageUsed >> 20));
+}
+
+// Deletes the oldest files while the recordings go over their quota or
+// the card lacks room for the next file, called with the lock held
+static void storage_evict() {
+    char path[sizeof(app_config.record_path) + 32];
+    struct statvfs fs;
+
+    pthread_mutex_unlock(&storageLock);
+    bool known = !statvfs(app_config.record_path, &fs);
+    pthread_mutex_lock(&storageLock);
+
+    uint64_t quota = 0, avail = 0;
+    if (known) {
+        avail = (uint64_t)fs.f_bavail * fs.f_frsize;
+        if (app_config.record_quota_percent)
+            quota = (uint64_t)fs.f_blocks * fs.f_frsize / 100 *
+                app_config.record_quota;
+    }
+    if (!app_config.record_quota_percent)
+        quota = (uint64_t)app_config.record_quota << 20;
+    storageQuota = quota;
+    storageFree = avail;
+
+    // Same as what the recorder reserves for each file
+    uint64_t reserve = (uint64_t)app_config.mp4_bitrate * 1024 / 8 *
+        app_config.record_file_duration * 60;
+    reserve += reserve / 8;
+
+    while (catalogCount && !catalog[0].open &&
+        ((quota && storageUsed > quota) || (known && avail < reserve))) {
+        unsigned int id = catalog[0].id;
+        storage_join(path, sizeof(path), catalog[0].name);
+
+        // Files that can't go stay listed and counted, the next pass tries
+        // again
+        pthread_mutex_unlock(&storageLock);
+        bool deleted = !unlink(path) || errno == ENOENT;
+        if (deleted)
+            printf(tag "Deleted %s to make room\n", path);
+        else
+            printf(tag "Can't delete %s: %s\n", path, strerror(errno));
+        pthread_mutex_lock(&storageLock);
+        if (!deleted)
+            break;
+
+        struct Recording *rec = storage_find(id);
+        if (rec) {
+            avail += rec->size;
+            storage_drop(rec);
+        }
+    }
+    storageFree = avail;
+}
+
+static void *storage_thread(void *arg) {
+    pthread_mutex_lock(&storageLock);
+    while (!storageStop) {
+        storage_evict();
+        if (storageStop)
+            break;
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += STORAGE_CHECK_S;
+        pthread_cond_timedwait(&storageCond, &storageLock, &ts);
+    }
+    pthread_mutex_unlock(&storageLock);
+    return NULL;
+}
+
+int start_storage() {
+    storage_scan();
+    storageStop = false;
+
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    size_t stacksize;
+    pthread_attr_getstacksize(&thread_attr, &stacksize);
+    size_t new_stacksize = 16 * 1024;
+    if (pthread_attr_setstacksize(&thread_attr, new_stacksize)) {
+        printf(tag "Can't set stack size %zu\n", new_stacksize);
+    }
+    if (pthread_create(&storagePid, &thread_attr, storage_thread, NULL)) {
+        printf(tag "Starting the storage thread failed!\n");
+        pthread_attr_destroy(&thread_attr);
+        return EXIT_FAILURE;
+    }
+    if (pthread_attr_setstacksize(&thread_attr, stacksize)) {
+        printf(tag "Error:  Can't set stack size %zu\n", stacksize);
+    }
+    pthread_attr_destroy(&thread_attr);
+    return EXIT_SUCCESS;
+}
+
+void stop_storage() {
+    if (!storagePid)
+        return;
+    pthread_mutex_lock(&storageLock);
+    storageStop = true;
+    pthread_cond_signal(&storageCond);
+    pthread_mutex_unlock(&storageLock);
+    pthread_join(storagePid, NULL);
+    storagePid = 0;
+
+    free(catalog);
+    catalog = NULL;
+    catalogCount = catalogCap = 0;
+    storageUsed = 0;
+}
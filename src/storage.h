@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+
+extern char keepRunning;
+
+// Catalog of the recordings under the record path, read from the card once
+// at startup and then kept up to date by the recorder. A thread of its own
+// deletes the oldest files whenever the quota or the free space of the
+// card runs out.
+int start_storage();
+void stop_storage();
+
+// A new file is about to be recorded, gives the id it goes by from then on
+// or 0 when the catalog has no room left
+unsigned int storage_add(time_t start);
+void storage_remove(unsigned int id);
+// Full path of a file, false once it has left the catalog
+bool storage_path(unsigned int id, char *path, size_t size);
+void storage_keyframe(unsigned int id);
+void storage_written(unsigned int id, uint64_t size);
+void storage_close(unsigned int id);
+
+// Whether a file name belongs to a recording of the catalog
+bool storage_contains(const char *name);
+// The catalog as a JSON document, to be freed by the caller
+char *storage_json();
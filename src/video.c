@@ -5,11 +5,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "error.h"
+#include "frame.h"
 #include "http_post.h"
 #include "jpeg.h"
+#include "mp4/mp4.h"
+#include "record.h"
 #include "rtsp/ringfifo.h"
 #include "rtsp/rtputils.h"
 #include "rtsp/rtspservice.h"
@@ -18,61 +22,47 @@
 pthread_mutex_t mutex;
 pthread_t ispPid = 0;
 pthread_t vencPid = 0;
+int mp4Chn = -1;
 
 int save_stream(char index, hal_vidstream *stream) {
-    int ret;
+    struct Frame *frame = frame_create(chnState[index].payload, stream);
+    if (!frame)
+        return EXIT_FAILURE;
 
-    switch (chnState[index].payload) {
+    switch (frame->codec) {
         case HAL_VIDCODEC_H264:
+        case HAL_VIDCODEC_H265:
             if (app_config.mp4_enable) {
-                send_mp4_to_client(index, stream);
-                send_h264_to_client(index, stream);
+                bool ready;
+                gop_cache_put(frame);
+                preroll_put(frame);
+                if (set_frame(frame, &ready) == BUF_OK && ready) {
+                    send_mp4_to_client(index);
+                    if (app_config.record_enable)
+                        record_fragment();
+                }
+                send_h264_to_client(index, frame);
             }
             if (app_config.rtsp_enable)
-                put_h264_data_to_buffer(stream);
+                put_h264_data_to_buffer(frame);
             break;
         case HAL_VIDCODEC_MJPG:
             if (app_config.mjpeg_enable) {
-                static char *mjpeg_buf;
-                static ssize_t mjpeg_buf_size = 0;
-                ssize_t buf_size = 0;
-                for (unsigned int i = 0; i < stream->count; i++) {
-                    hal_vidpack *data = &stream->pack[i];
-                    ssize_t need_size = buf_size + data->length - data->offset + 2;
-                    if (need_size > mjpeg_buf_size) {
-                        mjpeg_buf = realloc(mjpeg_buf, need_size);
-                        mjpeg_buf_size = need_size;
-                    }
-                    memcpy(mjpeg_buf + buf_size, data->data + data->offset,
-                        data->length - data->offset);
-                    buf_size += data->length - data->offset;
-                }
-                send_mjpeg(index, mjpeg_buf, buf_size);
+                send_mjpeg(index, frame);
+                if (app_config.rtsp_enable)
+                    put_mjpeg_data_to_buffer(frame);
             }
             break;
         case HAL_VIDCODEC_JPG:
-        {
-            static char *jpeg_buf;
-            static ssize_t jpeg_buf_size = 0;
-            ssize_t buf_size = 0;
-            for (unsigned int i = 0; i < stream->count; i++) {
-                hal_vidpack *data = &stream->pack[i];
-                ssize_t need_size = buf_size + data->length - data->offset + 2;
-                if (need_size > jpeg_buf_size) {
-                    jpeg_buf = realloc(jpeg_buf, need_size);
-                    jpeg_buf_size = need_size;
-                }
-                memcpy(jpeg_buf + buf_size, data->data + data->offset,
-                    data->length - data->offset);
-                buf_size += data->length - data->offset;
-            }
             if (app_config.jpeg_enable)
-                send_jpeg(index, jpeg_buf, buf_size);
+                send_jpeg(index, frame);
             break;
-        }
         default:
+            frame_unref(frame);
             return EXIT_FAILURE;
     }
+
+    frame_unref(frame);
     return EXIT_SUCCESS;
 }
 
@@ -121,6 +111,59 @@ void set_grayscale(bool active) {
     pthread_mutex_unlock(&mutex);
 }
 
+// Applied on the fly to the MP4 channel, in kbits per second
+int set_video_bitrate(unsigned int bitrate) {
+    int ret = EXIT_FAILURE;
+
+    if (mp4Chn < 0)
+        return EXIT_FAILURE;
+
+    pthread_mutex_lock(&mutex);
+    switch (plat) {
+        case HAL_PLATFORM_I6: ret = i6_encoder_set_bitrate(mp4Chn, bitrate); break;
+        case HAL_PLATFORM_I6C: ret = i6c_encoder_set_bitrate(mp4Chn, bitrate); break;
+        case HAL_PLATFORM_I6F: ret = i6f_encoder_set_bitrate(mp4Chn, bitrate); break;
+        case HAL_PLATFORM_V3: ret = v3_encoder_set_bitrate(mp4Chn, bitrate); break;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
+// Requests closer together than this are served by the IDR already on its way
+#define IDR_MIN_INTERVAL 1000
+
+// Forces an IDR frame out of the MP4 channel for a viewer to start on,
+// without flooding the stream with keyframes when many of them join at once
+int request_idr(void) {
+    static unsigned long long last = 0;
+    struct timespec ts;
+    unsigned long long now;
+    int ret = EXIT_FAILURE;
+
+    if (mp4Chn < 0)
+        return EXIT_FAILURE;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+    pthread_mutex_lock(&mutex);
+    if (last && now - last < IDR_MIN_INTERVAL) {
+        pthread_mutex_unlock(&mutex);
+        return EXIT_SUCCESS;
+    }
+    switch (plat) {
+        case HAL_PLATFORM_I6: ret = i6_encoder_request_idr(mp4Chn); break;
+        case HAL_PLATFORM_I6C: ret = i6c_encoder_request_idr(mp4Chn); break;
+        case HAL_PLATFORM_I6F: ret = i6f_encoder_request_idr(mp4Chn); break;
+        case HAL_PLATFORM_V3: ret = v3_encoder_request_idr(mp4Chn); break;
+    }
+    if (!ret)
+        last = now;
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
+
 int create_vpss_chn(char index, short width, short height, char framerate, char jpeg) {
     switch (plat) {
         case HAL_PLATFORM_I6: return i6_channel_create(index, width, height,
@@ -249,6 +292,12 @@ int start_sdk() {
     if (app_config.mp4_enable) {
         int index = take_next_free_channel(true);
 
+        set_mp4_config(app_config.mp4_codec_h265 ?
+            HAL_VIDCODEC_H265 : HAL_VIDCODEC_H264, app_config.mp4_width,
+            app_config.mp4_height, app_config.mp4_fps);
+        set_mp4_fragment(app_config.mp4_low_latency ?
+            0 : app_config.mp4_fragment_duration);
+
         if (ret = create_vpss_chn(index, app_config.mp4_width, 
             app_config.mp4_height, app_config.mp4_fps, 0)) {
             fprintf(stderr, 
@@ -261,9 +310,12 @@ int start_sdk() {
             hal_vidconfig config;
             config.width = app_config.mp4_width;
             config.height = app_config.mp4_height;
-            config.codec = HAL_VIDCODEC_H264;
+            config.codec = app_config.mp4_codec_h265 ?
+                HAL_VIDCODEC_H265 : HAL_VIDCODEC_H264;
             config.mode = HAL_VIDMODE_CBR;
-            config.profile = HAL_VIDPROFILE_HIGH;
+            // H.265 has no high profile, its main one is what decoders take
+            config.profile = app_config.mp4_codec_h265 ?
+                HAL_VIDPROFILE_MAIN : HAL_VIDPROFILE_HIGH;
             config.gop = app_config.mp4_fps * 2;
             config.framerate = app_config.mp4_fps;
             config.bitrate = app_config.mp4_bitrate;
@@ -290,6 +342,7 @@ int start_sdk() {
                 index, ret, errstr(ret));
             return EXIT_FAILURE;
         }
+        mp4Chn = index;
     }
 
     if (app_config.mjpeg_enable) {
@@ -381,6 +434,7 @@ int start_sdk() {
 
 int stop_sdk() {
     pthread_join(vencPid, NULL);
+    gop_cache_clear();
 
     if (app_config.jpeg_enable)
         jpeg_deinit();
@@ -10,6 +10,8 @@ bool channel_is_enabled(char index);
 bool channel_main_loop(char index);
 void set_channel_disable(char index);
 void set_grayscale(bool active);
+int set_video_bitrate(unsigned int bitrate);
+int request_idr(void);
 
 int create_vpss_chn(char index, short width, short height, char framerate, char jpeg);
 int bind_vpss_venc(char index, char framerate, char jpeg);